@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "windows.h"
+#include "Bench.h"
+#include "Crc32.h"
+#include "HexFile.h"
+#include "Session.h"
+#include "Sim.h"
+#include "Usb.h"
+#include "pic32mx.h"
+
+//
+// A case regresses if it needs more than BENCH_TOLERANCE percent more
+// turnarounds or bytes on the wire than its baseline.
+//
+#define BENCH_TOLERANCE        2
+
+#define MAX_BENCH_RESULTS      128
+
+/*
+ * A synthetic image: "size" bytes from "start", of which about "density"
+ * percent (in 16 byte lines) hold data.
+ */
+typedef struct {
+	const char *name;
+	FAMILY family;
+	unsigned int start;
+	unsigned int size;
+	int density;
+	bool crc;
+} BENCH_CASE;
+
+static const BENCH_CASE bench_cases[] = {
+	{ "pic16-1k-dense",     FAMILY_PIC16, 0x0000,    0x0400, 100, false },
+	{ "pic16-4k-dense",     FAMILY_PIC16, 0x0000,    0x1000, 100, false },
+	{ "pic16-4k-sparse",    FAMILY_PIC16, 0x0000,    0x1000, 25,  false },
+	{ "pic16-4k-dense-crc", FAMILY_PIC16, 0x0000,    0x1000, 100, true  },
+	{ "pic18-4k-dense",     FAMILY_PIC18, 0x0000,    0x1000, 100, false },
+	{ "pic18-32k-dense",    FAMILY_PIC18, 0x0000,    0x8000, 100, false },
+	{ "pic18-32k-sparse",   FAMILY_PIC18, 0x0000,    0x8000, 10,  false },
+	{ "pic18-32k-dense-crc",FAMILY_PIC18, 0x0000,    0x8000, 100, true  },
+	{ "pic32-4k-dense",     FAMILY_PIC32, PFM_START, 0x1000, 100, false },
+	{ "pic32-32k-dense",    FAMILY_PIC32, PFM_START, 0x8000, 100, false },
+	{ "pic32-32k-sparse",   FAMILY_PIC32, PFM_START, 0x8000, 10,  false },
+	{ "pic32-32k-dense-crc",FAMILY_PIC32, PFM_START, 0x8000, 100, true  },
+};
+
+/*
+ * The cost of one operation on one case.
+ */
+typedef struct {
+	char name[64];
+	char operation[16];
+	unsigned int bytes;
+	unsigned int turnarounds;
+	unsigned int packets;
+	unsigned int wire_bytes;
+	double cpu_ms;
+	double modelled_ms;
+	bool ok;
+} BENCH_RESULT;
+
+//===========================================================================
+//
+// Name    : CpuTime
+//
+// Desc    : Tells how much CPU time (user and kernel) the process has used.
+//
+// Returns : The CPU time in milliseconds.
+//
+//===========================================================================
+static double CpuTime()
+{
+	FILETIME creation, exit, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+	{
+		return 0;
+	}
+
+	unsigned long long k = ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+	unsigned long long u = ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime;
+	return (k + u) / 10000.0;
+}
+
+//===========================================================================
+//
+// Name    : CreateSyntheticImage
+//
+// Desc    : Fills the "memory_segments" array with the pseudo random image
+//           described by "bench_case". The same case always gives the same
+//           image. PIC16 words only have 14 bits.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void CreateSyntheticImage(const BENCH_CASE *bench_case)
+{
+	unsigned int seed = Crc32((const unsigned char *)bench_case->name, strlen(bench_case->name), 0);
+
+	g_number_of_segments = 0;
+	for (unsigned int offset = 0; offset < bench_case->size; offset += MAX_SEGMENT_LENGTH)
+	{
+		seed = seed * 1103515245 + 12345;
+		if ((int)((seed >> 16) % 100) >= bench_case->density)
+		{
+			continue;
+		}
+
+		SEGMENT *segment = &g_memory_segment[g_number_of_segments++];
+		segment->address = bench_case->start + offset;
+		segment->length = MAX_SEGMENT_LENGTH;
+		for (int i = 0; i < MAX_SEGMENT_LENGTH; i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			segment->bytes[i] = (unsigned char)(seed >> 16);
+			if (bench_case->family == FAMILY_PIC16 && i % 2)
+			{
+				segment->bytes[i] &= 0x3f;
+			}
+		}
+	}
+}
+
+//===========================================================================
+//
+// Name    : Measure
+//
+// Desc    : Runs "operation" of "bench_case" (one of "erase", "program",
+//           "verify", "read" or "id") in a session of its own and records
+//           what it cost, not counting the session itself, in "result".
+//
+// Returns : True if the operation succeeded, false otherwise.
+//
+//===========================================================================
+static bool Measure(const FAMILY_OPERATIONS *operations, const BENCH_CASE *bench_case, const char *operation, BENCH_RESULT *result)
+{
+	//
+	// The session is opened outside the measurement, as how long Vpp takes
+	// to settle depends on the (simulated) clock rather than the protocol.
+	//
+	bool begun = operations->begin_session();
+	bool ok = begun;
+
+	memset(&g_usb_statistics, 0, sizeof(g_usb_statistics));
+	double cpu_start = CpuTime();
+	double sim_start = SimTime();
+
+	if (strcmp(operation, "erase") == 0)
+	{
+		ok = ok && operations->erase();
+	}
+	else if (strcmp(operation, "program") == 0)
+	{
+		ok = ok && operations->program();
+	}
+	else if (strcmp(operation, "verify") == 0)
+	{
+		ok = ok && operations->verify();
+	}
+	else if (strcmp(operation, "read") == 0)
+	{
+		unsigned char *buffer = (unsigned char *)malloc(bench_case->size);
+		ok = ok && operations->read_memory(bench_case->start, buffer, bench_case->size);
+		free(buffer);
+	}
+	else
+	{
+		unsigned int device_id;
+		ok = ok && operations->read_device_id(&device_id);
+	}
+	double cpu_end = CpuTime();
+	double sim_end = SimTime();
+	USB_STATISTICS statistics = g_usb_statistics;
+
+	if (begun)
+	{
+		ok = operations->end_session() && ok;
+	}
+
+	strncpy(result->name, bench_case->name, sizeof(result->name) - 1);
+	result->name[sizeof(result->name) - 1] = 0;
+	strncpy(result->operation, operation, sizeof(result->operation) - 1);
+	result->operation[sizeof(result->operation) - 1] = 0;
+	result->bytes = bench_case->size;
+	result->turnarounds = statistics.turnarounds;
+	result->packets = statistics.packets_sent + statistics.packets_received;
+	result->wire_bytes = statistics.bytes_sent + statistics.bytes_received;
+	result->cpu_ms = cpu_end - cpu_start;
+	result->modelled_ms = sim_end - sim_start;
+	result->ok = ok;
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : WriteResults
+//
+// Desc    : Writes the "count" results as JSON to the file "name", one case
+//           per line so that CompareWithBaseline can read it back.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool WriteResults(const char *name, const BENCH_RESULT *results, int count)
+{
+	FILE *file = NULL;
+	if (fopen_s(&file, name, "w") != 0 || file == NULL)
+	{
+		printf ("*** Failed to create \"%s\".\n", name);
+		return false;
+	}
+
+	fprintf(file, "{\n  \"results\": [\n");
+	for (int i = 0; i < count; i++)
+	{
+		const BENCH_RESULT *r = &results[i];
+		fprintf(file,
+				"    {\"name\": \"%s\", \"operation\": \"%s\", \"bytes\": %u, \"turnarounds\": %u, \"packets\": %u, \"wire_bytes\": %u, "
+				"\"cpu_ms\": %.2f, \"modelled_ms\": %.2f, \"modelled_ms_per_kb\": %.2f, \"ok\": %s}%s\n",
+				r->name,
+				r->operation,
+				r->bytes,
+				r->turnarounds,
+				r->packets,
+				r->wire_bytes,
+				r->cpu_ms,
+				r->modelled_ms,
+				r->modelled_ms * 1024 / r->bytes,
+				r->ok ? "true" : "false",
+				i + 1 < count ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	fclose(file);
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : Field
+//
+// Desc    : Finds the value of "key" in a line written by WriteResults.
+//
+// Returns : The start of the value, or an empty string if there is none.
+//
+//===========================================================================
+static const char *Field(const char *line, const char *key)
+{
+	char pattern[32];
+	snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+
+	const char *value = strstr(line, pattern);
+	return value != NULL ? value + strlen(pattern) : "";
+}
+
+//===========================================================================
+//
+// Name    : StringField
+//
+// Desc    : Copies the string value of "key" in a line written by
+//           WriteResults to "value", which has room for "size" bytes.
+//
+// Returns : True if the line has the key, false otherwise.
+//
+//===========================================================================
+static bool StringField(const char *line, const char *key, char *value, int size)
+{
+	const char *start = Field(line, key);
+	if (*start++ != '"')
+	{
+		return false;
+	}
+
+	int length = 0;
+	while (start[length] != 0 && start[length] != '"' && length < size - 1)
+	{
+		value[length] = start[length];
+		length++;
+	}
+	value[length] = 0;
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : CompareWithBaseline
+//
+// Desc    : Reads the results written by an earlier run from the file
+//           "name" and compares the "count" results of this run with them.
+//           Cases missing from the baseline are not compared.
+//
+// Returns : True if no case regressed, false otherwise.
+//
+//===========================================================================
+static bool CompareWithBaseline(const char *name, const BENCH_RESULT *results, int count)
+{
+	FILE *file = NULL;
+	if (fopen_s(&file, name, "r") != 0 || file == NULL)
+	{
+		printf ("*** Failed to open the baseline \"%s\".\n", name);
+		return false;
+	}
+
+	int regressions = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char case_name[64];
+		char operation[16];
+		if (!StringField(line, "name", case_name, sizeof(case_name))
+			|| !StringField(line, "operation", operation, sizeof(operation)))
+		{
+			continue;
+		}
+		unsigned int turnarounds = strtoul(Field(line, "turnarounds"), NULL, 10);
+		unsigned int wire_bytes = strtoul(Field(line, "wire_bytes"), NULL, 10);
+
+		for (int i = 0; i < count; i++)
+		{
+			const BENCH_RESULT *r = &results[i];
+			if (strcmp(r->name, case_name) != 0 || strcmp(r->operation, operation) != 0)
+			{
+				continue;
+			}
+			if (r->turnarounds * 100 > turnarounds * (100 + BENCH_TOLERANCE)
+				|| r->wire_bytes * 100 > wire_bytes * (100 + BENCH_TOLERANCE))
+			{
+				printf ("*** Regression in %s %s: %u turnarounds and %u bytes, the baseline has %u and %u.\n",
+						r->name, r->operation, r->turnarounds, r->wire_bytes, turnarounds, wire_bytes);
+				regressions++;
+			}
+		}
+	}
+	fclose(file);
+
+	if (regressions == 0)
+	{
+		printf ("No regressions against %s.\n", name);
+	}
+	return regressions == 0;
+}
+
+//===========================================================================
+//
+// Name    : RunBenchmark
+//
+// Desc    : Erases, programs, verifies, reads back and identifies a set of
+//           synthetic images of different sizes and densities on each
+//           family, and records the turnarounds, packets and bytes on the
+//           wire, the host CPU time and the modelled wall time of each. The
+//           results are written as JSON to "results_name" and, unless
+//           "baseline_name" is NULL, compared with an earlier run. Meant to
+//           be run against the simulated programmer.
+//
+// Returns : True if all operations succeeded and nothing regressed, false
+//           otherwise.
+//
+//===========================================================================
+bool RunBenchmark(const char *results_name, const char *baseline_name)
+{
+	static const char *bench_operations[] = {"erase", "program", "verify", "read", "id"};
+
+	BENCH_RESULT *results = (BENCH_RESULT *)malloc(MAX_BENCH_RESULTS * sizeof(BENCH_RESULT));
+	int count = 0;
+	bool ok = true;
+
+	for (unsigned int c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++)
+	{
+		const BENCH_CASE *bench_case = &bench_cases[c];
+		const FAMILY_OPERATIONS *operations = FamilyOperations(bench_case->family);
+
+		CreateSyntheticImage(bench_case);
+		g_crc_verify = bench_case->crc;
+
+		for (unsigned int o = 0; o < sizeof(bench_operations) / sizeof(bench_operations[0]) && count < MAX_BENCH_RESULTS; o++)
+		{
+			BENCH_RESULT *r = &results[count++];
+			if (!Measure(operations, bench_case, bench_operations[o], r))
+			{
+				printf ("*** %s %s failed.\n", bench_case->name, bench_operations[o]);
+				ok = false;
+			}
+		}
+	}
+	g_crc_verify = false;
+
+	printf ("\n%-22s %-8s %8s %8s %8s %10s %10s %10s\n", "Case", "Op", "Bytes", "Turns", "Packets", "Wire", "CPU ms", "ms/KB");
+	for (int i = 0; i < count; i++)
+	{
+		const BENCH_RESULT *r = &results[i];
+		printf ("%-22s %-8s %8u %8u %8u %10u %10.2f %10.2f\n",
+				r->name, r->operation, r->bytes, r->turnarounds, r->packets, r->wire_bytes, r->cpu_ms, r->modelled_ms * 1024 / r->bytes);
+	}
+
+	ok = WriteResults(results_name, results, count) && ok;
+	if (baseline_name != NULL)
+	{
+		ok = CompareWithBaseline(baseline_name, results, count) && ok;
+	}
+
+	free(results);
+	return ok;
+}
@@ -0,0 +1,12 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+bool RunBenchmark(const char *results_name, const char *baseline_name);
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "Capabilities.h"
+#include "Commands.h"
+#include "Usb.h"
+
+/*
+ * The capabilities of the programmer, queried once it has been asked.
+ */
+static unsigned int capabilities = 0;
+static bool capabilities_known = false;
+
+//===========================================================================
+//
+// Name    : Capabilities
+//
+// Desc    : Asks the programmer which optional protocol features it
+//           supports. The programmer answers with "CAPS" followed by a four
+//           byte, little endian, mask of CAPABILITY_* bits. Firmware that
+//           predates the command does not answer at all, so we only wait
+//           briefly and then assume it supports nothing optional. Anything
+//           else that has arrived by then is thrown away, so that it is not
+//           taken as the answer to the next command. If the command
+//           cannot be sent, nothing is assumed and the next call asks again.
+//
+// Returns : The CAPABILITY_* bits supported.
+//
+//===========================================================================
+unsigned int Capabilities()
+{
+	if (capabilities_known)
+	{
+		return capabilities;
+	}
+
+	unsigned char command[] = {GETCAPABILITIES};
+	if (!SetReceiveTimeout(100) || !Send(command, 1))
+	{
+		//
+		// Not asked, so ask again next time.
+		//
+		SetReceiveTimeout(1000);
+		return capabilities;
+	}
+
+	unsigned char response[64];
+	int bytes_received = 64;
+	if (Receive(response, &bytes_received)
+		&& bytes_received == 8
+		&& response[0] == 'C'
+		&& response[1] == 'A'
+		&& response[2] == 'P'
+		&& response[3] == 'S')
+	{
+		capabilities = response[4] | (response[5] << 8) | (response[6] << 16) | ((unsigned int)response[7] << 24);
+	}
+	DiscardResponses();
+	SetReceiveTimeout(1000);
+	capabilities_known = true;
+
+	return capabilities;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef CAPABILITIES_H
+#define CAPABILITIES_H
+
+//
+// Optional protocol features the programmer firmware may support, as
+// reported by the GETCAPABILITIES command.
+//
+#define CAPABILITY_READ_CRCS      0x00000001  // READCRCS, COMMAND_READ_CRCS and READCRCS_16.
+#define CAPABILITY_ROW_PIPELINE   0x00000002  // COMMAND_SEND_BUFFER_WORDS and COMMAND_PROGRAM_BUFFER.
+#define CAPABILITY_PAGE_ERASE     0x00000004  // COMMAND_ERASE_PAGE.
+#define CAPABILITY_VDD_VPP_ON     0x00000008  // VDDVPPON and VDDVPPON_16.
+#define CAPABILITY_PACKED_ROWS    0x00000010  // COMMAND_SEND_BUFFER_PACKED.
+#define CAPABILITY_EEPROM         0x00000020  // READEEPROM, PROGRAMEEPROM, READEEPROM_16 and PROGRAMEEPROM_16.
+
+unsigned int Capabilities();
+
+#endif
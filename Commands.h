@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+//
+// The commands sent from the PC to the programmer. The PIC18F commands are
+// in the range 0x00 - 0x0f, the PIC32MX commands in the range 0x10 - 0x1f,
+// the PIC16F commands in the range 0x20 - 0x2f and commands common to all
+// families in the range 0x30 - 0x3f.
+//
+#define READBYTES			0x00
+#define	PROGRAMBYTES		0x01
+#define	PROGRAMCONFIGBYTE	0x02
+#define ERASE				0x03
+#define VDDON				0x04
+#define VPPON				0x05
+#define VPPVDDOFF			0x06
+#define READEEPROM			0x07
+#define PROGRAMEEPROM		0x08
+#define READCRCS			0x09
+#define VDDVPPON			0x0a
+
+#define COMMAND_CHECK_DEVICE                 0x10
+#define COMMAND_ERASE						 0x11
+#define COMMAND_ENTER_SERIAL_EXECUTION_MODE  0x12
+#define COMMAND_EXIT_PROGRAMMING_MODE        0x13
+#define COMMAND_READ_WORDS                   0x15
+#define COMMAND_SEND_WORDS                   0x16
+#define COMMAND_PROGRAM_WORDS                0x17
+#define COMMAND_READ_CRCS                    0x18
+#define COMMAND_SEND_BUFFER_WORDS            0x19
+#define COMMAND_PROGRAM_BUFFER               0x1a
+#define COMMAND_ERASE_PAGE                   0x1b
+#define COMMAND_SEND_BUFFER_PACKED           0x1c
+
+#define READBYTES_16			0x20
+#define	PROGRAMBYTES_16			0x21
+#define	PROGRAMCONFIGWORD_16	0x22
+#define ERASE_16				0x23
+#define VDDON_16				0x24
+#define VPPON_16				0x25
+#define VPPVDDOFF_16			0x26
+#define READEEPROM_16			0x27
+#define PROGRAMEEPROM_16		0x28
+#define READCRCS_16				0x29
+#define VDDVPPON_16				0x2a
+
+#define GETCAPABILITIES			0x30
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "string.h"
+#include "Crc32.h"
+
+bool g_crc_verify = false;
+
+/*
+ * The IEEE 802.3 CRC32 (as used by zip and friends), reflected polynomial
+ * 0xedb88320. The table is built the first time it is needed.
+ */
+static unsigned int crc_table[256];
+static bool crc_table_built = false;
+
+//===========================================================================
+//
+// Name    : Crc32
+//
+// Desc    : Calculates the CRC32 of "length" bytes in "bytes". To calculate
+//           the CRC32 of data in several pieces, pass the CRC32 of the
+//           previous pieces in "crc".
+//
+// Returns : The CRC32.
+//
+//===========================================================================
+unsigned int Crc32(const unsigned char *bytes, unsigned int length, unsigned int crc)
+{
+	if (!crc_table_built)
+	{
+		for (unsigned int i = 0; i < 256; i++)
+		{
+			unsigned int c = i;
+			for (int bit = 0; bit < 8; bit++)
+			{
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			}
+			crc_table[i] = c;
+		}
+		crc_table_built = true;
+	}
+
+	crc = ~crc;
+	for (unsigned int i = 0; i < length; i++)
+	{
+		crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+//===========================================================================
+//
+// Name    : Gf2Times
+//
+// Desc    : Multiplies the 32x32 bit matrix "matrix" (one column per word)
+//           with the bit vector "vector" over GF(2).
+//
+// Returns : The product.
+//
+//===========================================================================
+static unsigned int Gf2Times(const unsigned int *matrix, unsigned int vector)
+{
+	unsigned int sum = 0;
+	for (int i = 0; vector != 0; i++, vector >>= 1)
+	{
+		if (vector & 1)
+		{
+			sum ^= matrix[i];
+		}
+	}
+	return sum;
+}
+
+//===========================================================================
+//
+// Name    : Gf2Square
+//
+// Desc    : Puts the square of the 32x32 bit matrix "matrix" in "square".
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void Gf2Square(unsigned int *square, const unsigned int *matrix)
+{
+	for (int i = 0; i < 32; i++)
+	{
+		square[i] = Gf2Times(matrix, matrix[i]);
+	}
+}
+
+//===========================================================================
+//
+// Name    : Crc32Shift
+//
+// Desc    : Prepares "shift" for combining CRC32s of pieces that are
+//           "length" bytes long (see Crc32Combine). This is the zlib
+//           crc32_combine operator, built once so that each combine is a
+//           single matrix multiplication.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void Crc32Shift(CRC32_SHIFT *shift, unsigned int length)
+{
+	unsigned int odd[32];
+	unsigned int even[32];
+
+	//
+	// The operator for one zero bit, then for two and four zero bits.
+	//
+	odd[0] = 0xedb88320;
+	for (int i = 1; i < 32; i++)
+	{
+		odd[i] = 1u << (i - 1);
+	}
+	Gf2Square(even, odd);
+	Gf2Square(odd, even);
+
+	//
+	// Multiply the operators for each set bit of the length in bytes,
+	// starting with the one for a single zero byte.
+	//
+	for (int i = 0; i < 32; i++)
+	{
+		shift->matrix[i] = 1u << i;
+	}
+	unsigned int *square = even;
+	unsigned int *operator_ = odd;
+	while (length != 0)
+	{
+		Gf2Square(square, operator_);
+		if (length & 1)
+		{
+			unsigned int product[32];
+			for (int i = 0; i < 32; i++)
+			{
+				product[i] = Gf2Times(square, shift->matrix[i]);
+			}
+			memcpy(shift->matrix, product, sizeof(product));
+		}
+		length >>= 1;
+
+		unsigned int *swap = square;
+		square = operator_;
+		operator_ = swap;
+	}
+}
+
+//===========================================================================
+//
+// Name    : Crc32Combine
+//
+// Desc    : Calculates the CRC32 of two pieces of data one after the other
+//           from "crc1", the CRC32 of the first piece, and "crc2", the CRC32
+//           of the second, whose length "shift" was prepared for.
+//
+// Returns : The CRC32 of both pieces.
+//
+//===========================================================================
+unsigned int Crc32Combine(const CRC32_SHIFT *shift, unsigned int crc1, unsigned int crc2)
+{
+	return Gf2Times(shift->matrix, crc1) ^ crc2;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef CRC32_H
+#define CRC32_H
+
+/*
+ * If true, verification asks the programmer for CRC32s of the programmed
+ * ranges and only reads back the ranges that do not match.
+ */
+extern bool g_crc_verify;
+
+/*
+ * Combines the CRC32s of two pieces of data when the second piece is of a
+ * fixed length (see Crc32Shift).
+ */
+typedef struct {
+	unsigned int matrix[32];
+} CRC32_SHIFT;
+
+unsigned int Crc32(const unsigned char *bytes, unsigned int length, unsigned int crc = 0);
+void Crc32Shift(CRC32_SHIFT *shift, unsigned int length);
+unsigned int Crc32Combine(const CRC32_SHIFT *shift, unsigned int crc1, unsigned int crc2);
+
+#endif
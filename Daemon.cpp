@@ -0,0 +1,331 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "windows.h"
+#include "sddl.h"
+#include "Crc32.h"
+#include "Daemon.h"
+#include "HexFile.h"
+#include "JobFile.h"
+#include "Session.h"
+
+#define MAX_CACHED_IMAGES  8
+#define MAX_JOB_LENGTH     1024
+#define MAX_JOB_ARGUMENTS  16
+
+#ifndef PIPE_REJECT_REMOTE_CLIENTS
+#define PIPE_REJECT_REMOTE_CLIENTS 0x00000008
+#endif
+
+/*
+ * Only SYSTEM, the Administrators and the owner of the pipe (the account
+ * the daemon runs as) may connect, and never over the network. Jobs erase
+ * and program whatever is in the socket, so they must come from this
+ * station.
+ */
+#define PIPE_SECURITY "D:P(D;;GA;;;NU)(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;OW)"
+
+/*
+ * A parsed .hex file, kept for as long as the daemon runs or until the
+ * file changes. The file is taken to have changed when its last write time
+ * or size does.
+ */
+typedef struct {
+	char name[MAX_JOB_LENGTH];
+	FILETIME last_write;
+	DWORD size_high;
+	DWORD size_low;
+	SEGMENT *segments;
+	int number_of_segments;
+} CACHED_IMAGE;
+
+static CACHED_IMAGE cache[MAX_CACHED_IMAGES];
+static int next_cache_slot = 0;
+
+//===========================================================================
+//
+// Name    : LoadCachedHexFile
+//
+// Desc    : Makes the .hex file "name" the loaded one. The file is only
+//           parsed the first time, and again whenever it has been rebuilt
+//           since; otherwise the segments are copied from the cache. Once
+//           the cache is full, the oldest image goes.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool LoadCachedHexFile(char *name)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesEx(name, GetFileExInfoStandard, &attributes))
+	{
+		//
+		// Let LoadHexFile say what is wrong with it.
+		//
+		return LoadHexFile(name);
+	}
+
+	CACHED_IMAGE *image = NULL;
+	for (int i = 0; i < MAX_CACHED_IMAGES; i++)
+	{
+		if (cache[i].segments != NULL && strcmp(cache[i].name, name) == 0)
+		{
+			image = &cache[i];
+			break;
+		}
+	}
+
+	if (image != NULL
+		&& CompareFileTime(&image->last_write, &attributes.ftLastWriteTime) == 0
+		&& image->size_high == attributes.nFileSizeHigh
+		&& image->size_low == attributes.nFileSizeLow)
+	{
+		memcpy(g_memory_segment, image->segments, image->number_of_segments * sizeof(SEGMENT));
+		g_number_of_segments = image->number_of_segments;
+		return true;
+	}
+
+	if (!LoadHexFile(name))
+	{
+		return false;
+	}
+
+	//
+	// A rebuilt file replaces its old image; a new one takes the oldest slot.
+	//
+	if (image == NULL)
+	{
+		image = &cache[next_cache_slot];
+		next_cache_slot = (next_cache_slot + 1) % MAX_CACHED_IMAGES;
+	}
+
+	free(image->segments);
+	image->segments = NULL;
+	if (g_number_of_segments == 0)
+	{
+		return true;
+	}
+
+	SEGMENT *segments = (SEGMENT *)malloc(g_number_of_segments * sizeof(SEGMENT));
+	if (segments == NULL)
+	{
+		//
+		// The file is loaded; it just is not cached.
+		//
+		return true;
+	}
+	strncpy(image->name, name, sizeof(image->name) - 1);
+	image->name[sizeof(image->name) - 1] = 0;
+	image->last_write = attributes.ftLastWriteTime;
+	image->size_high = attributes.nFileSizeHigh;
+	image->size_low = attributes.nFileSizeLow;
+	image->number_of_segments = g_number_of_segments;
+	image->segments = segments;
+	memcpy(image->segments, g_memory_segment, g_number_of_segments * sizeof(SEGMENT));
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : Reply
+//
+// Desc    : Sends the line "text" back to the client on "pipe". If "pipe"
+//           is NULL the line goes to stdout.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void Reply(HANDLE pipe, const char *text)
+{
+	if (pipe == NULL)
+	{
+		printf("%s\n", text);
+		return;
+	}
+
+	char line[MAX_JOB_LENGTH + 2];
+	int length = snprintf(line, sizeof(line), "%s\n", text);
+
+	DWORD written;
+	WriteFile(pipe, line, length, &written, NULL);
+	FlushFileBuffers(pipe);
+}
+
+//===========================================================================
+//
+// Name    : RunJob
+//
+// Desc    : Runs one job and streams the outcome of each step back on
+//           "pipe". A job is a line of the same options as on the command
+//           line, limited to a family (-16, -18 or -32), -e, -p <hex_file>,
+//           -u <hex_file> and -crc, for example
+//
+//               -18 -e -p "C:\Firmware\board.hex"
+//
+//           Each step is answered by "<step> OK" or "<step> FAIL" and the
+//           job by "DONE OK" or "DONE FAIL". Steps stop at the first
+//           failure. Other output (progress, errors) goes to the daemon's
+//           console.
+//
+// Returns : True if all steps succeeded, false otherwise.
+//
+//===========================================================================
+static bool RunJob(char *job, HANDLE pipe)
+{
+	char *argv[MAX_JOB_ARGUMENTS];
+	int argc = SplitWords(job, argv, MAX_JOB_ARGUMENTS);
+
+	const FAMILY_OPERATIONS *operations = NULL;
+	bool erase = false;
+	bool program = false;
+	bool update = false;
+	char *hex_file_name = NULL;
+
+	g_crc_verify = false;
+
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-16") == 0 || strcmp(argv[i], "-18") == 0 || strcmp(argv[i], "-32") == 0)
+		{
+			operations = FamilyOperations(argv[i][1] == '1' ? (argv[i][2] == '6' ? FAMILY_PIC16 : FAMILY_PIC18) : FAMILY_PIC32);
+		}
+		else if (strcmp(argv[i], "-e") == 0)
+		{
+			erase = true;
+		}
+		else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-u") == 0) && i + 1 < argc)
+		{
+			program = argv[i][1] == 'p';
+			update = argv[i][1] == 'u';
+			hex_file_name = argv[++i];
+		}
+		else if (strcmp(argv[i], "-crc") == 0)
+		{
+			g_crc_verify = true;
+		}
+		else
+		{
+			char text[MAX_JOB_LENGTH];
+			snprintf(text, sizeof(text), "ERROR \"%s\" is not a valid job option", argv[i]);
+			Reply(pipe, text);
+			Reply(pipe, "DONE FAIL");
+			return false;
+		}
+	}
+
+	if (operations == NULL || (update && operations->update == NULL))
+	{
+		Reply(pipe, "ERROR the job needs -16, -18 or -32, and -u needs -32");
+		Reply(pipe, "DONE FAIL");
+		return false;
+	}
+
+	bool ok = true;
+	if (hex_file_name != NULL)
+	{
+		ok = LoadCachedHexFile(hex_file_name);
+		Reply(pipe, ok ? "load OK" : "load FAIL");
+	}
+	//
+	// One session for the whole job, so the target is powered up once.
+	//
+	bool in_session = ok && (erase || program || update);
+	if (in_session)
+	{
+		ok = in_session = operations->begin_session();
+	}
+	if (ok && erase)
+	{
+		ok = operations->erase();
+		Reply(pipe, ok ? "erase OK" : "erase FAIL");
+	}
+	if (ok && program)
+	{
+		ok = operations->program();
+		Reply(pipe, ok ? "program OK" : "program FAIL");
+	}
+	if (ok && update)
+	{
+		ok = operations->update();
+		Reply(pipe, ok ? "update OK" : "update FAIL");
+	}
+	if (in_session)
+	{
+		ok = operations->end_session() && ok;
+	}
+
+	Reply(pipe, ok ? "DONE OK" : "DONE FAIL");
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : RunDaemon
+//
+// Desc    : Serves jobs from clients connecting to the named pipe
+//           "pipe_name", one client at a time, until the process is
+//           stopped. Each message from a client is one job (see RunJob).
+//           The programmer stays open and parsed .hex files stay cached
+//           between jobs, so a job costs little more than its device work.
+//           Only local clients are served (see PIPE_SECURITY).
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void RunDaemon(const char *pipe_name)
+{
+	SECURITY_ATTRIBUTES security;
+	security.nLength = sizeof(security);
+	security.bInheritHandle = FALSE;
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptor(PIPE_SECURITY,
+															 SDDL_REVISION_1,
+															 &security.lpSecurityDescriptor,
+															 NULL))
+	{
+		printf ("*** Can't build the security descriptor of the named pipe.\n");
+		return;
+	}
+
+	printf ("Waiting for jobs on %s.\n", pipe_name);
+
+	while (1)
+	{
+		HANDLE pipe = CreateNamedPipe(pipe_name,
+									  PIPE_ACCESS_DUPLEX,
+									  PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+									  1,
+									  MAX_JOB_LENGTH,
+									  MAX_JOB_LENGTH,
+									  0,
+									  &security);
+		if (pipe == INVALID_HANDLE_VALUE)
+		{
+			printf ("*** Can't create the named pipe %s.\n", pipe_name);
+			LocalFree(security.lpSecurityDescriptor);
+			return;
+		}
+
+		if (ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED)
+		{
+			char job[MAX_JOB_LENGTH + 1];
+			DWORD length;
+
+			while (ReadFile(pipe, job, MAX_JOB_LENGTH, &length, NULL))
+			{
+				job[length] = 0;
+				printf ("\nJob: %s\n", job);
+				RunJob(job, pipe);
+			}
+		}
+
+		DisconnectNamedPipe(pipe);
+		CloseHandle(pipe);
+	}
+}
@@ -0,0 +1,14 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#define DEFAULT_PIPE_NAME "\\\\.\\pipe\\prog-win"
+
+void RunDaemon(const char *pipe_name);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "string.h"
+#include "Devices.h"
+
+#define PIC16_ID_MASK  0x00003fe0
+#define PIC18_ID_MASK  0x0000ffe0
+#define PIC32_ID_MASK  0x0fffffff
+
+//
+// Configuration byte masks. Not all config bytes are used on all PIC18
+// devices. Unused ones are programmed 0xff, but read as 0x00, so they are
+// not verified. On the PIC32, DEVCFG0 is always read with its most
+// significant bit set to zero and the JTAGEN bit cannot be programmed to 0,
+// so DEVCFG0 (the last of the four config words) is not verified at all.
+//
+#define CONFIG_16            { 0xff, 0x3f }
+#define CONFIG_18_ALL        { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }
+#define CONFIG_18_USB        { 0xff, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }
+#define CONFIG_18_1X30       { 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff }
+#define CONFIG_32            { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00 }
+
+//
+// PIC16F parts. Program memory is written one word at a time by the
+// programmer, so a programming command may carry as much as fits in a USB
+// packet.
+//
+static constexpr DEVICE pic16_devices[] = {
+//    Name        ID      ID mask        Flash   BFM Write Erase Xfer EEPROM Config  Size Mask
+	{ "16F627A",  0x1040, PIC16_ID_MASK, 0x0800, 0,  2,    0,    32,  128,   0x400e, 2,   CONFIG_16 },
+	{ "16F628A",  0x1060, PIC16_ID_MASK, 0x1000, 0,  2,    0,    32,  128,   0x400e, 2,   CONFIG_16 },
+	{ "16F648A",  0x1100, PIC16_ID_MASK, 0x2000, 0,  2,    0,    32,  256,   0x400e, 2,   CONFIG_16 },
+};
+
+//
+// PIC18F parts. The programmer commits each programming command to the
+// write buffer in one go, so a command must not carry more than the write
+// buffer holds. Nor can it carry more than 32 bytes, as it has to fit in a
+// single USB packet together with the header.
+//
+static constexpr DEVICE pic18_devices[] = {
+//    Name             ID      ID mask        Flash    BFM Write Erase Xfer EEPROM Config    Size Mask
+	{ "18F4550",       0x1200, PIC18_ID_MASK, 0x08000, 0,  32,   64,   32,  256,   0x300000, 14,  CONFIG_18_USB },
+	{ "18F4450",       0x1220, PIC18_ID_MASK, 0x04000, 0,  16,   64,   16,  0,     0x300000, 14,  CONFIG_18_USB },
+	{ "18F2550",       0x1240, PIC18_ID_MASK, 0x08000, 0,  32,   64,   32,  256,   0x300000, 14,  CONFIG_18_USB },
+	{ "18F2450",       0x1260, PIC18_ID_MASK, 0x04000, 0,  16,   64,   16,  0,     0x300000, 14,  CONFIG_18_USB },
+	{ "18F45K50",      0x5c00, PIC18_ID_MASK, 0x08000, 0,  64,   64,   32,  256,   0x300000, 14,  CONFIG_18_USB },
+	{ "18F25K50",      0x5c20, PIC18_ID_MASK, 0x08000, 0,  64,   64,   32,  256,   0x300000, 14,  CONFIG_18_USB },
+	{ "18F24K50",      0x5c60, PIC18_ID_MASK, 0x04000, 0,  64,   64,   32,  256,   0x300000, 14,  CONFIG_18_USB },
+	{ "18F26K50",      0x5d20, PIC18_ID_MASK, 0x10000, 0,  64,   64,   32,  256,   0x300000, 14,  CONFIG_18_USB },
+	{ "18F46K50",      0x5d60, PIC18_ID_MASK, 0x10000, 0,  64,   64,   32,  256,   0x300000, 14,  CONFIG_18_USB },
+	{ "18F1230",       0x1e00, PIC18_ID_MASK, 0x01000, 0,  8,    64,   8,   128,   0x300000, 14,  CONFIG_18_1X30 },
+	{ "18F1330",       0x1e20, PIC18_ID_MASK, 0x02000, 0,  8,    64,   8,   128,   0x300000, 14,  CONFIG_18_1X30 },
+	{ "18F1330-ICD",   0x1ee0, PIC18_ID_MASK, 0x02000, 0,  8,    64,   8,   128,   0x300000, 14,  CONFIG_18_1X30 },
+};
+
+//
+// PIC32MX parts. A row is programmed in one go, so the transfer size is the
+// row size.
+//
+static constexpr DEVICE pic32_devices[] = {
+//    Name                ID          ID mask        Flash     BFM     Write  Erase   Xfer   EEPROM Config      Size Mask
+	{ "PIC32MX110F016B",  0x04A07053, PIC32_ID_MASK, 0x004000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX120F032B",  0x04A06053, PIC32_ID_MASK, 0x008000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX130F064B",  0x04D07053, PIC32_ID_MASK, 0x010000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX150F128B",  0x04D06053, PIC32_ID_MASK, 0x020000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX210F016B",  0x04A01053, PIC32_ID_MASK, 0x004000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX220F032B",  0x04A00053, PIC32_ID_MASK, 0x008000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX250F128B",  0x04D00053, PIC32_ID_MASK, 0x020000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX230F063B",  0x04D01053, PIC32_ID_MASK, 0x010000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX170F256B",  0x06610053, PIC32_ID_MASK, 0x040000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX270F256B",  0x06600053, PIC32_ID_MASK, 0x040000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+	{ "PIC32MX360F512L",  0x00938053, PIC32_ID_MASK, 0x080000, 0x3000, 0x200, 0x1000, 0x200, 0,     0x1fc02ff0, 16,  CONFIG_32 },
+	{ "PIC32MX440F256H",  0x00952053, PIC32_ID_MASK, 0x040000, 0x3000, 0x200, 0x1000, 0x200, 0,     0x1fc02ff0, 16,  CONFIG_32 },
+	{ "PIC32MX460F512L",  0x00978053, PIC32_ID_MASK, 0x080000, 0x3000, 0x200, 0x1000, 0x200, 0,     0x1fc02ff0, 16,  CONFIG_32 },
+	{ "PIC32MX795F512H",  0x0430E053, PIC32_ID_MASK, 0x080000, 0x3000, 0x200, 0x1000, 0x200, 0,     0x1fc02ff0, 16,  CONFIG_32 },
+	{ "PIC32MX795F512L",  0x04307053, PIC32_ID_MASK, 0x080000, 0x3000, 0x200, 0x1000, 0x200, 0,     0x1fc02ff0, 16,  CONFIG_32 },
+};
+
+//
+// Used for parts that are not in the tables above. These are conservative
+// and match what the programmer always did before it knew about parts.
+//
+static constexpr DEVICE default_devices[] = {
+	{ "PIC16F",           0,          PIC16_ID_MASK, 0x004000, 0,      2,     0,      16,    256,   0x400e,     2,   CONFIG_16 },
+	{ "PIC18F",           0,          PIC18_ID_MASK, 0x010000, 0,      8,     64,     8,     256,   0x300000,   14,  CONFIG_18_ALL },
+	{ "PIC32MX",          0,          PIC32_ID_MASK, 0x020000, 0x0c00, 0x080, 0x0400, 0x080, 0,     0x1fc00bf0, 16,  CONFIG_32 },
+};
+
+//===========================================================================
+//
+// Name    : DeviceHash
+//
+// Desc    : Maps a (masked) device ID to a slot in a hash table with
+//           "slots" slots. "slots" must be a power of two.
+//
+// Returns : The slot.
+//
+//===========================================================================
+static constexpr unsigned int DeviceHash(unsigned int device_id, unsigned int slots)
+{
+	return ((device_id * 0x9e3779b1u) >> 16) & (slots - 1);
+}
+
+/*
+ * An open addressing hash table over one of the device tables, built by the
+ * compiler. Each slot holds the index of a device plus one, or zero if the
+ * slot is empty. With at least twice as many slots as devices a lookup
+ * rarely needs more than one probe.
+ */
+template <int DEVICES, int SLOTS>
+struct DEVICE_INDEX {
+	const DEVICE *devices;
+	unsigned int mask;
+	unsigned char slot[SLOTS];
+
+	constexpr DEVICE_INDEX(const DEVICE (&table)[DEVICES], unsigned int id_mask)
+		: devices(table), mask(id_mask), slot()
+	{
+		static_assert(SLOTS >= 2 * DEVICES && (SLOTS & (SLOTS - 1)) == 0, "Bad number of hash slots");
+
+		for (int i = 0; i < DEVICES; i++)
+		{
+			unsigned int s = DeviceHash(table[i].device_id, SLOTS);
+			while (slot[s] != 0)
+			{
+				s = (s + 1) & (SLOTS - 1);
+			}
+			slot[s] = static_cast<unsigned char>(i + 1);
+		}
+	}
+
+	const DEVICE *Find(unsigned int device_id) const
+	{
+		device_id &= mask;
+		for (unsigned int s = DeviceHash(device_id, SLOTS); slot[s] != 0; s = (s + 1) & (SLOTS - 1))
+		{
+			if (devices[slot[s] - 1].device_id == device_id)
+			{
+				return &devices[slot[s] - 1];
+			}
+		}
+		return NULL;
+	}
+};
+
+static constexpr DEVICE_INDEX<sizeof(pic16_devices) / sizeof(DEVICE), 8>  pic16_index(pic16_devices, PIC16_ID_MASK);
+static constexpr DEVICE_INDEX<sizeof(pic18_devices) / sizeof(DEVICE), 32> pic18_index(pic18_devices, PIC18_ID_MASK);
+static constexpr DEVICE_INDEX<sizeof(pic32_devices) / sizeof(DEVICE), 32> pic32_index(pic32_devices, PIC32_ID_MASK);
+
+//===========================================================================
+//
+// Name    : FindDevice
+//
+// Desc    : Looks up the part with device ID "device_id" in the "family"
+//           device table. Revision bits in "device_id" are ignored.
+//
+// Returns : The part, or NULL if it is unknown.
+//
+//===========================================================================
+const DEVICE *FindDevice(FAMILY family, unsigned int device_id)
+{
+	switch (family)
+	{
+	case FAMILY_PIC16: return pic16_index.Find(device_id);
+	case FAMILY_PIC18: return pic18_index.Find(device_id);
+	case FAMILY_PIC32: return pic32_index.Find(device_id);
+	}
+	return NULL;
+}
+
+//===========================================================================
+//
+// Name    : FindDeviceByName
+//
+// Desc    : Looks up the part called "name" (such as "18F45K50", in any
+//           case) in the "family" device table.
+//
+// Returns : The part, or NULL if it is unknown.
+//
+//===========================================================================
+const DEVICE *FindDeviceByName(FAMILY family, const char *name)
+{
+	const DEVICE *devices = family == FAMILY_PIC16 ? pic16_devices : family == FAMILY_PIC18 ? pic18_devices : pic32_devices;
+	int count = family == FAMILY_PIC16 ? sizeof(pic16_devices) / sizeof(DEVICE)
+			  : family == FAMILY_PIC18 ? sizeof(pic18_devices) / sizeof(DEVICE)
+			  : sizeof(pic32_devices) / sizeof(DEVICE);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (_stricmp(devices[i].name, name) == 0)
+		{
+			return &devices[i];
+		}
+	}
+	return NULL;
+}
+
+//===========================================================================
+//
+// Name    : DefaultDevice
+//
+// Desc    : Returns a conservative description of an unknown "family" part.
+//
+// Returns : The part.
+//
+//===========================================================================
+const DEVICE *DefaultDevice(FAMILY family)
+{
+	return &default_devices[family];
+}
+
+//===========================================================================
+//
+// Name    : LargestMemorySize
+//
+// Desc    : Finds the most program (and boot) flash of any "family" part.
+//
+// Returns : The size in bytes, as laid out in the hex file.
+//
+//===========================================================================
+unsigned int LargestMemorySize(FAMILY family)
+{
+	const DEVICE *devices = family == FAMILY_PIC16 ? pic16_devices : family == FAMILY_PIC18 ? pic18_devices : pic32_devices;
+	int count = family == FAMILY_PIC16 ? sizeof(pic16_devices) / sizeof(DEVICE)
+			  : family == FAMILY_PIC18 ? sizeof(pic18_devices) / sizeof(DEVICE)
+			  : sizeof(pic32_devices) / sizeof(DEVICE);
+
+	unsigned int largest = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (devices[i].flash_size + devices[i].boot_flash_size > largest)
+		{
+			largest = devices[i].flash_size + devices[i].boot_flash_size;
+		}
+	}
+	return largest;
+}
+
+//===========================================================================
+//
+// Name    : DeviceRevision
+//
+// Desc    : Extracts the revision bits of "device_id", that is the bits not
+//           used to identify the part "device".
+//
+// Returns : The revision.
+//
+//===========================================================================
+unsigned int DeviceRevision(const DEVICE *device, unsigned int device_id)
+{
+	unsigned int revision_mask = ~device->device_id_mask;
+	unsigned int revision = device_id & revision_mask;
+
+	while (revision_mask != 0 && (revision_mask & 1) == 0)
+	{
+		revision_mask >>= 1;
+		revision >>= 1;
+	}
+	return revision;
+}
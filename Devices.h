@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef DEVICES_H
+#define DEVICES_H
+
+typedef enum {
+	FAMILY_PIC16,
+	FAMILY_PIC18,
+	FAMILY_PIC32
+} FAMILY;
+
+/*
+ * Everything we need to know about a part to program it. Addresses and sizes
+ * are in bytes as laid out in the hex file (so PIC16 addresses are twice the
+ * device word address).
+ */
+typedef struct {
+	const char *name;
+	unsigned int device_id;            // Device ID with the revision bits masked away.
+	unsigned int device_id_mask;       // Bits of the device ID that identify the part.
+	unsigned int flash_size;           // Program flash memory.
+	unsigned int boot_flash_size;      // Boot flash memory (PIC32 only).
+	unsigned int write_size;           // Write latches (PIC16), write buffer (PIC18) or row (PIC32).
+	unsigned int erase_size;           // Erase block (PIC18) or page (PIC32).
+	unsigned int transfer_size;        // Bytes of flash sent per programming command (or row for PIC32).
+	unsigned int eeprom_size;          // Data EEPROM, 0 if the part has none.
+	unsigned int config_address;       // First configuration byte.
+	unsigned int config_size;          // Number of configuration bytes.
+	unsigned char config_mask[16];     // Bits to verify in each configuration byte.
+} DEVICE;
+
+const DEVICE *FindDevice(FAMILY family, unsigned int device_id);
+const DEVICE *FindDeviceByName(FAMILY family, const char *name);
+const DEVICE *DefaultDevice(FAMILY family);
+unsigned int LargestMemorySize(FAMILY family);
+unsigned int DeviceRevision(const DEVICE *device, unsigned int device_id);
+
+#endif
@@ -0,0 +1,589 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef FAMILY_H
+#define FAMILY_H
+
+/*
+ * The part of the programming code that is the same for every family except
+ * for opcodes and how addresses are put into commands: power sequencing,
+ * reading and programming bytes in chunks, data EEPROM access and CRC
+ * requests. Each is a template over a traits type (PIC16_TRAITS,
+ * PIC18_TRAITS, PIC32_TRAITS) holding the opcodes and encoding of one
+ * family, so the compiler generates the code of each family with the
+ * encoding folded in. Pic16.cpp, Pic18.cpp and Pic32.cpp keep their
+ * existing functions as thin wrappers around these.
+ *
+ * The traits hold:
+ *
+ *   ADDRESS_BYTES      Bytes of address in read, program and CRC commands.
+ *   LSB_FIRST          True if addresses and lengths are little endian.
+ *   BYTES_PER_ADDRESS  Hex file bytes per device address (2 for the 14 bit
+ *                      words of the PIC16, which counts in words).
+ *   LENGTH_UNIT        Bytes per unit of the length in read commands.
+ *   READ_CHUNK         Bytes asked for by one read command.
+ *   CRC_LENGTH_BYTES   Bytes of length per range in CRC commands.
+ *   CRCS_PER_COMMAND   Ranges that fit in one CRC command.
+ *   BLANK_ID           What the device ID reads as with no target.
+ *
+ * plus ReceiveData, which receives the answer to a read command, and
+ * ReadDeviceId.
+ */
+
+#include "stdio.h"
+#include "string.h"
+#include "windows.h"
+#include "Usb.h"
+#include "Devices.h"
+#include "Commands.h"
+#include "Capabilities.h"
+#include "Trace.h"
+#include "Session.h"
+#include "Pic16.h"
+#include "Pic18.h"
+
+/*
+ * Vpp has settled once the device ID reads back the same, valid, value twice
+ * in a row. The MAX680 usually gets there well within the 100 ms it used to
+ * be given, but marginal boards may need longer, so we keep polling (every
+ * VPP_SETTLE_POLL ms) for up to VPP_SETTLE_TIMEOUT ms.
+ */
+#define VPP_SETTLE_POLL		2
+#define VPP_SETTLE_TIMEOUT	300
+
+/*
+ * The number of read commands sent ahead of their answers. The programmer
+ * answers in order, so each answer must carry exactly the bytes asked for.
+ */
+#define READS_IN_FLIGHT		4
+
+bool ReceiveAll(unsigned char *response, int *bytes_received);
+
+struct PIC16_TRAITS
+{
+	static constexpr FAMILY family = FAMILY_PIC16;
+
+	static constexpr unsigned char VDD_ON         = VDDON_16;
+	static constexpr unsigned char VPP_ON         = VPPON_16;
+	static constexpr unsigned char VDD_VPP_ON     = VDDVPPON_16;
+	static constexpr unsigned char VPP_VDD_OFF    = VPPVDDOFF_16;
+	static constexpr unsigned char READ_BYTES     = READBYTES_16;
+	static constexpr unsigned char PROGRAM_BYTES  = PROGRAMBYTES_16;
+	static constexpr unsigned char READ_EEPROM    = READEEPROM_16;
+	static constexpr unsigned char PROGRAM_EEPROM = PROGRAMEEPROM_16;
+	static constexpr unsigned char READ_CRCS      = READCRCS_16;
+
+	static constexpr int ADDRESS_BYTES     = 2;
+	static constexpr bool LSB_FIRST        = false;
+	static constexpr int BYTES_PER_ADDRESS = 2;
+	static constexpr int LENGTH_UNIT       = 1;
+	static constexpr int READ_CHUNK        = 32;
+	static constexpr int CRC_LENGTH_BYTES  = 2;
+	static constexpr int CRCS_PER_COMMAND  = 15;
+	static constexpr unsigned int BLANK_ID = 0x3fff;
+
+	static bool ReceiveData(unsigned char *buffer, int *bytes_received) { return Receive(buffer, bytes_received); }
+	static bool ReadDeviceId(unsigned int *device_id) { return ReadDeviceIdWord16(device_id); }
+};
+
+struct PIC18_TRAITS
+{
+	static constexpr FAMILY family = FAMILY_PIC18;
+
+	static constexpr unsigned char VDD_ON         = VDDON;
+	static constexpr unsigned char VPP_ON         = VPPON;
+	static constexpr unsigned char VDD_VPP_ON     = VDDVPPON;
+	static constexpr unsigned char VPP_VDD_OFF    = VPPVDDOFF;
+	static constexpr unsigned char READ_BYTES     = READBYTES;
+	static constexpr unsigned char PROGRAM_BYTES  = PROGRAMBYTES;
+	static constexpr unsigned char READ_EEPROM    = READEEPROM;
+	static constexpr unsigned char PROGRAM_EEPROM = PROGRAMEEPROM;
+	static constexpr unsigned char READ_CRCS      = READCRCS;
+
+	static constexpr int ADDRESS_BYTES     = 3;
+	static constexpr bool LSB_FIRST        = false;
+	static constexpr int BYTES_PER_ADDRESS = 1;
+	static constexpr int LENGTH_UNIT       = 1;
+	static constexpr int READ_CHUNK        = 32;
+	static constexpr int CRC_LENGTH_BYTES  = 2;
+	static constexpr int CRCS_PER_COMMAND  = 12;
+	static constexpr unsigned int BLANK_ID = 0xffff;
+
+	static bool ReceiveData(unsigned char *buffer, int *bytes_received) { return Receive(buffer, bytes_received); }
+	static bool ReadDeviceId(unsigned int *device_id) { return ReadDeviceIdWord18(device_id); }
+};
+
+/*
+ * The PIC32 is programmed through its own flow (see Pic32.cpp), so only the
+ * read and CRC commands come from here.
+ */
+struct PIC32_TRAITS
+{
+	static constexpr FAMILY family = FAMILY_PIC32;
+
+	static constexpr unsigned char READ_BYTES     = COMMAND_READ_WORDS;
+	static constexpr unsigned char READ_CRCS      = COMMAND_READ_CRCS;
+
+	static constexpr int ADDRESS_BYTES     = 4;
+	static constexpr bool LSB_FIRST        = true;
+	static constexpr int BYTES_PER_ADDRESS = 1;
+	static constexpr int LENGTH_UNIT       = 4;
+	static constexpr int READ_CHUNK        = 64;
+	static constexpr int CRC_LENGTH_BYTES  = 4;
+	static constexpr int CRCS_PER_COMMAND  = 7;
+
+	//
+	// Reads again if an empty packet arrives.
+	//
+	static bool ReceiveData(unsigned char *buffer, int *bytes_received) { return ReceiveAll(buffer, bytes_received); }
+};
+
+//===========================================================================
+//
+// Name    : PutField
+//
+// Desc    : Puts the "bytes" low bytes of "value" at "out", in the byte
+//           order of family "T".
+//
+// Returns : The number of bytes put.
+//
+//===========================================================================
+template <class T>
+inline int PutField(unsigned char *out, unsigned int value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+	{
+		int shift = T::LSB_FIRST ? 8 * i : 8 * (bytes - 1 - i);
+		out[i] = static_cast<unsigned char>(value >> shift);
+	}
+	return bytes;
+}
+
+//===========================================================================
+//
+// Name    : ReceiveOkT
+//
+// Desc    : Receives the "OK" that the PIC16 and PIC18 commands answer with.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool ReceiveOkT()
+{
+	unsigned char response[64];
+	int bytes_received = 64;
+
+	if (!Receive(response, &bytes_received))
+	{
+		printf("*** Waiting for an OK, but nothing came.\n");
+		return false;
+	}
+	if (bytes_received != 2)
+	{
+		printf("*** Waiting for an OK, but got %i bytes rather than 2.\n", bytes_received);
+		return false;
+	}
+
+	if (response[0] != 'O' || response[1] != 'K')
+	{
+		printf("*** Waiting for an OK, but got \"%c%c\".\n", response[0], response[1]);
+		return false;
+	}
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : SendOpcodeT
+//
+// Desc    : Sends the one byte command "opcode" (such as T::VDD_ON) and
+//           waits for its OK.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool SendOpcodeT(unsigned char opcode)
+{
+	return Send(&opcode, 1) && ReceiveOkT<T>();
+}
+
+//===========================================================================
+//
+// Name    : PowerUpT
+//
+// Desc    : Turns on Vdd and then Vpp, in one command if the programmer
+//           supports it.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool PowerUpT()
+{
+	double start = TraceTime();
+	bool ok;
+	if (Capabilities() & CAPABILITY_VDD_VPP_ON)
+	{
+		ok = SendOpcodeT<T>(T::VDD_VPP_ON);
+	}
+	else
+	{
+		ok = SendOpcodeT<T>(T::VDD_ON) && SendOpcodeT<T>(T::VPP_ON);
+	}
+	TraceSpan("power up", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : PowerDownT
+//
+// Desc    : Turns off Vpp and Vdd. Vdd must be turned off after Vpp, but no
+//           longer than 100ns after. In reality we have no choice but to turn
+//           them off at the same time.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool PowerDownT()
+{
+	double start = TraceTime();
+	bool ok = SendOpcodeT<T>(T::VPP_VDD_OFF);
+	TraceSpan("power down", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : WaitForVppT
+//
+// Desc    : Polls the device ID until Vpp has settled (see VPP_SETTLE_POLL).
+//
+// Returns : The number of milliseconds it took, or -1 if Vpp had not
+//           settled after VPP_SETTLE_TIMEOUT ms (or there is no target).
+//
+//===========================================================================
+template <class T>
+int WaitForVppT()
+{
+	DWORD start = GetTickCount();
+	double trace_start = TraceTime();
+	unsigned int previous = 0;
+
+	while (1)
+	{
+		unsigned int word;
+		if (T::ReadDeviceId(&word) && word != 0x0000 && word != T::BLANK_ID)
+		{
+			if (word == previous)
+			{
+				TraceSpan("settle", "target", trace_start, TRACE_NO_ADDRESS, -1);
+				return GetTickCount() - start;
+			}
+			previous = word;
+		}
+		else
+		{
+			previous = 0;
+		}
+
+		if (GetTickCount() - start >= VPP_SETTLE_TIMEOUT)
+		{
+			TraceSpan("settle", "target", trace_start, TRACE_NO_ADDRESS, -1);
+			return -1;
+		}
+		double sleep_start = TraceTime();
+		Sleep(VPP_SETTLE_POLL);
+		TraceSpan("sleep", "idle", sleep_start, TRACE_NO_ADDRESS, -1);
+	}
+}
+
+//===========================================================================
+//
+// Name    : PowerUpAndSettleT
+//
+// Desc    : Powers up the target and waits for Vpp to settle. The MAX680
+//           takes a little while. Vpp not settling fails the power up,
+//           unless g_allow_unsettled_vpp is set (-nosettle).
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool PowerUpAndSettleT()
+{
+	if (!PowerUpT<T>())
+	{
+		return false;
+	}
+
+	int settle_time = WaitForVppT<T>();
+	if (settle_time >= 0)
+	{
+		printf ("Vpp settled in %i ms.\n", settle_time);
+		return true;
+	}
+	if (g_allow_unsettled_vpp)
+	{
+		printf ("+++ Vpp did not settle within %i ms. Is the target connected?\n", VPP_SETTLE_TIMEOUT);
+		return true;
+	}
+
+	printf ("*** Vpp did not settle within %i ms. Is the target connected?\n", VPP_SETTLE_TIMEOUT);
+	return false;
+}
+
+//===========================================================================
+//
+// Name    : IsTargetPresentT
+//
+// Desc    : Powers up the target just long enough to read its device ID.
+//           Without a target the ID reads as all zeros or all ones, and Vpp
+//           never appears to settle. Not to be called within a session.
+//
+// Returns : True if a target answers, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool IsTargetPresentT()
+{
+	bool present = PowerUpT<T>() && WaitForVppT<T>() >= 0;
+
+	PowerDownT<T>();
+
+	return present;
+}
+
+//===========================================================================
+//
+// Name    : SendReadT
+//
+// Desc    : Sends read command "opcode" for "length" bytes at device address
+//           "address", which takes "address_bytes" bytes in the command.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool SendReadT(unsigned char opcode, int address_bytes, unsigned int address, int length)
+{
+	unsigned char command[8] = { opcode };
+	int size = 1 + PutField<T>(&command[1], address, address_bytes);
+	command[size++] = static_cast<unsigned char>(length / T::LENGTH_UNIT);
+
+	return Send(command, size);
+}
+
+//===========================================================================
+//
+// Name    : ReadBytesT
+//
+// Desc    : Reads "length" bytes (at most one packet) from the target into
+//           "buffer" starting at device address "address".
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool ReadBytesT(unsigned int address, unsigned char *buffer, int length)
+{
+	if (!SendReadT<T>(T::READ_BYTES, T::ADDRESS_BYTES, address, length))
+	{
+		return false;
+	}
+
+	int bytes_received = length;
+	return T::ReceiveData(buffer, &bytes_received);
+}
+
+//===========================================================================
+//
+// Name    : ReadMemoryT
+//
+// Desc    : Reads "length" bytes into "buffer" starting at hex file address
+//           "address", READ_CHUNK bytes at a time with up to READS_IN_FLIGHT
+//           commands outstanding. Both must be multiples of the word size.
+//           The target must be powered (or in programming mode).
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool ReadMemoryT(unsigned int address, unsigned char *buffer, int length)
+{
+	double start = TraceTime();
+	unsigned char data[64];
+	int requested = 0;
+	int received = 0;
+
+	while (received < length)
+	{
+		//
+		// Keep the pipe full.
+		//
+		while (requested < length && requested - received < READS_IN_FLIGHT * T::READ_CHUNK)
+		{
+			int chunk = length - requested < T::READ_CHUNK ? length - requested : T::READ_CHUNK;
+			if (!SendReadT<T>(T::READ_BYTES, T::ADDRESS_BYTES, (address + requested) / T::BYTES_PER_ADDRESS, chunk))
+			{
+				return false;
+			}
+			requested += chunk;
+		}
+
+		int chunk = length - received < T::READ_CHUNK ? length - received : T::READ_CHUNK;
+		int bytes_received = 64;
+		if (!T::ReceiveData(data, &bytes_received))
+		{
+			return false;
+		}
+		if (bytes_received != chunk)
+		{
+			printf("*** Reading %08x: expected %i bytes but got %i.\n", address + received, chunk, bytes_received);
+			return false;
+		}
+		memcpy(&buffer[received], data, chunk);
+		received += chunk;
+	}
+
+	TraceSpan("read", "target", start, address, length);
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : ProgramBytesT
+//
+// Desc    : Writes "length" bytes to the target from "buffer" starting at
+//           device address "address". The programmer commits each command
+//           to the write buffer, so a command carries at most the transfer
+//           size of "device" (only eight bytes on the PIC18F1330, for
+//           example).
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool ProgramBytesT(const DEVICE *device, unsigned int address, const unsigned char *buffer, int length)
+{
+	double start = TraceTime();
+	bool ok = true;
+	for (int i = 0; i < length && ok; i += device->transfer_size)
+	{
+		int len = (length - i < (int)device->transfer_size) ? length - i : device->transfer_size;
+
+		unsigned char command[1 + 4 + 200] = { T::PROGRAM_BYTES };
+		int size = 1 + PutField<T>(&command[1], address + i / T::BYTES_PER_ADDRESS, T::ADDRESS_BYTES);
+		memcpy(&command[size], &buffer[i], len);
+
+		ok = Send(command, size + len) && ReceiveOkT<T>();
+	}
+
+	TraceSpan("program", "target", start, address, length);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : ReadEepromT
+//
+// Desc    : Reads "length" bytes (at most one packet) from the data EEPROM
+//           of the target into "buffer" starting at EEPROM address
+//           "address".
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool ReadEepromT(unsigned int address, unsigned char *buffer, int length)
+{
+	if (!SendReadT<T>(T::READ_EEPROM, 2, address, length))
+	{
+		return false;
+	}
+
+	int bytes_received = length;
+	return T::ReceiveData(buffer, &bytes_received) && bytes_received == length;
+}
+
+//===========================================================================
+//
+// Name    : ProgramEepromT
+//
+// Desc    : Writes "length" bytes (at most one packet less the header) from
+//           "buffer" to the data EEPROM of the target starting at EEPROM
+//           address "address".
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool ProgramEepromT(unsigned int address, const unsigned char *buffer, int length)
+{
+	unsigned char command[64] = { T::PROGRAM_EEPROM };
+	int size = 1 + PutField<T>(&command[1], address, 2);
+	memcpy(&command[size], buffer, length);
+
+	double start = TraceTime();
+	bool ok = Send(command, size + length) && ReceiveOkT<T>();
+	TraceSpan("eeprom", "target", start, address, length);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : ReadCrcsT
+//
+// Desc    : Asks the programmer for the CRC32s of "count" (at most
+//           CRCS_PER_COMMAND) ranges. The addresses are hex file addresses.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+template <class T>
+bool ReadCrcsT(const unsigned int *addresses, const unsigned int *lengths, int count, unsigned int *crcs)
+{
+	unsigned char command[2 + T::CRCS_PER_COMMAND * (T::ADDRESS_BYTES + T::CRC_LENGTH_BYTES)] = {
+		T::READ_CRCS,
+		static_cast<unsigned char>(count)
+	};
+	double start = TraceTime();
+	int size = 2;
+	for (int i = 0; i < count; i++)
+	{
+		size += PutField<T>(&command[size], addresses[i] / T::BYTES_PER_ADDRESS, T::ADDRESS_BYTES);
+		size += PutField<T>(&command[size], lengths[i], T::CRC_LENGTH_BYTES);
+	}
+
+	if (!Send(command, size))
+	{
+		return false;
+	}
+
+	//
+	// Old firmware does not answer at all, in which case ReceiveAll would
+	// keep reading forever. So read once.
+	//
+	unsigned char response[64];
+	int bytes_received = 64;
+	if (!Receive(response, &bytes_received) || bytes_received != count * 4)
+	{
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		crcs[i] = response[i * 4] | (response[i * 4 + 1] << 8) | (response[i * 4 + 2] << 16) | ((unsigned int)response[i * 4 + 3] << 24);
+	}
+	TraceSpan("crc", "target", start, addresses[0], -1);
+	return true;
+}
+
+#endif
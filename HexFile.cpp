@@ -23,8 +23,8 @@ unsigned int base_address = 0;
 //
 // Name    : LoadHexFile
 //
-// Desc    : Loads the .hex file with the given name. The name may be a full
-//           or relative path.
+// Desc    : Loads the .hex file with the given name, replacing whatever was
+//           loaded before. The name may be a full or relative path.
 //
 // Returns : True if successful, false otherwise.
 //
@@ -38,6 +38,9 @@ bool LoadHexFile (char *name)
 		return false;
 	}
 
+	g_number_of_segments = 0;
+	base_address = 0;
+
 	char line[200];
 	while (fgets (line, 200, file) != NULL)
 	{
@@ -101,6 +104,7 @@ bool LoadHexFile (char *name)
 			break;
 
 		case '1':
+			fclose (file);
 			return true;
 			break;
 
@@ -111,6 +115,7 @@ bool LoadHexFile (char *name)
 
 		default:
 			printf ("Unrecognised line \"%s\".\n", line);
+			fclose (file);
 			return false;
 			break;
 		}
@@ -0,0 +1,531 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "HexFile.h"
+#include "Capabilities.h"
+#include "Crc32.h"
+#include "Image.h"
+#include "Pack.h"
+#include "pic32mx.h"
+
+//
+// Mask images built so far, one per part (see MaskImage).
+//
+static MASK_IMAGE *mask_images = NULL;
+
+//===========================================================================
+//
+// Name    : CreateImage
+//
+// Desc    : Creates an empty (all 0xff) image of "size" bytes starting at
+//           address "start", divided into blocks of "block_size" bytes.
+//           "size" must be a multiple of "block_size". No block storage is
+//           allocated until AddSegmentsToImage puts data in it.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void CreateImage(IMAGE *image, unsigned int start, unsigned int size, unsigned int block_size)
+{
+	image->start = start;
+	image->size = size;
+	image->block_size = block_size;
+	image->blocks = (unsigned char **)calloc(size / block_size, sizeof(unsigned char *));
+	image->used = (bool *)calloc(size / block_size, sizeof(bool));
+	image->verified = (bool *)calloc(size / block_size, sizeof(bool));
+	image->crcs = (unsigned int *)calloc(size / block_size, sizeof(unsigned int));
+	image->crc_known = (bool *)calloc(size / block_size, sizeof(bool));
+	Crc32Shift(&image->block_shift, block_size);
+	image->packed = (unsigned char **)calloc(size / block_size, sizeof(unsigned char *));
+	image->packed_lengths = (int *)calloc(size / block_size, sizeof(int));
+}
+
+//===========================================================================
+//
+// Name    : FreeImage
+//
+// Desc    : Releases the memory held by "image".
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void FreeImage(IMAGE *image)
+{
+	for (unsigned int block = 0; block < image->size / image->block_size; block++)
+	{
+		free(image->blocks[block]);
+		free(image->packed[block]);
+	}
+	free(image->blocks);
+	free(image->used);
+	free(image->verified);
+	free(image->crcs);
+	free(image->crc_known);
+	free(image->packed);
+	free(image->packed_lengths);
+	image->blocks = NULL;
+	image->used = NULL;
+	image->verified = NULL;
+	image->crcs = NULL;
+	image->crc_known = NULL;
+	image->packed = NULL;
+	image->packed_lengths = NULL;
+}
+
+//===========================================================================
+//
+// Name    : ImageWindow
+//
+// Desc    : Makes "window" an image of the "size" bytes of "image" from
+//           "address", both whole blocks of "image", such as a single flash
+//           page. The window shares the blocks and flags of "image" and
+//           must not be freed.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void ImageWindow(IMAGE *window, const IMAGE *image, unsigned int address, unsigned int size)
+{
+	unsigned int first = (address - image->start) / image->block_size;
+
+	*window = *image;
+	window->start = address;
+	window->size = size;
+	window->blocks += first;
+	window->used += first;
+	window->verified += first;
+	window->crcs += first;
+	window->crc_known += first;
+	window->packed += first;
+	window->packed_lengths += first;
+}
+
+//===========================================================================
+//
+// Name    : IsInImage
+//
+// Desc    : Tells if all of the "length" bytes at "address" are inside the
+//           area covered by "image".
+//
+// Returns : True if they are, false otherwise.
+//
+//===========================================================================
+bool IsInImage(const IMAGE *image, unsigned int address, int length)
+{
+	return image->start <= address && address + length <= image->start + image->size;
+}
+
+//===========================================================================
+//
+// Name    : AddSegmentsToImage
+//
+// Desc    : Copies the bytes of each segment of the last read .hex file that
+//           fall inside "image" into the image and marks their blocks used,
+//           allocating (0xff filled) storage for each block as it is first
+//           used. Bytes outside the image are ignored.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void AddSegmentsToImage(IMAGE *image)
+{
+	for (int seg = 0; seg < g_number_of_segments; seg++)
+	{
+		for (int i = 0; i < g_memory_segment[seg].length; i++)
+		{
+			unsigned int address = g_memory_segment[seg].address + i;
+			if (IsInImage(image, address, 1))
+			{
+				unsigned int offset = address - image->start;
+				unsigned int block = offset / image->block_size;
+				if (image->blocks[block] == NULL)
+				{
+					image->blocks[block] = (unsigned char *)malloc(image->block_size);
+					memset(image->blocks[block], 0xff, image->block_size);
+				}
+				image->blocks[block][offset % image->block_size] = g_memory_segment[seg].bytes[i];
+				image->used[block] = true;
+				image->crc_known[block] = false;
+				free(image->packed[block]);
+				image->packed[block] = NULL;
+			}
+		}
+	}
+}
+
+//===========================================================================
+//
+// Name    : PackImage
+//
+// Desc    : Packs each used block of "image" (a multiple of four bytes) as
+//           words, so that sending them later does not have to. Blocks
+//           that are already packed are left alone.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void PackImage(IMAGE *image)
+{
+	for (unsigned int block = 0; block < image->size / image->block_size; block++)
+	{
+		if (image->used[block] && image->blocks[block] != NULL && image->packed[block] == NULL)
+		{
+			unsigned int words = image->block_size / 4;
+			image->packed[block] = (unsigned char *)malloc(4 * words + words / PACKED_LITERAL_WORDS + 1);
+			image->packed_lengths[block] = PackWords(image->blocks[block], words, image->packed[block]);
+		}
+	}
+}
+
+//===========================================================================
+//
+// Name    : ImageBlock
+//
+// Desc    : Gives the bytes of block number "block" of "image". Changing
+//           them is only allowed before ImageBlockCrc is asked for the block
+//           and before it is packed.
+//
+// Returns : A pointer to "block_size" bytes, or NULL if no data has been put
+//           in the block (it is all 0xff).
+//
+//===========================================================================
+unsigned char *ImageBlock(const IMAGE *image, unsigned int block)
+{
+	return image->blocks[block];
+}
+
+//===========================================================================
+//
+// Name    : ImageBlockCrc
+//
+// Desc    : Gives the CRC32 of block number "block" of "image", calculating
+//           it only the first time.
+//
+// Returns : The CRC32.
+//
+//===========================================================================
+unsigned int ImageBlockCrc(IMAGE *image, unsigned int block)
+{
+	if (!image->crc_known[block])
+	{
+		if (image->blocks[block] != NULL)
+		{
+			image->crcs[block] = Crc32(image->blocks[block], image->block_size);
+		}
+		else
+		{
+			unsigned char *blank = (unsigned char *)malloc(image->block_size);
+			memset(blank, 0xff, image->block_size);
+			image->crcs[block] = Crc32(blank, image->block_size);
+			free(blank);
+		}
+		image->crc_known[block] = true;
+	}
+	return image->crcs[block];
+}
+
+//===========================================================================
+//
+// Name    : IsBlank
+//
+// Desc    : Tells if all "length" bytes at "bytes" are 0xff, that is, if
+//           programming them would leave erased flash unchanged. The bulk of
+//           the bytes are compared eight at a time.
+//
+// Returns : True if they are, false otherwise.
+//
+//===========================================================================
+bool IsBlank(const unsigned char *bytes, unsigned int length)
+{
+	unsigned int i = 0;
+
+	for (; i + 8 <= length; i += 8)
+	{
+		unsigned long long word;
+		memcpy(&word, &bytes[i], 8);
+		if (word != 0xffffffffffffffffULL)
+		{
+			return false;
+		}
+	}
+	for (; i < length; i++)
+	{
+		if (bytes[i] != 0xff)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : CompareRanges
+//
+// Desc    : Asks the programmer for the CRC32s of "count" ranges using
+//           "read_crcs", compares them with "expected" and marks the blocks
+//           of "image" in matching ranges verified. "*mismatches" is
+//           incremented for each range that does not match.
+//
+// Returns : True if the programmer calculated the CRC32s, false otherwise.
+//
+//===========================================================================
+static bool CompareRanges(IMAGE *image, READ_CRCS read_crcs, const unsigned int *addresses, const unsigned int *lengths, const unsigned int *expected, int count, int *mismatches)
+{
+	unsigned int crcs[16];
+
+	if (!read_crcs(addresses, lengths, count, crcs))
+	{
+		return false;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		bool match = crcs[i] == expected[i];
+		unsigned int first = (addresses[i] - image->start) / image->block_size;
+		unsigned int last = (addresses[i] - image->start + lengths[i]) / image->block_size;
+		for (unsigned int block = first; block < last; block++)
+		{
+			image->verified[block] = match;
+		}
+		if (!match)
+		{
+			(*mismatches)++;
+		}
+	}
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : CompareImageCrcs
+//
+// Desc    : Merges the used blocks of "image" into ranges of at most
+//           CRC_RANGE_SIZE bytes (or a single block, if larger) and compares
+//           the CRC32 of each range, as calculated by the programmer using
+//           "read_crcs", with the CRC32 of the image. The blocks of matching
+//           ranges are marked verified. "read_crcs" is given at most
+//           "ranges_per_command" (and no more than 16) ranges at a time.
+//
+// Returns : True if the programmer calculated the CRC32s, false otherwise
+//           (including when it does not report CAPABILITY_READ_CRCS).
+//           Mismatches are not failures; they are left for the caller to
+//           verify by other means.
+//
+//===========================================================================
+bool CompareImageCrcs(IMAGE *image, READ_CRCS read_crcs, int ranges_per_command)
+{
+	const unsigned int blocks = image->size / image->block_size;
+
+	unsigned int addresses[16];
+	unsigned int lengths[16];
+	unsigned int expected[16];
+	int count = 0;
+	int mismatches = 0;
+
+	if (ranges_per_command > 16)
+	{
+		ranges_per_command = 16;
+	}
+
+	if (!(Capabilities() & CAPABILITY_READ_CRCS))
+	{
+		return false;
+	}
+
+	unsigned int block = 0;
+	while (block < blocks)
+	{
+		if (!image->used[block])
+		{
+			block++;
+			continue;
+		}
+
+		//
+		// Grow the range over consecutive used blocks.
+		//
+		unsigned int first = block;
+		do
+		{
+			block++;
+		}
+		while (block < blocks
+			   && image->used[block]
+			   && (block + 1 - first) * image->block_size <= CRC_RANGE_SIZE);
+
+		addresses[count] = image->start + first * image->block_size;
+		lengths[count] = (block - first) * image->block_size;
+		expected[count] = ImageBlockCrc(image, first);
+		for (unsigned int b = first + 1; b < block; b++)
+		{
+			expected[count] = Crc32Combine(&image->block_shift, expected[count], ImageBlockCrc(image, b));
+		}
+		count++;
+
+		if (count == ranges_per_command)
+		{
+			if (!CompareRanges(image, read_crcs, addresses, lengths, expected, count, &mismatches))
+			{
+				return false;
+			}
+			count = 0;
+		}
+	}
+
+	if (count > 0 && !CompareRanges(image, read_crcs, addresses, lengths, expected, count, &mismatches))
+	{
+		return false;
+	}
+
+	if (mismatches > 0)
+	{
+		printf("+++ CRC mismatch in %i range(s), reading them back.\n", mismatches);
+	}
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : IsImageVerified
+//
+// Desc    : Tells if all of the "length" bytes at "address" are in blocks of
+//           "image" that have been verified using CRCs.
+//
+// Returns : True if they are, false otherwise.
+//
+//===========================================================================
+bool IsImageVerified(const IMAGE *image, unsigned int address, int length)
+{
+	if (!IsInImage(image, address, length))
+	{
+		return false;
+	}
+
+	for (unsigned int b = (address - image->start) / image->block_size;
+		 b <= (address - image->start + length - 1) / image->block_size;
+		 b++)
+	{
+		if (!image->verified[b])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : AddMaskRegion
+//
+// Desc    : Adds a region of "size" bytes from "start" to "mask", with
+//           each odd (high) byte set to "high_byte_mask" and the others to
+//           0xff.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void AddMaskRegion(MASK_IMAGE *mask, unsigned int start, unsigned int size, unsigned char high_byte_mask)
+{
+	MASK_REGION *region = &mask->regions[mask->number_of_regions++];
+
+	region->start = start;
+	region->size = size;
+	region->bytes = (unsigned char *)malloc(size);
+	for (unsigned int i = 0; i < size; i++)
+	{
+		region->bytes[i] = ((start + i) % 2) ? high_byte_mask : 0xff;
+	}
+}
+
+//===========================================================================
+//
+// Name    : MaskImage
+//
+// Desc    : Gives the mask image of "device", a "family" part, building it
+//           the first time the part is asked for. Mask images are kept, and
+//           stay where they are, until the process ends: verifiers hold on
+//           to them, and there are no more than the parts in the device
+//           tables. The regions are the
+//           program memory up to and including the CONFIG word (PIC16F), the
+//           program flash and the configuration bytes (PIC18F), or the
+//           program and boot flash (PIC32MX, whose configuration words are
+//           in the boot flash).
+//
+// Returns : The mask image.
+//
+//===========================================================================
+const MASK_IMAGE *MaskImage(FAMILY family, const DEVICE *device)
+{
+	for (MASK_IMAGE *known = mask_images; known != NULL; known = known->next)
+	{
+		if (known->family == family && known->device == device)
+		{
+			return known;
+		}
+	}
+
+	MASK_IMAGE *mask = (MASK_IMAGE *)malloc(sizeof(MASK_IMAGE));
+	mask->family = family;
+	mask->device = device;
+	mask->number_of_regions = 0;
+	mask->next = mask_images;
+	mask_images = mask;
+
+	switch (family)
+	{
+	case FAMILY_PIC16:
+		AddMaskRegion(mask, 0, device->config_address + device->config_size, 0x3f);
+		break;
+	case FAMILY_PIC18:
+		AddMaskRegion(mask, 0, device->flash_size, 0xff);
+		AddMaskRegion(mask, device->config_address, device->config_size, 0xff);
+		break;
+	case FAMILY_PIC32:
+		AddMaskRegion(mask, PFM_START, device->flash_size, 0xff);
+		AddMaskRegion(mask, BFM_START, device->boot_flash_size, 0xff);
+		break;
+	}
+
+	for (unsigned int i = 0; i < device->config_size; i++)
+	{
+		unsigned char *byte = (unsigned char *)MaskBytes(mask, device->config_address + i, 1);
+		if (byte != NULL)
+		{
+			*byte = device->config_mask[i];
+		}
+	}
+
+	return mask;
+}
+
+//===========================================================================
+//
+// Name    : MaskBytes
+//
+// Desc    : Finds the masks of the "length" bytes at "address" in "mask".
+//
+// Returns : A pointer to the "length" masks, or NULL if the bytes are not
+//           all inside one region.
+//
+//===========================================================================
+const unsigned char *MaskBytes(const MASK_IMAGE *mask, unsigned int address, unsigned int length)
+{
+	for (int r = 0; r < mask->number_of_regions; r++)
+	{
+		const MASK_REGION *region = &mask->regions[r];
+		if (region->start <= address && address + length <= region->start + region->size)
+		{
+			return &region->bytes[address - region->start];
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "Crc32.h"
+#include "Devices.h"
+
+/*
+ * The number of bytes covered by one CRC32 during CRC verification.
+ */
+#define CRC_RANGE_SIZE 1024
+
+/*
+ * A memory area of the target (such as the program flash) as it should look
+ * once programmed, built from the segments of the last read .hex file. The
+ * area is divided into blocks; "used" tells which blocks have data in the hex
+ * file and "verified" which blocks have been verified using CRCs. Storage for
+ * a block is only allocated once data lands in it; "blocks" holds NULL for
+ * the others, which read as all 0xff. The CRC32 of each block is kept in
+ * "crcs" once calculated ("crc_known"), so that range CRCs are combined from
+ * them rather than recalculated over the bytes. PackImage keeps a packed copy
+ * (see Pack.h) of each used block in "packed", NULL until then.
+ */
+typedef struct {
+	unsigned int start;
+	unsigned int size;
+	unsigned int block_size;
+	unsigned char **blocks;
+	bool *used;
+	bool *verified;
+	unsigned int *crcs;
+	bool *crc_known;
+	CRC32_SHIFT block_shift;
+	unsigned char **packed;
+	int *packed_lengths;
+} IMAGE;
+
+/*
+ * The bits of each byte of a part that are implemented, and so verified: all
+ * but the top two bits of each 14 bit PIC16F word, and in the configuration
+ * bytes only the bits the device table gives (which also covers quirks such
+ * as the PIC32MX DEVCFG0 bits that read back differently). Built once per
+ * part by MaskImage, with one region per memory area of the part.
+ */
+#define MAX_MASK_REGIONS 3
+
+typedef struct {
+	unsigned int start;
+	unsigned int size;
+	unsigned char *bytes;
+} MASK_REGION;
+
+typedef struct MASK_IMAGE {
+	FAMILY family;
+	const DEVICE *device;
+	int number_of_regions;
+	MASK_REGION regions[MAX_MASK_REGIONS];
+	struct MASK_IMAGE *next;          // The part asked for before, if any.
+} MASK_IMAGE;
+
+/*
+ * Asks the programmer for the CRC32s of "count" address ranges.
+ */
+typedef bool (*READ_CRCS)(const unsigned int *addresses, const unsigned int *lengths, int count, unsigned int *crcs);
+
+void CreateImage(IMAGE *image, unsigned int start, unsigned int size, unsigned int block_size);
+void FreeImage(IMAGE *image);
+void ImageWindow(IMAGE *window, const IMAGE *image, unsigned int address, unsigned int size);
+bool IsInImage(const IMAGE *image, unsigned int address, int length);
+void AddSegmentsToImage(IMAGE *image);
+void PackImage(IMAGE *image);
+unsigned char *ImageBlock(const IMAGE *image, unsigned int block);
+unsigned int ImageBlockCrc(IMAGE *image, unsigned int block);
+bool IsBlank(const unsigned char *bytes, unsigned int length);
+bool CompareImageCrcs(IMAGE *image, READ_CRCS read_crcs, int ranges_per_command);
+bool IsImageVerified(const IMAGE *image, unsigned int address, int length);
+const MASK_IMAGE *MaskImage(FAMILY family, const DEVICE *device);
+const unsigned char *MaskBytes(const MASK_IMAGE *mask, unsigned int address, unsigned int length);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "windows.h"
+#include "Devices.h"
+#include "HexFile.h"
+#include "JobFile.h"
+#include "Session.h"
+
+#define MAX_JOB_STEPS      64
+#define MAX_STEP_WORDS     4
+#define MAX_LINE_LENGTH    512
+
+typedef enum {
+	STEP_ID,
+	STEP_ERASE,
+	STEP_PROGRAM,
+	STEP_EEPROM,
+	STEP_VERIFY,
+	STEP_DUMP
+} STEP_TYPE;
+
+/*
+ * One line of a job file.
+ */
+typedef struct {
+	STEP_TYPE type;
+	int line;
+	char argument[MAX_LINE_LENGTH];
+	unsigned int address;
+	int length;
+} JOB_STEP;
+
+//===========================================================================
+//
+// Name    : SplitWords
+//
+// Desc    : Splits "line" into at most "max_words" words in place. Words are
+//           separated by blanks; a word in double quotes may hold blanks.
+//
+// Returns : The number of words.
+//
+//===========================================================================
+int SplitWords(char *line, char *words[], int max_words)
+{
+	int count = 0;
+	char *p = line;
+
+	while (*p != 0 && count < max_words)
+	{
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		{
+			p++;
+		}
+		if (*p == 0)
+		{
+			break;
+		}
+
+		char end = ' ';
+		if (*p == '"')
+		{
+			end = '"';
+			p++;
+		}
+		words[count++] = p;
+		while (*p != 0 && *p != end && (end == '"' || (*p != '\t' && *p != '\r' && *p != '\n')))
+		{
+			p++;
+		}
+		if (*p != 0)
+		{
+			*p++ = 0;
+		}
+	}
+
+	return count;
+}
+
+//===========================================================================
+//
+// Name    : ParseStep
+//
+// Desc    : Parses the words of line "line" of a job file into "step".
+//           "operations" tells what the family can do. A dump may not be
+//           longer than the flash of the largest part of the family.
+//
+// Returns : True if the line is a valid step, false otherwise.
+//
+//===========================================================================
+static bool ParseStep(const FAMILY_OPERATIONS *operations, char *words[], int count, int line, JOB_STEP *step)
+{
+	step->line = line;
+	step->argument[0] = 0;
+
+	if (strcmp(words[0], "id") == 0 && count <= 2)
+	{
+		step->type = STEP_ID;
+	}
+	else if (strcmp(words[0], "erase") == 0 && count == 1)
+	{
+		step->type = STEP_ERASE;
+	}
+	else if (strcmp(words[0], "program") == 0 && count == 2)
+	{
+		step->type = STEP_PROGRAM;
+	}
+	else if (strcmp(words[0], "eeprom") == 0 && count == 2 && operations->write_eeprom != NULL)
+	{
+		step->type = STEP_EEPROM;
+	}
+	else if (strcmp(words[0], "verify") == 0 && count == 2)
+	{
+		step->type = STEP_VERIFY;
+	}
+	else if (strcmp(words[0], "dump") == 0 && count == 4)
+	{
+		step->type = STEP_DUMP;
+		step->address = strtoul(words[1], NULL, 0);
+		unsigned long length = strtoul(words[2], NULL, 0);
+		if (length == 0 || length > LargestMemorySize(operations->family))
+		{
+			printf ("*** Line %i: the dump length must be between 1 and %u bytes.\n", line, LargestMemorySize(operations->family));
+			return false;
+		}
+		step->length = (int)length;
+		if (step->address % 4 != 0 || step->length % 4 != 0)
+		{
+			printf ("*** Line %i: the dump address and length must be multiples of four.\n", line);
+			return false;
+		}
+	}
+	else
+	{
+		printf ("*** Line %i: \"%s\" is not a valid step.\n", line, words[0]);
+		return false;
+	}
+
+	if (count > 1)
+	{
+		strncpy(step->argument, words[count - 1], sizeof(step->argument) - 1);
+		step->argument[sizeof(step->argument) - 1] = 0;
+	}
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : CheckId
+//
+// Desc    : Reads the device ID and prints it. If "part" is not empty, the
+//           part must also be the one named by it (such as "18F45K50").
+//
+// Returns : True if a target answers (and is the expected part), false
+//           otherwise.
+//
+//===========================================================================
+static bool CheckId(const FAMILY_OPERATIONS *operations, const char *part)
+{
+	unsigned int device_id;
+	if (!operations->read_device_id(&device_id))
+	{
+		printf ("*** Failed to read the device ID.\n");
+		return false;
+	}
+
+	const DEVICE *device = FindDevice(operations->family, device_id);
+	printf ("Dev_ID : 0x%04x, %s.\n", device_id, device != NULL ? device->name : "an unknown part");
+
+	if (part[0] != 0 && (device == NULL || _stricmp(device->name, part) != 0))
+	{
+		printf ("*** Expected a %s.\n", part);
+		return false;
+	}
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : Dump
+//
+// Desc    : Writes the "length" bytes of the device starting at "address"
+//           to the binary file "file_name".
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool Dump(const FAMILY_OPERATIONS *operations, unsigned int address, int length, const char *file_name)
+{
+	unsigned char *buffer = (unsigned char *)malloc(length);
+	if (buffer == NULL)
+	{
+		printf ("*** Out of memory dumping %i bytes.\n", length);
+		return false;
+	}
+	bool ok = operations->read_memory(address, buffer, length);
+
+	FILE *file = NULL;
+	if (ok && (fopen_s(&file, file_name, "wb") != 0 || file == NULL))
+	{
+		printf ("*** Failed to create \"%s\".\n", file_name);
+		ok = false;
+	}
+	if (ok)
+	{
+		ok = fwrite(buffer, 1, length, file) == (size_t)length;
+		fclose(file);
+	}
+	if (ok)
+	{
+		printf ("Dumped %i bytes from %06x to %s.\n", length, address, file_name);
+	}
+
+	free(buffer);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : RunStep
+//
+// Desc    : Runs one step of a job file. The session is already open.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool RunStep(const FAMILY_OPERATIONS *operations, JOB_STEP *step)
+{
+	switch (step->type)
+	{
+	case STEP_ID:
+		return CheckId(operations, step->argument);
+
+	case STEP_ERASE:
+		return operations->erase();
+
+	case STEP_PROGRAM:
+		return LoadHexFile(step->argument) && operations->program();
+
+	case STEP_EEPROM:
+		return LoadHexFile(step->argument) && operations->write_eeprom();
+
+	case STEP_VERIFY:
+		return LoadHexFile(step->argument) && operations->verify();
+
+	case STEP_DUMP:
+		return Dump(operations, step->address, step->length, step->argument);
+	}
+	return false;
+}
+
+//===========================================================================
+//
+// Name    : RunJobFile
+//
+// Desc    : Runs the steps listed in the job file "name" on a device of
+//           "family", one per line, in order:
+//
+//               id [<part>]                    Read the device ID, and check
+//                                              the part if one is given.
+//               erase                          Erase the device.
+//               program <hex_file>             Program and verify.
+//               eeprom <hex_file>              Program only the data EEPROM.
+//               verify <hex_file>              Verify without programming.
+//               dump <address> <length> <file> Save memory to a binary file.
+//
+//           Blank lines and lines starting with '#' are ignored. The whole
+//           file is checked before the device is touched. The steps then
+//           run in a single session (the target is powered up, or put in
+//           programming mode, once) and the job stops at the first step
+//           that fails.
+//
+// Returns : True if all steps succeeded, false otherwise.
+//
+//===========================================================================
+bool RunJobFile(FAMILY family, char *name)
+{
+	const FAMILY_OPERATIONS *operations = FamilyOperations(family);
+
+	FILE *file = NULL;
+	if (fopen_s(&file, name, "r") != 0 || file == NULL)
+	{
+		printf ("*** Failed to open the job file \"%s\".\n", name);
+		return false;
+	}
+
+	JOB_STEP *steps = (JOB_STEP *)malloc(MAX_JOB_STEPS * sizeof(JOB_STEP));
+	if (steps == NULL)
+	{
+		printf ("*** Out of memory reading the job file \"%s\".\n", name);
+		fclose(file);
+		return false;
+	}
+	int number_of_steps = 0;
+	int line_number = 0;
+	bool ok = true;
+
+	char line[MAX_LINE_LENGTH];
+	while (ok && fgets(line, sizeof(line), file) != NULL)
+	{
+		line_number++;
+
+		char *words[MAX_STEP_WORDS + 1];
+		int count = SplitWords(line, words, MAX_STEP_WORDS + 1);
+		if (count == 0 || words[0][0] == '#')
+		{
+			continue;
+		}
+		if (number_of_steps == MAX_JOB_STEPS)
+		{
+			printf ("*** Line %i: a job file can have at most %i steps.\n", line_number, MAX_JOB_STEPS);
+			ok = false;
+			break;
+		}
+		ok = ParseStep(operations, words, count, line_number, &steps[number_of_steps++]);
+	}
+	fclose(file);
+
+	if (ok)
+	{
+		ok = operations->begin_session();
+		if (ok)
+		{
+			for (int i = 0; i < number_of_steps && ok; i++)
+			{
+				ok = RunStep(operations, &steps[i]);
+				if (!ok)
+				{
+					printf ("*** Line %i failed, stopping.\n", steps[i].line);
+				}
+			}
+			ok = operations->end_session() && ok;
+		}
+	}
+
+	free(steps);
+
+	printf (ok ? "Job done.\n" : "*** Job failed.\n");
+	return ok;
+}
@@ -0,0 +1,15 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef JOBFILE_H
+#define JOBFILE_H
+
+#include "Devices.h"
+
+int SplitWords(char *line, char *words[], int max_words);
+bool RunJobFile(FAMILY family, char *name);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "windows.h"
+#include "Log.h"
+#include "PacketQueue.h"
+
+/*
+ * Diagnostic packets waiting to be printed by the logger thread. The USB
+ * reader thread is the only producer.
+ */
+static PACKET_QUEUE log_queue;
+static HANDLE logger_thread = NULL;
+static HANDLE logger_event = NULL;
+static volatile LONG stop_logger = 0;
+
+//===========================================================================
+//
+// Name    : IsLogPacket
+//
+// Desc    : Tells if the "length" bytes in "packet" are a "DEBU" or "TEXT"
+//           diagnostic packet.
+//
+// Returns : True if they are, false otherwise.
+//
+//===========================================================================
+bool IsLogPacket(const unsigned char *packet, int length)
+{
+	return length > 4
+		&& ((packet[0] == 'D' && packet[1] == 'E' && packet[2] == 'B' && packet[3] == 'U')
+			|| (packet[0] == 'T' && packet[1] == 'E' && packet[2] == 'X' && packet[3] == 'T'));
+}
+
+//===========================================================================
+//
+// Name    : PrintLogPacket
+//
+// Desc    : Prints a diagnostic packet. "DEBU" data is printed as words (32
+//           bit) if it is a whole number of them, and as bytes otherwise.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void PrintLogPacket(const unsigned char *packet, int length)
+{
+	if (packet[0] == 'D')
+	{
+		printf("DEBU: ");
+		if ((length % 4) == 0)
+		{
+			//
+			// Treat the bytes as an array of words (32 bit).
+			//
+			const unsigned int *words = (const unsigned int *)&packet[4];
+
+			for (int i = 0; i < (length - 4) / 4; i++)
+			{
+				printf("%08x ", words[i]);
+			}
+		}
+		else
+		{
+			for (int i = 0; i < length - 4; i++)
+			{
+				printf("%02x ", packet[i + 4]);
+			}
+		}
+		printf("\n");
+	}
+	else
+	{
+		printf("TEXT: %.*s\n", length - 4, &packet[4]);
+	}
+}
+
+//===========================================================================
+//
+// Name    : LoggerThread
+//
+// Desc    : Prints queued diagnostic packets until StopLogger is called.
+//
+// Returns : 0.
+//
+//===========================================================================
+static DWORD WINAPI LoggerThread(void *)
+{
+	unsigned char packet[PACKET_SIZE];
+	int length;
+
+	do
+	{
+		WaitForSingleObject(logger_event, 100);
+		while (PopPacket(&log_queue, packet, &length))
+		{
+			PrintLogPacket(packet, length);
+		}
+	}
+	while (!stop_logger);
+
+	//
+	// Anything queued just before we were told to stop.
+	//
+	while (PopPacket(&log_queue, packet, &length))
+	{
+		PrintLogPacket(packet, length);
+	}
+
+	return 0;
+}
+
+//===========================================================================
+//
+// Name    : Log
+//
+// Desc    : Hands the diagnostic packet in "packet" to the logger. If the
+//           logger thread is running (see StartLogger) the packet is queued
+//           and printed later; otherwise it is printed right away. Only one
+//           thread may call Log while the logger thread runs.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void Log(const unsigned char *packet, int length)
+{
+	if (logger_thread == NULL)
+	{
+		PrintLogPacket(packet, length);
+		return;
+	}
+
+	if (!PushPacket(&log_queue, packet, length))
+	{
+		printf("+++ Dropped a diagnostic packet from the programmer.\n");
+		return;
+	}
+	SetEvent(logger_event);
+}
+
+//===========================================================================
+//
+// Name    : StartLogger
+//
+// Desc    : Starts the logger thread.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void StartLogger()
+{
+	InitPacketQueue(&log_queue);
+	stop_logger = 0;
+	logger_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	logger_thread = CreateThread(NULL, 0, LoggerThread, NULL, 0, NULL);
+}
+
+//===========================================================================
+//
+// Name    : StopLogger
+//
+// Desc    : Prints any diagnostic packets still queued and stops the logger
+//           thread.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void StopLogger()
+{
+	if (logger_thread == NULL)
+	{
+		return;
+	}
+
+	InterlockedExchange(&stop_logger, 1);
+	SetEvent(logger_event);
+	WaitForSingleObject(logger_thread, INFINITE);
+
+	CloseHandle(logger_thread);
+	CloseHandle(logger_event);
+	logger_thread = NULL;
+	logger_event = NULL;
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * The programmer firmware may at any time send diagnostic packets, starting
+ * with "DEBU" (followed by binary data) or "TEXT" (followed by a string).
+ * They are not answers to commands and are printed by the logger instead.
+ */
+bool IsLogPacket(const unsigned char *packet, int length);
+void Log(const unsigned char *packet, int length);
+void StartLogger();
+void StopLogger();
+
+#endif
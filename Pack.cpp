@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "string.h"
+#include "Pack.h"
+
+//===========================================================================
+//
+// Name    : WordAt
+//
+// Desc    : Gives word number "index" of "bytes".
+//
+// Returns : The word.
+//
+//===========================================================================
+static unsigned int WordAt(const unsigned char *bytes, unsigned int index)
+{
+	const unsigned char *word = &bytes[index * 4];
+
+	return word[0] | (word[1] << 8) | (word[2] << 16) | ((unsigned int)word[3] << 24);
+}
+
+//===========================================================================
+//
+// Name    : StartsFill
+//
+// Desc    : Tells if a fill run should start at word "index" of the "words"
+//           words in "bytes": the word is all zeros or all ones, which
+//           take a single byte, or it is repeated, which takes less than
+//           sending it twice.
+//
+// Returns : True if it should, false otherwise.
+//
+//===========================================================================
+static bool StartsFill(const unsigned char *bytes, unsigned int index, unsigned int words)
+{
+	unsigned int word = WordAt(bytes, index);
+
+	return word == 0x00000000
+		|| word == 0xffffffff
+		|| (index + 1 < words && WordAt(bytes, index + 1) == word);
+}
+
+//===========================================================================
+//
+// Name    : PackWords
+//
+// Desc    : Packs the "words" words in "bytes" into "packed" (see Pack.h),
+//           which must have room for 4 * "words" + "words" / 15 + 1 bytes.
+//
+// Returns : The number of bytes in "packed".
+//
+//===========================================================================
+int PackWords(const unsigned char *bytes, unsigned int words, unsigned char *packed)
+{
+	int length = 0;
+	unsigned int i = 0;
+
+	while (i < words)
+	{
+		unsigned int first = i;
+
+		if (StartsFill(bytes, i, words))
+		{
+			unsigned int word = WordAt(bytes, i);
+			do
+			{
+				i++;
+			}
+			while (i < words && i - first < PACKED_MAX_RUN && WordAt(bytes, i) == word);
+
+			if (word == 0x00000000)
+			{
+				packed[length++] = static_cast<unsigned char>(0x40 + i - first - 1);
+			}
+			else if (word == 0xffffffff)
+			{
+				packed[length++] = static_cast<unsigned char>(0x80 + i - first - 1);
+			}
+			else
+			{
+				packed[length++] = static_cast<unsigned char>(0xc0 + i - first - 1);
+				memcpy(&packed[length], &bytes[first * 4], 4);
+				length += 4;
+			}
+		}
+		else
+		{
+			do
+			{
+				i++;
+			}
+			while (i < words && i - first < PACKED_LITERAL_WORDS && !StartsFill(bytes, i, words));
+
+			packed[length++] = static_cast<unsigned char>(i - first - 1);
+			memcpy(&packed[length], &bytes[first * 4], (i - first) * 4);
+			length += (i - first) * 4;
+		}
+	}
+
+	return length;
+}
+
+//===========================================================================
+//
+// Name    : PackedRunLength
+//
+// Desc    : Looks at the run starting at "packed" and puts the number of
+//           words it codes in "*words".
+//
+// Returns : The number of bytes of the run.
+//
+//===========================================================================
+int PackedRunLength(const unsigned char *packed, unsigned int *words)
+{
+	unsigned char t = packed[0];
+
+	if (t < 0x40)
+	{
+		*words = t + 1;
+		return 1 + 4 * (t + 1);
+	}
+	*words = (t & 0x3f) + 1;
+	return t < 0xc0 ? 1 : 5;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef PACK_H
+#define PACK_H
+
+/*
+ * PIC32MX rows packed for COMMAND_SEND_BUFFER_PACKED. The words of a row are
+ * coded as a sequence of runs, each starting with a byte "t":
+ *
+ *   0x00 - 0x3f  t + 1 literal words follow,
+ *   0x40 - 0x7f  t - 0x3f words of 0x00000000,
+ *   0x80 - 0xbf  t - 0x7f words of 0xffffffff (erased flash),
+ *   0xc0 - 0xff  t - 0xbf copies of the word that follows.
+ *
+ * Words are little endian, as in the hex file. No run is longer than
+ * PACKED_LITERAL_WORDS literal words, so every run fits in one packet.
+ */
+#define PACKED_MAX_RUN        64
+#define PACKED_LITERAL_WORDS  15
+
+int PackWords(const unsigned char *bytes, unsigned int words, unsigned char *packed);
+int PackedRunLength(const unsigned char *packed, unsigned int *words);
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "string.h"
+#include "PacketQueue.h"
+
+//===========================================================================
+//
+// Name    : InitPacketQueue
+//
+// Desc    : Empties "queue".
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void InitPacketQueue(PACKET_QUEUE *queue)
+{
+	queue->head = 0;
+	queue->tail = 0;
+}
+
+//===========================================================================
+//
+// Name    : PushPacket
+//
+// Desc    : Adds a copy of the "length" (at most PACKET_SIZE) bytes in
+//           "bytes" to the end of "queue". A negative "length" queues an
+//           empty packet that carries just the length, which is useful for
+//           passing on errors. Called by the producer thread only.
+//
+// Returns : True if successful, false if the queue is full.
+//
+//===========================================================================
+bool PushPacket(PACKET_QUEUE *queue, const unsigned char *bytes, int length)
+{
+	LONG head = queue->head;
+
+	if (head - queue->tail == PACKET_QUEUE_LENGTH)
+	{
+		return false;
+	}
+
+	int slot = head & (PACKET_QUEUE_LENGTH - 1);
+	if (length > 0)
+	{
+		memcpy(queue->packets[slot], bytes, length);
+	}
+	queue->lengths[slot] = length;
+
+	//
+	// Make sure the packet is in place before the consumer can see it.
+	//
+	MemoryBarrier();
+	InterlockedExchange(&queue->head, head + 1);
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : PopPacket
+//
+// Desc    : Removes the first packet of "queue" and copies it into "bytes"
+//           (which must hold PACKET_SIZE bytes). "*length" receives its
+//           length. Called by the consumer thread only.
+//
+// Returns : True if successful, false if the queue is empty.
+//
+//===========================================================================
+bool PopPacket(PACKET_QUEUE *queue, unsigned char *bytes, int *length)
+{
+	LONG tail = queue->tail;
+
+	if (queue->head == tail)
+	{
+		return false;
+	}
+
+	//
+	// Make sure we read the packet only after seeing the new head.
+	//
+	MemoryBarrier();
+
+	int slot = tail & (PACKET_QUEUE_LENGTH - 1);
+	*length = queue->lengths[slot];
+	if (*length > 0)
+	{
+		memcpy(bytes, queue->packets[slot], *length);
+	}
+
+	//
+	// Make sure the packet has been copied before the slot can be reused.
+	//
+	MemoryBarrier();
+	InterlockedExchange(&queue->tail, tail + 1);
+	return true;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef PACKETQUEUE_H
+#define PACKETQUEUE_H
+
+#include "windows.h"
+
+#define PACKET_QUEUE_LENGTH  64  // Must be a power of two.
+#define PACKET_SIZE          64
+
+/*
+ * A queue of USB packets passed from exactly one producer thread to exactly
+ * one consumer thread without locking. The producer only writes "head" and
+ * the consumer only writes "tail"; each publishes its index after the
+ * packet it guards has been written or read.
+ */
+typedef struct {
+	unsigned char packets[PACKET_QUEUE_LENGTH][PACKET_SIZE];
+	int lengths[PACKET_QUEUE_LENGTH];
+	volatile LONG head;
+	volatile LONG tail;
+} PACKET_QUEUE;
+
+void InitPacketQueue(PACKET_QUEUE *queue);
+bool PushPacket(PACKET_QUEUE *queue, const unsigned char *bytes, int length);
+bool PopPacket(PACKET_QUEUE *queue, unsigned char *bytes, int *length);
+
+#endif
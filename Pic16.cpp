@@ -9,177 +9,358 @@
 #include "windows.h"
 #include "Usb.h"
 #include "HexFile.h"
+#include "Devices.h"
+#include "Commands.h"
+#include "Capabilities.h"
+#include "Crc32.h"
+#include "Image.h"
+#include "Verify.h"
+#include "Family.h"
+#include "Trace.h"
+#include "Pic16.h"
 
-#define READBYTES_16			0x20
-#define	PROGRAMBYTES_16			0x21
-#define	PROGRAMCONFIGWORD_16	0x22
-#define ERASE_16				0x23
-#define VDDON_16				0x24
-#define VPPON_16				0x25
-#define VPPVDDOFF_16			0x26
+//
+// The data EEPROM is mapped to device address 0x2100 (0x4200 in the hex file,
+// as all addresses are doubled). Each EEPROM byte occupies the low byte of a
+// 14 bit word. EEPROM_SIZE_16 is the largest EEPROM of any part. The EEPROM
+// is transferred in blocks of EEPROM_BLOCK_SIZE bytes, which leaves room for
+// the command header in a 64 byte USB packet.
+//
+#define EEPROM_START_16			0x2100
+#define EEPROM_SIZE_16			256
+#define EEPROM_BLOCK_SIZE_16	32
+
+//
+// The number of BeginSession16 calls not yet matched by EndSession16.
+//
+static int session_depth = 0;
 
 //===========================================================================
 //
-// Name    : ReceiveOk16
+// Name    : BeginSession16
 //
-// Desc    : .
+// Desc    : Powers up the target (Vdd, then Vpp) unless a session is already
+//           open, in which case the target stays powered and the session is
+//           only nested. Each successful call must be matched by
+//           EndSession16. If powering up fails, the target is powered down
+//           again and no session is open.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ReceiveOk16 ()
+bool BeginSession16()
 {
-	unsigned char response[64];
-	int bytes_received = 64;
-
-	if (!Receive(response, &bytes_received))
+	if (session_depth > 0)
 	{
-		printf("*** Waiting for an OK, but nothing came.\n");
-		return false;
-	}
-	if (bytes_received != 2)
-	{
-		printf("*** Waiting for an OK, but got %i bytes rather than 2.\n", bytes_received);
-		return false;
+		session_depth++;
+		return true;
 	}
 
-	if (response[0] != 'O' || response[1] != 'K')
+	if (!PowerUpAndSettleT<PIC16_TRAITS>())
 	{
-		printf("*** Waiting for an OK, but got \"%c%c\".\n", response[0], response[1]);
+		PowerDownT<PIC16_TRAITS>();
 		return false;
 	}
-
+	session_depth = 1;
 	return true;
 }
 
 //===========================================================================
 //
-// Name    : VddOn16
+// Name    : EndSession16
 //
-// Desc    : Turns on Vdd (+5V) on the target PIC.
+// Desc    : Ends a session begun by BeginSession16. The target is powered
+//           down when the outermost session ends.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool VddOn16 ()
+bool EndSession16()
 {
-	unsigned char command[] = {VDDON_16};
+	if (--session_depth > 0)
+	{
+		return true;
+	}
 
-	return Send(command, 1) && ReceiveOk16();
+	return PowerDownT<PIC16_TRAITS>();
 }
 
 //===========================================================================
 //
-// Name    : VppOn16
+// Name    : ReadBytes16
 //
-// Desc    : Turns on Vpp (+12V) on the target PIC.
+// Desc    : Reads "length" bytes from the target PIC into "buffer" starting
+//           at address "address".
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool VppOn16 ()
+bool ReadBytes16 (unsigned int address, unsigned char *buffer, int length)
 {
-	unsigned char command[] = {VPPON_16};
-
-	return Send(command, 1) && ReceiveOk16();
+	return ReadBytesT<PIC16_TRAITS>(address, buffer, length);
 }
 
 //===========================================================================
 //
-// Name    : VppVddOff16
+// Name    : ProgramBytes16
 //
-// Desc    : Turns off Vpp and Vdd. Vdd must be turned off after Vpp, but no
-//           longer than 100ns after. In reality we have no choice but to turn
-//           them off at the same time.
+// Desc    : Writes "length" bytes to the target PIC from "buffer" starting
+//           at address "address", in commands of at most the transfer size
+//           of "device".
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool VppVddOff16 ()
+bool ProgramBytes16 (const DEVICE *device, unsigned int address, unsigned char *buffer, int length)
 {
-	unsigned char command[] = {VPPVDDOFF_16};
-
-	return Send(command, 1) && ReceiveOk16();
+	return ProgramBytesT<PIC16_TRAITS>(device, address, buffer, length);
 }
 
 //===========================================================================
 //
-// Name    : ReadBytes16
+// Name    : ProgramConfigWord16
 //
-// Desc    : Reads "length" bytes from the target PIC into "buffer" starting
-//           at address "address".
+// Desc    : Write configuration word "word".
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ReadBytes16 (unsigned int address, unsigned char *buffer, int length)
+bool ProgramConfigWord16 (unsigned short int word)
 {
 	unsigned char command[] = {
-		READBYTES_16,
-		static_cast<unsigned char>((address & 0x0000ff00) >> 8),
-		static_cast<unsigned char>((address & 0x000000ff) >> 0),
-		static_cast<unsigned char>(length)
+		PROGRAMCONFIGWORD_16,
+		static_cast<unsigned char>(word & 0x00ff),
+		static_cast<unsigned char>(word >> 8)
 	};
 	
-	if (!Send(command, 4))
-	{
-		return false;
-	}
-
-	int bytes_received = length;
-	if (!Receive(buffer, &bytes_received))
-	{
-		return false;
-	}
+	double start = TraceTime();
+	bool ok = Send(command, 3) && ReceiveOkT<PIC16_TRAITS>();
+	TraceSpan("config", "target", start, 0x2007, -1);
+	return ok;
+}
 
-	return true;
+//===========================================================================
+//
+// Name    : ReadEeprom16
+//
+// Desc    : Reads "length" bytes from the data EEPROM of the target PIC into
+//           "buffer" starting at EEPROM address "address". "length" must not
+//           exceed EEPROM_BLOCK_SIZE_16.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadEeprom16 (unsigned int address, unsigned char *buffer, int length)
+{
+	return ReadEepromT<PIC16_TRAITS>(address, buffer, length);
 }
 
 //===========================================================================
 //
-// Name    : ProgramBytes16
+// Name    : ProgramEeprom16
 //
-// Desc    : Writes "length" bytes to the target PIC from "buffer" starting
-//           at address "address".
+// Desc    : Writes "length" bytes from "buffer" to the data EEPROM of the
+//           target PIC starting at EEPROM address "address". "length" must
+//           not exceed EEPROM_BLOCK_SIZE_16.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ProgramBytes16 (unsigned int address, unsigned char *buffer, int length)
+bool ProgramEeprom16 (unsigned int address, unsigned char *buffer, int length)
 {
-	unsigned char command[200] = {
-		PROGRAMBYTES_16,
-		static_cast<unsigned char>((address & 0x0000ff00) >> 8),
-		static_cast<unsigned char>((address & 0x000000ff) >> 0)
-	};
-	memcpy(&command[3], buffer, length);
+	return ProgramEepromT<PIC16_TRAITS>(address, buffer, length);
+}
 
-	return Send(command, length + 3) && ReceiveOk16();
+//===========================================================================
+//
+// Name    : IsEepromAddress16
+//
+// Desc    : Tells if the device (word) address "device_address" is in the
+//           data EEPROM.
+//
+// Returns : True if it is, false otherwise.
+//
+//===========================================================================
+bool IsEepromAddress16 (unsigned int device_address)
+{
+	return EEPROM_START_16 <= device_address && device_address < EEPROM_START_16 + EEPROM_SIZE_16;
 }
 
 //===========================================================================
 //
-// Name    : ProgramConfigWord16
+// Name    : ProgramAndVerifyEeprom16
 //
-// Desc    : Write configuration word "word".
+// Desc    : Collects the data EEPROM bytes of the hex file into an image and
+//           writes it to the device one block at a time. Firmware without
+//           CAPABILITY_EEPROM only gets a warning. Each block is read
+//           from the device first and only written if the content differs,
+//           after which it is read back and verified. If "program" is false
+//           nothing is written, and a block that differs is a verification
+//           error.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ProgramConfigWord16 (unsigned short int word)
+bool ProgramAndVerifyEeprom16 (const DEVICE *device, bool program)
 {
-	unsigned char command[] = {
-		PROGRAMCONFIGWORD_16,
-		static_cast<unsigned char>(word & 0x00ff),
-		static_cast<unsigned char>(word >> 8)
-	};
-	
-	return Send(command, 3) && ReceiveOk16();
+	unsigned char image[EEPROM_SIZE_16];
+	bool used[EEPROM_SIZE_16] = {false};
+	bool any_used = false;
+
+	for (int seg = 0; seg < g_number_of_segments; seg++)
+	{
+		for (int i = 0; i < g_memory_segment[seg].length; i += 2)
+		{
+			//
+			// Only the even (low) byte of each hex file word holds EEPROM data.
+			//
+			unsigned int device_address = (g_memory_segment[seg].address + i) / 2;
+			if (IsEepromAddress16(device_address))
+			{
+				image[device_address - EEPROM_START_16] = g_memory_segment[seg].bytes[i];
+				used[device_address - EEPROM_START_16] = true;
+				any_used = true;
+			}
+		}
+	}
+	if (!any_used)
+	{
+		return true;
+	}
+	if (!(Capabilities() & CAPABILITY_EEPROM))
+	{
+		printf ("+++ EEPROM data not supported by the programmer firmware!\n");
+		return true;
+	}
+	for (int i = device->eeprom_size; i < EEPROM_SIZE_16; i++)
+	{
+		if (used[i])
+		{
+			printf ("\n*** The hex file has EEPROM data at %02x, but the %s only has %i bytes of EEPROM.\n",
+					i,
+					device->name,
+					device->eeprom_size);
+			return false;
+		}
+	}
+
+	int blocks_written = 0;
+	for (int block = 0; block < (int)device->eeprom_size; block += EEPROM_BLOCK_SIZE_16)
+	{
+		bool block_used = false;
+		for (int i = 0; i < EEPROM_BLOCK_SIZE_16 && !block_used; i++)
+		{
+			block_used = used[block + i];
+		}
+		if (!block_used)
+		{
+			continue;
+		}
+
+		//
+		// Merge the image into what is already in the device, so bytes not
+		// mentioned in the hex file are left alone, and skip the block if
+		// nothing changed.
+		//
+		unsigned char buffer[EEPROM_BLOCK_SIZE_16];
+		if (!ReadEeprom16(block, buffer, EEPROM_BLOCK_SIZE_16))
+		{
+			printf ("\n*** Failed to read the data EEPROM at %02x.\n", block);
+			return false;
+		}
+		unsigned char merged[EEPROM_BLOCK_SIZE_16];
+		for (int i = 0; i < EEPROM_BLOCK_SIZE_16; i++)
+		{
+			merged[i] = used[block + i] ? image[block + i] : buffer[i];
+		}
+		if (memcmp(merged, buffer, EEPROM_BLOCK_SIZE_16) == 0)
+		{
+			continue;
+		}
+
+		if (!program)
+		{
+			for (int i = 0; i < EEPROM_BLOCK_SIZE_16; i++)
+			{
+				if (buffer[i] != merged[i])
+				{
+					printf ("\n*** Verification Error: EEPROM byte %02x should be %02x, but reads as %02x.\n",
+							block + i,
+							merged[i],
+							buffer[i]);
+					break;
+				}
+			}
+			return false;
+		}
+
+		if (!ProgramEeprom16(block, merged, EEPROM_BLOCK_SIZE_16)
+			|| !ReadEeprom16(block, buffer, EEPROM_BLOCK_SIZE_16))
+		{
+			printf ("\n*** Failed to program the data EEPROM at %02x.\n", block);
+			return false;
+		}
+		for (int i = 0; i < EEPROM_BLOCK_SIZE_16; i++)
+		{
+			if (buffer[i] != merged[i])
+			{
+				printf ("\n*** Verification Error: EEPROM byte %02x should be %02x, but reads as %02x.\n",
+						block + i,
+						merged[i],
+						buffer[i]);
+				return false;
+			}
+		}
+		blocks_written++;
+	}
+
+	if (program)
+	{
+		printf ("EEPROM: %i block(s) of %i bytes written.\n", blocks_written, EEPROM_BLOCK_SIZE_16);
+	}
+
+	return true;
 }
 
 //===========================================================================
 //===========================================================================
 
+//===========================================================================
+//
+// Name    : DumpEeprom16
+//
+// Desc    : Write the contents of the first "length" bytes of the data
+//           EEPROM. "length" should be a multiple of 16.
+//
+// Returns : True if successfull, false otherwise.
+//
+//===========================================================================
+bool DumpEeprom16(int length)
+{
+	unsigned char buffer[EEPROM_BLOCK_SIZE_16];
+
+	for (int block = 0; block < length; block += EEPROM_BLOCK_SIZE_16)
+	{
+		int block_length = (length - block < EEPROM_BLOCK_SIZE_16) ? length - block : EEPROM_BLOCK_SIZE_16;
+		if (!ReadEeprom16 (block, buffer, block_length))
+		{
+			return false;
+		}
+
+		for (int i = 0; i < block_length; i += 16)
+		{
+			printf ("%02x : ", block + i);
+			for (int j = 0; j < 16; j++)
+			{
+				printf ("%02x ", buffer[i + j]);
+			}
+			printf ("\n");
+		}
+	}
+
+	return true;
+}
+
 //===========================================================================
 //
 // Name    : DumpDevice16
@@ -226,31 +407,242 @@ bool DumpDevice16(int address, int words)
 
 //===========================================================================
 //
-// Name    : Erase16
+// Name    : ReadCrcs16
 //
-// Desc    : 
+// Desc    : Asks the programmer for the CRC32s of "count" address ranges.
+//           The addresses are hex file addresses, twice the device address.
+//           Up to 15 ranges fit in one command.
 //
-// Returns : Nothing.
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadCrcs16(const unsigned int *addresses, const unsigned int *lengths, int count, unsigned int *crcs)
+{
+	return ReadCrcsT<PIC16_TRAITS>(addresses, lengths, count, crcs);
+}
+
+//===========================================================================
+//
+// Name    : ReadDeviceIdWord16
+//
+// Desc    : Reads the device ID word at 0x2006 into "device_id".
+//
+// Returns : True if successfull, false otherwise.
+//
+//===========================================================================
+bool ReadDeviceIdWord16(unsigned int *device_id)
+{
+	unsigned char buffer[16];
+
+	if (!ReadBytes16(0x2000, buffer, 16))
+	{
+		return false;
+	}
+
+	*device_id = buffer[13] << 8 | buffer[12];
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : DetectDevice16
+//
+// Desc    : Reads the device ID and looks the part up in the device table.
+//           Vdd and Vpp must be on.
+//
+// Returns : The part, or a conservative default if the part is unknown.
 //
 //===========================================================================
-void Erase16()
+const DEVICE *DetectDevice16()
 {
-	VddOn16 ();
-	VppOn16 ();
+	unsigned int device_id;
+	const DEVICE *device = NULL;
+
+	if (ReadDeviceIdWord16(&device_id))
+	{
+		device = FindDevice(FAMILY_PIC16, device_id);
+	}
+
+	return device != NULL ? device : DefaultDevice(FAMILY_PIC16);
+}
+
+//===========================================================================
+//
+// Name    : RewriteRuns16
+//
+// Desc    : Programs the segments of the hex file that the "count" runs in
+//           "runs" fall in again, widening each run to them. Each word is
+//           erased as it is written, so any word can simply be programmed
+//           again, and so can the CONFIG word. "context" is the device.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool RewriteRuns16(void *context, VERIFY_RUN *runs, int count)
+{
+	const DEVICE *device = (const DEVICE *)context;
+	bool ok = true;
+
+	for (int i = 0; i < count && ok; i++)
+	{
+		unsigned int low = runs[i].address;
+		unsigned int high = runs[i].address + runs[i].length;
+
+		for (int seg = 0; seg < g_number_of_segments && ok; seg++)
+		{
+			unsigned int address = g_memory_segment[seg].address;
+			unsigned int end = address + g_memory_segment[seg].length;
+			if (end <= runs[i].address || address >= runs[i].address + runs[i].length)
+			{
+				continue;
+			}
+
+			unsigned short int device_address = address / 2;
+			if (device_address < device->flash_size / 2)
+			{
+				ok = ProgramBytes16 (device,
+									device_address,
+									g_memory_segment[seg].bytes,
+									g_memory_segment[seg].length);
+			}
+			else if (device_address == 0x2007)
+			{
+				unsigned short int word = g_memory_segment[seg].bytes[0] | (g_memory_segment[seg].bytes[1] << 8);
+				ok = ProgramConfigWord16 (word);
+			}
+			else
+			{
+				continue;
+			}
+
+			if (address < low)
+			{
+				low = address;
+			}
+			if (end > high)
+			{
+				high = end;
+			}
+		}
+
+		runs[i].address = low;
+		runs[i].length = high - low;
+	}
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : VerifyFlash16
+//
+// Desc    : Verifies that the program memory and the CONFIG word of the
+//           device match the hex file. The target must be powered. Words
+//           that differ are read back again and, if "rewrite" is set,
+//           programmed again (see RetryVerify).
+//
+// Returns : True if they match, false otherwise.
+//
+//===========================================================================
+static bool VerifyFlash16(const DEVICE *device, bool rewrite)
+{
+	double start = TraceTime();
+	bool ok = true;
 
 	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
+	// Verify... If the programmer can calculate CRCs, then only the parts
+	// of the program memory whose CRC does not match are read back. The
+	// top two bits of each word read as zero, and so does the image.
 	//
-	Sleep(100);
+	IMAGE flash;
+	CreateImage(&flash, 0, device->flash_size, device->transfer_size);
+	if (g_crc_verify)
+	{
+		AddSegmentsToImage(&flash);
+		for (unsigned int block = 0; block < flash.size / flash.block_size; block++)
+		{
+			unsigned char *bytes = ImageBlock(&flash, block);
+			for (unsigned int i = 1; bytes != NULL && i < flash.block_size; i += 2)
+			{
+				bytes[i] &= 0x3f;
+			}
+		}
+		if (!CompareImageCrcs(&flash, ReadCrcs16, 15))
+		{
+			printf ("+++ The programmer does not support CRC verification, reading back instead.\n");
+		}
+	}
+
+	VERIFIER verifier;
+	BeginVerify(&verifier, FAMILY_PIC16, device, true);
+	for (int seg = 0; seg < g_number_of_segments && ok; seg++)
+	{
+		unsigned short int device_address = g_memory_segment[seg].address / 2;
+		unsigned char buffer[MAX_SEGMENT_LENGTH];
+
+		if (IsEepromAddress16(device_address))
+		{
+			//
+			// The data EEPROM is verified by ProgramAndVerifyEeprom16.
+			//
+			continue;
+		}
+		if (IsImageVerified(&flash, g_memory_segment[seg].address, g_memory_segment[seg].length))
+		{
+			continue;
+		}
+
+		if (!ReadBytes16 (device_address, buffer, g_memory_segment[seg].length))
+		{
+			printf ("\n*** Verification Error: Failed to read words at %06x\n", device_address);
+			ok = false;
+			break;
+		}
+
+		//
+		// The mask image ignores the top two bits of each word, as this bus
+		// is only 14 bits wide. The hex file is little endian, so odd bytes
+		// are the top ones. The CONFIG word may have fewer bits still.
+		//
+		VerifyBytes(&verifier, g_memory_segment[seg].address, g_memory_segment[seg].bytes, buffer, g_memory_segment[seg].length);
+	}
+	bool match = EndVerify(&verifier);
+	ok = ok && (match || RetryVerify(&verifier, ReadMemory16, rewrite ? RewriteRuns16 : NULL, (void *)device));
+	FreeImage(&flash);
+
+	TraceSpan("verify", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : Erase16
+//
+// Desc    : 
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool Erase16()
+{
+	if (!BeginSession16 ())
+	{
+		return false;
+	}
 
 	unsigned char command[] = {ERASE_16};
 
-	if (Send(command, 1) && ReceiveOk16())
+	double start = TraceTime();
+	bool ok = Send(command, 1) && ReceiveOkT<PIC16_TRAITS>();
+	TraceSpan("erase", "target", start, TRACE_NO_ADDRESS, -1);
+	if (ok)
 	{
 		printf ("Erased!\n");
 	}
 
-	VppVddOff16 ();
+	EndSession16 ();
+
+	return ok;
 }
 
 //===========================================================================
@@ -259,18 +651,21 @@ void Erase16()
 //
 // Desc    : Writes the contents of the "memory_segments" array to the device.
 //
-// Returns : Nothing.
+// Returns : True if successful, false otherwise.
 //
 //===========================================================================
-void Program16()
+bool Program16()
 {
-	VddOn16 ();
-	VppOn16 ();
+	if (!BeginSession16 ())
+	{
+		return false;
+	}
 
 	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
+	// Different devices have different memory sizes.
 	//
-	Sleep(100);
+	const DEVICE *device = DetectDevice16();
+	bool ok = true;
 
 	//
 	// Due to the 14 bit width of the bus, each word in the device is treated
@@ -284,19 +679,17 @@ void Program16()
 		//
 		// Program...
 		//
-		for (int seg = 0; seg < g_number_of_segments; seg++)
+		for (int seg = 0; seg < g_number_of_segments && ok; seg++)
 		{
 			//		printf("\n(%i/%i, %08x, %04x) ", seg, segments, memory_segment[seg].address, memory_segment[seg].length);
 
 			unsigned short int device_address = g_memory_segment[seg].address / 2;
-			if (device_address < 0x2000)
+			if (device_address < device->flash_size / 2)
 			{
-				if (!ProgramBytes16 (device_address,
+				ok = ProgramBytes16 (device,
+									device_address,
 									g_memory_segment[seg].bytes,
-									g_memory_segment[seg].length))
-				{
-					break;
-				}
+									g_memory_segment[seg].length);
 			}
 			else if (device_address == 0x2007)
 			{
@@ -304,69 +697,137 @@ void Program16()
 				// CONFIG words will be programmed last...
 				//
 			}
+			else if (IsEepromAddress16(device_address))
+			{
+				//
+				// The data EEPROM is programmed in blocks once the CONFIG words are done.
+				//
+			}
 			else
 			{
-				printf ("ERROR: EEPROM data not supported!\n");
+				printf ("ERROR: Data at %04x not supported!\n", device_address);
 			}
 		}
 
-		for (int seg = 0; seg < g_number_of_segments; seg++)
+		for (int seg = 0; seg < g_number_of_segments && ok; seg++)
 		{
 			unsigned short int device_address = g_memory_segment[seg].address / 2;
 			if (device_address == 0x2007)
 			{
 				unsigned short int word = g_memory_segment[seg].bytes[0] | (g_memory_segment[seg].bytes[1] << 8);
-				if (!ProgramConfigWord16 (word))
-				{
-					break;
-				}
+				ok = ProgramConfigWord16 (word);
 			}
 		}
 
-		//
-		// Verify...
-		//
-		for (int seg = 0; seg < g_number_of_segments; seg++)
+		if (!ok || !ProgramAndVerifyEeprom16(device, true))
 		{
-			unsigned short int device_address = g_memory_segment[seg].address / 2;
-			unsigned char buffer[MAX_SEGMENT_LENGTH];
-
-			if (!ReadBytes16 (device_address, buffer, g_memory_segment[seg].length))
-			{
-				printf ("\n*** Verification Error: Failed to read words at %06x\n", device_address);
-				break;
-			}
-
-			for (int i = 0; i < g_memory_segment[seg].length; i++)
-			{
-				unsigned char byte = g_memory_segment[seg].bytes[i];
-
-				//
-				// If this is the high byte (of the two), then ignore the top two bits as
-				// this bus is only 14 bits wide. The hex file is little endian, so odd
-				// bytes are the top ones.
-				//
-				if ((g_memory_segment[seg].address + i) % 2)
-				{
-					byte &= 0x3f;
-				}
-				if (buffer[i] != byte)
-				{
-					printf ("\n*** Verification Error: Byte %06x should be %02x, but reads as %02x.\n",
-							device_address + i,
-							byte,
-							buffer[i]);
+			ok = false;
+			break;
+		}
 
-					break;
-				}
-			}
+		if (!VerifyFlash16(device, true))
+		{
+			ok = false;
+			break;
 		}
 
 		printf ("Programmed!\n");
 	}
 	while(0);
 
-	VppVddOff16 ();
+	EndSession16 ();
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : Verify16
+//
+// Desc    : Verifies that the device holds the contents of the
+//           "memory_segments" array, without programming anything.
+//
+// Returns : True if it does, false otherwise.
+//
+//===========================================================================
+bool Verify16()
+{
+	if (!BeginSession16 ())
+	{
+		return false;
+	}
+
+	const DEVICE *device = DetectDevice16();
+	bool ok = VerifyFlash16(device, false) && ProgramAndVerifyEeprom16(device, false);
+	if (ok)
+	{
+		printf ("Verified!\n");
+	}
+
+	EndSession16 ();
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : WriteEeprom16
+//
+// Desc    : Writes and verifies only the data EEPROM contents of the
+//           "memory_segments" array.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool WriteEeprom16()
+{
+	if (!(Capabilities() & CAPABILITY_EEPROM))
+	{
+		printf ("*** The programmer firmware cannot write the data EEPROM.\n");
+		return false;
+	}
+	if (!BeginSession16 ())
+	{
+		return false;
+	}
+
+	bool ok = ProgramAndVerifyEeprom16(DetectDevice16(), true);
+
+	EndSession16 ();
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : ReadMemory16
+//
+// Desc    : Reads "length" bytes into "buffer" starting at "address". The
+//           address is a hex file address (twice the device address) and
+//           must be even, as must "length". The target must be powered.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadMemory16(unsigned int address, unsigned char *buffer, int length)
+{
+	return ReadMemoryT<PIC16_TRAITS>(address, buffer, length);
+}
+
+//===========================================================================
+//
+// Name    : IsTargetPresent16
+//
+// Desc    : Powers up the target just long enough to read its device ID.
+//           Without a target the ID reads as all zeros or all ones, and Vpp
+//           never appears to settle. Not to be called within a session.
+//
+// Returns : True if a target answers, false otherwise.
+//
+//===========================================================================
+bool IsTargetPresent16()
+{
+	return IsTargetPresentT<PIC16_TRAITS>();
 }
 
 //===========================================================================
@@ -380,31 +841,29 @@ void Program16()
 //===========================================================================
 void ReadDeviceId16()
 {
-	VddOn16 ();
-	VppOn16 ();
-
-	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
-	//
-	Sleep(100);
+	if (!BeginSession16 ())
+	{
+		return;
+	}
 
-	unsigned char buffer[16];
+	unsigned int word;
 
-	if (ReadBytes16(0x2000, buffer, 16))
+	if (ReadDeviceIdWord16(&word))
 	{
-		unsigned short int word = buffer[13] << 8 | buffer[12];
 		printf ("Dev_ID : 0x%04x", word);
-		switch (word & 0x3fe0)
+		const DEVICE *device = FindDevice(FAMILY_PIC16, word);
+		if (device != NULL)
 		{
-		case 0x1040: printf(", a 16F627A rev %i", word & 0x001f); break;
-		case 0x1060: printf(", a 16F628A rev %i", word & 0x001f); break;
-		case 0x1100: printf(", a 16F648A rev %i", word & 0x001f); break;
-		default    : printf(", an unknown part");                 break;
+			printf(", a %s rev %i", device->name, DeviceRevision(device, word));
+		}
+		else
+		{
+			printf(", an unknown part");
 		}
 		printf(".\n");
 	}
 
-	VppVddOff16 ();
+	EndSession16 ();
 }
 
 //===========================================================================
@@ -418,17 +877,21 @@ void ReadDeviceId16()
 //===========================================================================
 void DumpDevice16()
 {
-	VddOn16 ();
-	VppOn16 ();
+	if (!BeginSession16 ())
+	{
+		return;
+	}
 
-	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
-	//
-	Sleep(100);
+	const DEVICE *device = DetectDevice16();
 
 	DumpDevice16(0x0000, 0x40);   // Program space.
 	printf ("\n");
 	DumpDevice16(0x2000, 0x08);   // Configuration words.
+	if (device->eeprom_size > 0 && (Capabilities() & CAPABILITY_EEPROM))
+	{
+		printf ("\nData EEPROM:\n");
+		DumpEeprom16(device->eeprom_size);
+	}
 
-	VppVddOff16 ();
+	EndSession16 ();
 }
@@ -7,8 +7,15 @@
 #ifndef PIC16_H
 #define PIC16_H
 
-void Erase16();
-void Program16();
+bool BeginSession16();
+bool EndSession16();
+bool Erase16();
+bool Program16();
+bool Verify16();
+bool WriteEeprom16();
+bool ReadDeviceIdWord16(unsigned int *device_id);
+bool ReadMemory16(unsigned int address, unsigned char *buffer, int length);
+bool IsTargetPresent16();
 void ReadDeviceId16();
 void DumpDevice16();
 
@@ -9,196 +9,352 @@
 #include "windows.h"
 #include "Usb.h"
 #include "HexFile.h"
+#include "Devices.h"
+#include "Commands.h"
+#include "Capabilities.h"
+#include "Crc32.h"
+#include "Image.h"
+#include "Verify.h"
+#include "Family.h"
+#include "Trace.h"
+#include "Pic18.h"
 
-#define READBYTES			0x00
-#define	PROGRAMBYTES		0x01
-#define	PROGRAMCONFIGBYTE	0x02
-#define ERASE				0x03
-#define VDDON				0x04
-#define VPPON				0x05
-#define VPPVDDOFF			0x06
+//
+// The data EEPROM is mapped to address 0xf00000 in the hex file. EEPROM_SIZE
+// is the largest EEPROM of any part. The EEPROM is transferred in blocks of
+// EEPROM_BLOCK_SIZE bytes, which leaves room for the command header in a 64
+// byte USB packet.
+//
+#define EEPROM_START		0xf00000
+#define EEPROM_SIZE			256
+#define EEPROM_BLOCK_SIZE	32
+
+//
+// The number of BeginSession18 calls not yet matched by EndSession18.
+//
+static int session_depth = 0;
 
 //===========================================================================
 //
-// Name    : ReceiveOk18
+// Name    : BeginSession18
 //
-// Desc    : .
+// Desc    : Powers up the target (Vdd, then Vpp) unless a session is already
+//           open, in which case the target stays powered and the session is
+//           only nested. Each successful call must be matched by
+//           EndSession18. If powering up fails, the target is powered down
+//           again and no session is open.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ReceiveOk18 ()
+bool BeginSession18()
 {
-	unsigned char response[64];
-	int bytes_received = 64;
-
-	if (!Receive(response, &bytes_received))
-	{
-		printf("*** Waiting for an OK, but nothing came.\n");
-		return false;
-	}
-	if (bytes_received != 2)
+	if (session_depth > 0)
 	{
-		printf("*** Waiting for an OK, but got %i bytes rather than 2.\n", bytes_received);
-		return false;
+		session_depth++;
+		return true;
 	}
 
-	if (response[0] != 'O' || response[1] != 'K')
+	if (!PowerUpAndSettleT<PIC18_TRAITS>())
 	{
-		printf("*** Waiting for an OK, but got \"%c%c\".\n", response[0], response[1]);
+		PowerDownT<PIC18_TRAITS>();
 		return false;
 	}
-
+	session_depth = 1;
 	return true;
 }
 
 //===========================================================================
 //
-// Name    : VddOn
+// Name    : EndSession18
 //
-// Desc    : Turns on Vdd (+5V) on the target PIC.
+// Desc    : Ends a session begun by BeginSession18. The target is powered
+//           down when the outermost session ends.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool VddOn ()
+bool EndSession18()
 {
-	unsigned char command[] = {VDDON};
+	if (--session_depth > 0)
+	{
+		return true;
+	}
 
-	return Send(command, 1) && ReceiveOk18();
+	return PowerDownT<PIC18_TRAITS>();
 }
 
 //===========================================================================
 //
-// Name    : VppOn
+// Name    : ReadBytes
 //
-// Desc    : Turns on Vpp (+12V) on the target PIC.
+// Desc    : Reads "length" bytes from the target PIC into "buffer" starting
+//           at address "address".
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool VppOn ()
+bool ReadBytes (unsigned int address, unsigned char *buffer, int length)
 {
-	unsigned char command[] = {VPPON};
-
-	return Send(command, 1) && ReceiveOk18();
+	return ReadBytesT<PIC18_TRAITS>(address, buffer, length);
 }
 
 //===========================================================================
 //
-// Name    : VppVddOff
+// Name    : ProgramBytes
 //
-// Desc    : Turns off Vpp and Vdd. Vdd must be turned off after Vpp, but no
-//           longer than 100ns after. In reality we have no choice but to turn
-//           them off at the same time.
+// Desc    : Writes "length" bytes to the target PIC from "buffer" starting
+//           at address "address".
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool VppVddOff ()
+bool ProgramBytes (const DEVICE *device, unsigned int address, unsigned char *buffer, int length)
 {
-	unsigned char command[] = {VPPVDDOFF};
-
-	return Send(command, 1) && ReceiveOk18();
+	return ProgramBytesT<PIC18_TRAITS>(device, address, buffer, length);
 }
 
 //===========================================================================
 //
-// Name    : ReadBytes
+// Name    : ProgramConfigByte
 //
-// Desc    : Reads "length" bytes from the target PIC into "buffer" starting
-//           at address "address".
+// Desc    : Write configuration byte "byte" into address "address". Address
+//           must be in the range 0x300000 to 0x30000d inclusive.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ReadBytes (unsigned int address, unsigned char *buffer, int length)
+bool ProgramConfigByte (unsigned int address, unsigned char byte)
 {
 	unsigned char command[] = {
-		READBYTES,
-		static_cast<unsigned char>((address & 0x00ff0000) >> 16),
-		static_cast<unsigned char>((address & 0x0000ff00) >> 8),
+		PROGRAMCONFIGBYTE,
 		static_cast<unsigned char>((address & 0x000000ff) >> 0),
-		static_cast<unsigned char>(length)
+		byte
 	};
 	
-	if (!Send(command, 5))
-	{
-		return false;
-	}
-
-	int bytes_received = length;
-	if (!Receive(buffer, &bytes_received))
-	{
-		return false;
-	}
+	double start = TraceTime();
+	bool ok = Send(command, 3) && ReceiveOkT<PIC18_TRAITS>();
+	TraceSpan("config", "target", start, address, -1);
+	return ok;
+}
 
-	return true;
+//===========================================================================
+//
+// Name    : ReadEeprom
+//
+// Desc    : Reads "length" bytes from the data EEPROM of the target PIC into
+//           "buffer" starting at EEPROM address "address". "length" must not
+//           exceed EEPROM_BLOCK_SIZE.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadEeprom (unsigned int address, unsigned char *buffer, int length)
+{
+	return ReadEepromT<PIC18_TRAITS>(address, buffer, length);
 }
 
 //===========================================================================
 //
-// Name    : ProgramBytes
+// Name    : ProgramEeprom
 //
-// Desc    : Writes "length" bytes to the target PIC from "buffer" starting
-//           at address "address".
+// Desc    : Writes "length" bytes from "buffer" to the data EEPROM of the
+//           target PIC starting at EEPROM address "address". "length" must
+//           not exceed EEPROM_BLOCK_SIZE.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ProgramBytes (unsigned int address, unsigned char *buffer, int length)
+bool ProgramEeprom (unsigned int address, unsigned char *buffer, int length)
 {
-	//
-	// Some PIC18F devices (such as the PIC18F1330) have a write buffer
-	// size of 8. For simplicity, we make all programming adhere to that
-	// limit.
-	//
-	bool ok = true;
-	for (int i = 0; i < length && ok; i += 8) {
-		unsigned int addr = address + i;
-		int len = (length - i < 8) ? length - i : 8;
-
-		unsigned char command[12] = { // Four byte header plus eight bytes of data.
-			PROGRAMBYTES,
-			static_cast<unsigned char>((addr & 0x00ff0000) >> 16),
-			static_cast<unsigned char>((addr & 0x0000ff00) >> 8),
-			static_cast<unsigned char>((addr & 0x000000ff) >> 0)
-		};
-		memcpy(&command[4], &buffer[i], len);
-
-		ok = Send(command, len + 4);
-		if (ok) {
-			ok = ReceiveOk18();
-		}
-	}
-	
-	return ok;
+	return ProgramEepromT<PIC18_TRAITS>(address, buffer, length);
 }
 
 //===========================================================================
 //
-// Name    : ProgramConfigByte
+// Name    : IsEepromAddress
 //
-// Desc    : Write configuration byte "byte" into address "address". Address
-//           must be in the range 0x300000 to 0x30000d inclusive.
+// Desc    : Tells if the hex file address "address" is in the data EEPROM.
+//
+// Returns : True if it is, false otherwise.
+//
+//===========================================================================
+bool IsEepromAddress (unsigned int address)
+{
+	return EEPROM_START <= address && address < EEPROM_START + EEPROM_SIZE;
+}
+
+//===========================================================================
+//
+// Name    : ProgramAndVerifyEeprom
+//
+// Desc    : Collects the data EEPROM bytes of the hex file into an image and
+//           writes it to the device one block at a time. Firmware without
+//           CAPABILITY_EEPROM only gets a warning. Each block is read
+//           from the device first and only written if the content differs,
+//           after which it is read back and verified. If "program" is false
+//           nothing is written, and a block that differs is a verification
+//           error.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ProgramConfigByte (unsigned int address, unsigned char byte)
+bool ProgramAndVerifyEeprom (const DEVICE *device, bool program)
 {
-	unsigned char command[] = {
-		PROGRAMCONFIGBYTE,
-		static_cast<unsigned char>((address & 0x000000ff) >> 0),
-		byte
-	};
-	
-	return Send(command, 3) && ReceiveOk18();
+	unsigned char image[EEPROM_SIZE];
+	bool used[EEPROM_SIZE] = {false};
+	bool any_used = false;
+
+	for (int seg = 0; seg < g_number_of_segments; seg++)
+	{
+		for (int i = 0; i < g_memory_segment[seg].length; i++)
+		{
+			unsigned int address = g_memory_segment[seg].address + i;
+			if (IsEepromAddress(address))
+			{
+				image[address - EEPROM_START] = g_memory_segment[seg].bytes[i];
+				used[address - EEPROM_START] = true;
+				any_used = true;
+			}
+		}
+	}
+	if (!any_used)
+	{
+		return true;
+	}
+	if (!(Capabilities() & CAPABILITY_EEPROM))
+	{
+		printf ("+++ EEPROM data not supported by the programmer firmware!\n");
+		return true;
+	}
+	for (int i = device->eeprom_size; i < EEPROM_SIZE; i++)
+	{
+		if (used[i])
+		{
+			printf ("\n*** The hex file has EEPROM data at %02x, but the %s only has %i bytes of EEPROM.\n",
+					i,
+					device->name,
+					device->eeprom_size);
+			return false;
+		}
+	}
+
+	int blocks_written = 0;
+	for (int block = 0; block < (int)device->eeprom_size; block += EEPROM_BLOCK_SIZE)
+	{
+		bool block_used = false;
+		for (int i = 0; i < EEPROM_BLOCK_SIZE && !block_used; i++)
+		{
+			block_used = used[block + i];
+		}
+		if (!block_used)
+		{
+			continue;
+		}
+
+		//
+		// Merge the image into what is already in the device, so bytes not
+		// mentioned in the hex file are left alone, and skip the block if
+		// nothing changed.
+		//
+		unsigned char buffer[EEPROM_BLOCK_SIZE];
+		if (!ReadEeprom(block, buffer, EEPROM_BLOCK_SIZE))
+		{
+			printf ("\n*** Failed to read the data EEPROM at %02x.\n", block);
+			return false;
+		}
+		unsigned char merged[EEPROM_BLOCK_SIZE];
+		for (int i = 0; i < EEPROM_BLOCK_SIZE; i++)
+		{
+			merged[i] = used[block + i] ? image[block + i] : buffer[i];
+		}
+		if (memcmp(merged, buffer, EEPROM_BLOCK_SIZE) == 0)
+		{
+			continue;
+		}
+
+		if (!program)
+		{
+			for (int i = 0; i < EEPROM_BLOCK_SIZE; i++)
+			{
+				if (buffer[i] != merged[i])
+				{
+					printf ("\n*** Verification Error: EEPROM byte %02x should be %02x, but reads as %02x.\n",
+							block + i,
+							merged[i],
+							buffer[i]);
+					break;
+				}
+			}
+			return false;
+		}
+
+		if (!ProgramEeprom(block, merged, EEPROM_BLOCK_SIZE)
+			|| !ReadEeprom(block, buffer, EEPROM_BLOCK_SIZE))
+		{
+			printf ("\n*** Failed to program the data EEPROM at %02x.\n", block);
+			return false;
+		}
+		for (int i = 0; i < EEPROM_BLOCK_SIZE; i++)
+		{
+			if (buffer[i] != merged[i])
+			{
+				printf ("\n*** Verification Error: EEPROM byte %02x should be %02x, but reads as %02x.\n",
+						block + i,
+						merged[i],
+						buffer[i]);
+				return false;
+			}
+		}
+		blocks_written++;
+	}
+
+	if (program)
+	{
+		printf ("EEPROM: %i block(s) of %i bytes written.\n", blocks_written, EEPROM_BLOCK_SIZE);
+	}
+
+	return true;
 }
 
 //===========================================================================
 //===========================================================================
 
+//===========================================================================
+//
+// Name    : DumpEeprom
+//
+// Desc    : Write the contents of the first "length" bytes of the data
+//           EEPROM. "length" should be a multiple of EEPROM_BLOCK_SIZE.
+//
+// Returns : True if successfull, false otherwise.
+//
+//===========================================================================
+bool DumpEeprom(int length)
+{
+	unsigned char buffer[EEPROM_BLOCK_SIZE];
+
+	for (int block = 0; block < length; block += EEPROM_BLOCK_SIZE)
+	{
+		if (!ReadEeprom (block, buffer, EEPROM_BLOCK_SIZE))
+		{
+			return false;
+		}
+
+		for (int i = 0; i < EEPROM_BLOCK_SIZE; i += 16)
+		{
+			printf ("%02x : ", block + i);
+			for (int j = 0; j < 16; j++)
+			{
+				printf ("%02x ", buffer[i + j]);
+			}
+			printf ("\n");
+		}
+	}
+
+	return true;
+}
+
 //===========================================================================
 //
 // Name    : DumpDevice
@@ -243,33 +399,297 @@ bool DumpDevice18(int address, int length)
 	return true;
 }
 
+//===========================================================================
+//
+// Name    : ReadDeviceIdWord18
+//
+// Desc    : Reads the device ID word at 0x3ffffe into "device_id".
+//
+// Returns : True if successfull, false otherwise.
+//
+//===========================================================================
+bool ReadDeviceIdWord18(unsigned int *device_id)
+{
+	unsigned char buffer[2];
+
+	if (!ReadBytes (0x3ffffe, buffer, 2))
+	{
+		return false;
+	}
+
+	*device_id = buffer[0] | (buffer[1] << 8);
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : DetectDevice18
+//
+// Desc    : Reads the device ID and looks the part up in the device table.
+//           Vdd and Vpp must be on.
+//
+// Returns : The part, or a conservative default if the part is unknown.
+//
+//===========================================================================
+const DEVICE *DetectDevice18()
+{
+	unsigned int device_id;
+	const DEVICE *device = NULL;
+
+	if (ReadDeviceIdWord18(&device_id))
+	{
+		device = FindDevice(FAMILY_PIC18, device_id);
+	}
+
+	return device != NULL ? device : DefaultDevice(FAMILY_PIC18);
+}
+
 //===========================================================================
 //
 // Name    : Erase18
 //
 // Desc    : 
 //
-// Returns : Nothing.
+// Returns : True if successful, false otherwise.
 //
 //===========================================================================
-void Erase18()
+bool Erase18()
 {
-	VddOn ();
-	VppOn ();
-
-	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
-	//
-	Sleep(100);
+	if (!BeginSession18 ())
+	{
+		return false;
+	}
 
 	unsigned char command[] = {ERASE};
 
-	if (Send(command, 1) && ReceiveOk18())
+	double start = TraceTime();
+	bool ok = Send(command, 1) && ReceiveOkT<PIC18_TRAITS>();
+	TraceSpan("erase", "target", start, TRACE_NO_ADDRESS, -1);
+	if (ok)
 	{
 		printf ("Erased!\n");
 	}
 
-	VppVddOff ();
+	EndSession18 ();
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : ProgramFlashBlocks
+//
+// Desc    : Writes the program flash "image" one aligned, full block of the
+//           transfer size of "device" at a time. Blocks without any data are
+//           skipped, and bytes not mentioned in the hex file are written as
+//           0xff.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ProgramFlashBlocks(const DEVICE *device, IMAGE *image)
+{
+	const unsigned int blocks = image->size / image->block_size;
+
+	bool ok = true;
+	for (unsigned int block = 0; block < blocks && ok; block++)
+	{
+		if (image->used[block])
+		{
+			ok = ProgramBytes(device, image->start + block * image->block_size, ImageBlock(image, block), image->block_size);
+		}
+	}
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : ReadCrcs18
+//
+// Desc    : Asks the programmer for the CRC32s of "count" address ranges.
+//           Up to 12 ranges fit in one command.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadCrcs18(const unsigned int *addresses, const unsigned int *lengths, int count, unsigned int *crcs)
+{
+	return ReadCrcsT<PIC18_TRAITS>(addresses, lengths, count, crcs);
+}
+
+/*
+ * What RewriteRuns18 needs besides the runs.
+ */
+typedef struct {
+	const DEVICE *device;
+	IMAGE *flash;
+} REWRITE18;
+
+//===========================================================================
+//
+// Name    : RewriteRuns18
+//
+// Desc    : Programs the bytes of the "count" runs in "runs" again: the
+//           write buffer blocks of the program flash they fall in, the
+//           segments of the ID locations and the config bytes one by one.
+//           Each run is widened to the bytes written. Flash programming can
+//           only clear bits, and only a bulk erase sets them, so runs with
+//           bits that read as 0 but should be 1 are not rewritten; the
+//           device then needs programming from scratch. "context" is a
+//           REWRITE18.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool RewriteRuns18(void *context, VERIFY_RUN *runs, int count)
+{
+	const REWRITE18 *rewrite = (const REWRITE18 *)context;
+	const DEVICE *device = rewrite->device;
+	IMAGE *flash = rewrite->flash;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (runs[i].needs_erase && runs[i].address < 0x300000)
+		{
+			printf ("*** %u byte(s) from %06x have bits that only a bulk erase can set.\n", runs[i].length, runs[i].address);
+			return false;
+		}
+	}
+
+	bool ok = true;
+	for (int i = 0; i < count && ok; i++)
+	{
+		unsigned int low = runs[i].address;
+		unsigned int high = runs[i].address + runs[i].length;
+
+		if (IsInImage(flash, runs[i].address, runs[i].length))
+		{
+			unsigned int first = (low - flash->start) / flash->block_size;
+			unsigned int last = (high - 1 - flash->start) / flash->block_size;
+			for (unsigned int block = first; block <= last && ok; block++)
+			{
+				if (flash->used[block])
+				{
+					ok = ProgramBytes(device, flash->start + block * flash->block_size, ImageBlock(flash, block), flash->block_size);
+				}
+			}
+			runs[i].address = flash->start + first * flash->block_size;
+			runs[i].length = (last + 1 - first) * flash->block_size;
+			continue;
+		}
+
+		for (int seg = 0; seg < g_number_of_segments && ok; seg++)
+		{
+			unsigned int address = g_memory_segment[seg].address;
+			unsigned int end = address + g_memory_segment[seg].length;
+			if (end <= runs[i].address || address >= runs[i].address + runs[i].length)
+			{
+				continue;
+			}
+
+			if (address >= device->flash_size && address < 0x300000)
+			{
+				//
+				// Single bytes were padded to two by Program18.
+				//
+				ok = ProgramBytes (device,
+									address,
+									g_memory_segment[seg].bytes,
+									g_memory_segment[seg].length == 1 ? 2 : g_memory_segment[seg].length);
+				if (address < low)
+				{
+					low = address;
+				}
+				if (end > high)
+				{
+					high = end;
+				}
+			}
+			else if (device->config_address <= address
+				&& address < device->config_address + device->config_size)
+			{
+				for (unsigned int a = runs[i].address; a < runs[i].address + runs[i].length && ok; a++)
+				{
+					if (address <= a && a < end)
+					{
+						ok = ProgramConfigByte (a, g_memory_segment[seg].bytes[a - address]);
+					}
+				}
+			}
+		}
+
+		runs[i].address = low;
+		runs[i].length = high - low;
+	}
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : VerifyFlash18
+//
+// Desc    : Verifies that everything but the data EEPROM of the device
+//           matches the hex file. "flash" is the image of the program flash
+//           bytes of the hex file. The target must be powered. Bytes that
+//           differ are read back again and, if "rewrite" is set,
+//           programmed again where that can fix them (see RetryVerify).
+//
+// Returns : True if they match, false otherwise.
+//
+//===========================================================================
+static bool VerifyFlash18(const DEVICE *device, IMAGE *flash, bool rewrite)
+{
+	double start = TraceTime();
+	bool ok = true;
+
+	//
+	// Verify... If the programmer can calculate CRCs, then only the parts
+	// of the program flash whose CRC does not match are read back.
+	//
+	if (g_crc_verify && !CompareImageCrcs(flash, ReadCrcs18, 12))
+	{
+		printf ("+++ The programmer does not support CRC verification, reading back instead.\n");
+	}
+
+	VERIFIER verifier;
+	BeginVerify(&verifier, FAMILY_PIC18, device, true);
+	for (int seg = 0; seg < g_number_of_segments && ok; seg++)
+	{
+		unsigned char buffer[MAX_SEGMENT_LENGTH];
+
+		if (IsEepromAddress(g_memory_segment[seg].address))
+		{
+			//
+			// The data EEPROM is verified by ProgramAndVerifyEeprom.
+			//
+			continue;
+		}
+		if (IsImageVerified(flash, g_memory_segment[seg].address, g_memory_segment[seg].length))
+		{
+			continue;
+		}
+
+		if (!ReadBytes  (g_memory_segment[seg].address, buffer, g_memory_segment[seg].length))
+		{
+			ok = false;
+			break;
+		}
+
+		//
+		// Not all config bytes are used on all devices. Unused ones are
+		// programmed 0xff, but read as 0x00, so the mask image of the part
+		// leaves them out.
+		//
+		VerifyBytes(&verifier, g_memory_segment[seg].address, g_memory_segment[seg].bytes, buffer, g_memory_segment[seg].length);
+	}
+	REWRITE18 context = {device, flash};
+	bool match = EndVerify(&verifier);
+	ok = ok && (match || RetryVerify(&verifier, ReadMemory18, rewrite ? RewriteRuns18 : NULL, &context));
+
+	TraceSpan("verify", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
 }
 
 //===========================================================================
@@ -278,36 +698,52 @@ void Erase18()
 //
 // Desc    : Writes the contents of the "memory_segments" array to the device.
 //
-// Returns : Nothing.
+// Returns : True if successful, false otherwise.
 //
 //===========================================================================
-void Program18()
+bool Program18()
 {
-	VddOn ();
-	VppOn ();
+	if (!BeginSession18 ())
+	{
+		return false;
+	}
 
 	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
+	// Read the device ID. Different devices have different write buffer sizes
+	// and use different config bytes, so we need to know how to program and
+	// what to verify.
 	//
-	Sleep(100);
+	const DEVICE *device = DetectDevice18();
 
 	//
-	// Read the device ID. Different devices use different config bytes, so we need to know what to verify.
+	// Collect the program flash bytes of the hex file into an image so they
+	// can be programmed in full write buffer blocks.
 	//
-	unsigned char buffer[2];
-	if (!ReadBytes (0x3ffffe, buffer, 2)) {
-		return;
-	}
-	unsigned short int device_id = buffer[0] | (buffer[1] << 8);
+	IMAGE flash;
+	CreateImage(&flash, 0, device->flash_size, device->transfer_size);
+	AddSegmentsToImage(&flash);
 
+	bool ok = true;
 	do
 	{
 		//
 		// Program...
 		//
-		for (int seg = 0; seg < g_number_of_segments; seg++)
+		if (!ProgramFlashBlocks(device, &flash))
 		{
-			if (g_memory_segment[seg].address < 0x300000)
+			ok = false;
+			break;
+		}
+
+		for (int seg = 0; seg < g_number_of_segments && ok; seg++)
+		{
+			if (g_memory_segment[seg].address < device->flash_size)
+			{
+				//
+				// Already programmed by ProgramFlashBlocks.
+				//
+			}
+			else if (g_memory_segment[seg].address < 0x300000)
 			{
 				//
 				// Make sure there are no single bytes as the programmer doesn't like them.
@@ -318,12 +754,10 @@ void Program18()
 					g_memory_segment[seg].bytes[1] = 0xff;
 					length = 2;
 				}
-				if (!ProgramBytes (g_memory_segment[seg].address,
+				ok = ProgramBytes (device,
+									g_memory_segment[seg].address,
 									g_memory_segment[seg].bytes,
-									length))
-				{
-					break;
-				}
+									length);
 			}
 			else if (g_memory_segment[seg].address < 0x3ffffe)
 			{
@@ -331,92 +765,148 @@ void Program18()
 				// CONFIG words will be programmed last...
 				//
 			}
+			else if (IsEepromAddress(g_memory_segment[seg].address))
+			{
+				//
+				// The data EEPROM is programmed in blocks once the CONFIG words are done.
+				//
+			}
 			else
 			{
-				printf ("ERROR: EEPROM data not supported!\n");
+				printf ("ERROR: Data at %06x not supported!\n", g_memory_segment[seg].address);
 			}
 		}
 
-		for (int seg = 0; seg < g_number_of_segments; seg++)
+		for (int seg = 0; seg < g_number_of_segments && ok; seg++)
 		{
-			if (0x300000 <= g_memory_segment[seg].address
-				&& g_memory_segment[seg].address < 0x30000d)
+			if (device->config_address <= g_memory_segment[seg].address
+				&& g_memory_segment[seg].address < device->config_address + device->config_size)
 			{
-				for (int i = 0; i < g_memory_segment[seg].length; i++)
+				for (int i = 0; i < g_memory_segment[seg].length && ok; i++)
 				{
-					if (!ProgramConfigByte (g_memory_segment[seg].address + i,
-										g_memory_segment[seg].bytes[i]))
-					{
-						break;
-					}
+					ok = ProgramConfigByte (g_memory_segment[seg].address + i,
+										g_memory_segment[seg].bytes[i]);
 				}
 			}
 		}
 
-		//
-		// Verify...
-		//
-		bool error_found = false;
-		for (int seg = 0; seg < g_number_of_segments && !error_found; seg++)
+		if (!ok || !ProgramAndVerifyEeprom(device, true))
 		{
-			unsigned char buffer[MAX_SEGMENT_LENGTH];
+			ok = false;
+			break;
+		}
 
-			if (!ReadBytes  (g_memory_segment[seg].address, buffer, g_memory_segment[seg].length))
-			{
-				break;
-			}
+		if (!VerifyFlash18(device, &flash, true))
+		{
+			ok = false;
+			break;
+		}
 
-			for (int i = 0; i < g_memory_segment[seg].length; i++)
-			{
-				//
-				// Not all config bytes are used on all devices. Unused ones
-				// are programmed 0xff, but read as 0x00, so they should not
-				// be verified.
-				//
-				boolean check_this_byte = true;
-				unsigned int addr = g_memory_segment[seg].address + i;
-				switch (device_id & 0xffe0) // Mask away the revision number.
-				{
-				case 0x1200:
-				case 0x1220:
-				case 0x1240:
-				case 0x1260:
-				case 0x5c00:
-				case 0x5c20:
-				case 0x5c60:
-				case 0x5d20:
-				case 0x5d60:
-					if (addr == 0x00300004) check_this_byte = false;
-					if (addr == 0x00300007) check_this_byte = false;
-					break;
+		printf ("Programmed!\n");
+	}
+	while(0);
 
-				case 0x1e00:
-				case 0x1e20:
-				case 0x1ee0:
-					if (addr == 0x00300000) check_this_byte = false;
-					if (addr == 0x00300007) check_this_byte = false;
-					break;
-				}
+	FreeImage(&flash);
 
-				if (check_this_byte && buffer[i] != g_memory_segment[seg].bytes[i])
-				{
-					printf ("\n*** Verification Error: Byte %06x should be %02x, but reads as %02x.\n",
-							g_memory_segment[seg].address + i,
-							g_memory_segment[seg].bytes[i],
-							buffer[i]);
-					error_found = true;
-					break;
-				}
-			}
-		}
+	EndSession18 ();
 
-		if (!error_found) {
-			printf ("Programmed!\n");
-		}
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : Verify18
+//
+// Desc    : Verifies that the device holds the contents of the
+//           "memory_segments" array, without programming anything.
+//
+// Returns : True if it does, false otherwise.
+//
+//===========================================================================
+bool Verify18()
+{
+	if (!BeginSession18 ())
+	{
+		return false;
 	}
-	while(0);
 
-	VppVddOff ();
+	const DEVICE *device = DetectDevice18();
+
+	IMAGE flash;
+	CreateImage(&flash, 0, device->flash_size, device->transfer_size);
+	AddSegmentsToImage(&flash);
+
+	bool ok = VerifyFlash18(device, &flash, false) && ProgramAndVerifyEeprom(device, false);
+	if (ok)
+	{
+		printf ("Verified!\n");
+	}
+
+	FreeImage(&flash);
+
+	EndSession18 ();
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : WriteEeprom18
+//
+// Desc    : Writes and verifies only the data EEPROM contents of the
+//           "memory_segments" array.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool WriteEeprom18()
+{
+	if (!(Capabilities() & CAPABILITY_EEPROM))
+	{
+		printf ("*** The programmer firmware cannot write the data EEPROM.\n");
+		return false;
+	}
+	if (!BeginSession18 ())
+	{
+		return false;
+	}
+
+	bool ok = ProgramAndVerifyEeprom(DetectDevice18(), true);
+
+	EndSession18 ();
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : ReadMemory18
+//
+// Desc    : Reads "length" bytes into "buffer" starting at "address". The
+//           target must be powered.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadMemory18(unsigned int address, unsigned char *buffer, int length)
+{
+	return ReadMemoryT<PIC18_TRAITS>(address, buffer, length);
+}
+
+//===========================================================================
+//
+// Name    : IsTargetPresent18
+//
+// Desc    : Powers up the target just long enough to read its device ID.
+//           Without a target the ID reads as all zeros or all ones, and Vpp
+//           never appears to settle. Not to be called within a session.
+//
+// Returns : True if a target answers, false otherwise.
+//
+//===========================================================================
+bool IsTargetPresent18()
+{
+	return IsTargetPresentT<PIC18_TRAITS>();
 }
 
 //===========================================================================
@@ -430,41 +920,29 @@ void Program18()
 //===========================================================================
 void ReadDeviceId18()
 {
-	VddOn ();
-	VppOn ();
-
-	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
-	//
-	Sleep(100);
+	if (!BeginSession18 ())
+	{
+		return;
+	}
 
-	unsigned char buffer[2];
+	unsigned int word;
 
-	if (ReadBytes (0x3ffffe, buffer, 2))
+	if (ReadDeviceIdWord18(&word))
 	{
-		unsigned short int word = buffer[0] | (buffer[1] << 8);
-
-		printf ("Dev_ID : 0x%02x%02x", buffer[1], buffer[0]);
-		switch (word & 0xffe0)
+		printf ("Dev_ID : 0x%04x", word);
+		const DEVICE *device = FindDevice(FAMILY_PIC18, word);
+		if (device != NULL)
 		{
-		case 0x1200: printf(", a 18F4550 rev %i", word & 0x001f); break;
-		case 0x1220: printf(", a 18F4450 rev %i", word & 0x001f); break;
-		case 0x1240: printf(", a 18F2550 rev %i", word & 0x001f); break;
-		case 0x1260: printf(", a 18F2450 rev %i", word & 0x001f); break;
-		case 0x5c00: printf(", a 18F45K50 rev %i", word & 0x001f); break;
-		case 0x5c20: printf(", a 18F25K50 rev %i", word & 0x001f); break;
-		case 0x5c60: printf(", a 18F24K50 rev %i", word & 0x001f); break;
-		case 0x5d20: printf(", a 18F26K50 rev %i", word & 0x001f); break;
-		case 0x5d60: printf(", a 18F46K50 rev %i", word & 0x001f); break;
-		case 0x1e00: printf(", a 18F1230 rev %i", word & 0x001f); break;
-		case 0x1e20: printf(", a 18F1330 rev %i", word & 0x001f); break;
-		case 0x1ee0: printf(", a 18F1330-ICD rev %i", word & 0x001f); break;
-		default: printf(", an unknown part"); break;
+			printf(", a %s rev %i", device->name, DeviceRevision(device, word));
+		}
+		else
+		{
+			printf(", an unknown part");
 		}
 		printf(".\n");
 	}
 
-	VppVddOff ();
+	EndSession18 ();
 }
 
 //===========================================================================
@@ -478,13 +956,12 @@ void ReadDeviceId18()
 //===========================================================================
 void DumpDevice18()
 {
-	VddOn ();
-	VppOn ();
+	if (!BeginSession18 ())
+	{
+		return;
+	}
 
-	//
-	// Wait for VPP to settle. The MAX680 takes a little while.
-	//
-	Sleep(100);
+	const DEVICE *device = DetectDevice18();
 
 	DumpDevice18(0x000000, 0x400);
 	//DumpDevice18(0x000800, 0x1000);
@@ -494,6 +971,11 @@ void DumpDevice18()
 	DumpDevice18(0x300000, 0x10);   // Configuration words.
 	printf ("\nDevice ID words:\n");
 	DumpDevice18(0x3ffff0, 0x10);   // Device ID words.
+	if (device->eeprom_size > 0 && (Capabilities() & CAPABILITY_EEPROM))
+	{
+		printf ("\nData EEPROM:\n");
+		DumpEeprom(device->eeprom_size);
+	}
 
-	VppVddOff ();
+	EndSession18 ();
 }
@@ -7,8 +7,15 @@
 #ifndef PIC18_H
 #define PIC18_H
 
-void Erase18();
-void Program18();
+bool BeginSession18();
+bool EndSession18();
+bool Erase18();
+bool Program18();
+bool Verify18();
+bool WriteEeprom18();
+bool ReadDeviceIdWord18(unsigned int *device_id);
+bool ReadMemory18(unsigned int address, unsigned char *buffer, int length);
+bool IsTargetPresent18();
 void ReadDeviceId18();
 void DumpDevice18();
 
@@ -5,27 +5,33 @@
  * of the MIT license.  See the LICENSE file for details.
  */
 #include "stdio.h"
+#include "stdlib.h"
 #include "time.h"
 #include "windows.h"
 #include "Usb.h"
 #include "HexFile.h"
-#include "pic32mx220f032b.h"
+#include "Capabilities.h"
+#include "Devices.h"
+#include "Commands.h"
+#include "Crc32.h"
+#include "Image.h"
+#include "Pack.h"
+#include "Verify.h"
+#include "Family.h"
+#include "Trace.h"
+#include "pic32mx.h"
+#include "Pic32.h"
 
 //
-// These are the commands sent from the PC to the PIC. Commands in the range
-// 0x00 - 0x0f are used in Prog18FUsb and not reused here to enable a merge
-// of the two at some future date.
+// Words per COMMAND_SEND_BUFFER_WORDS; as many as fit in one packet after
+// the three byte header.
 //
-#define COMMAND_CHECK_DEVICE                 0x10
-#define COMMAND_ERASE						 0x11
-#define COMMAND_ENTER_SERIAL_EXECUTION_MODE  0x12
-#define COMMAND_EXIT_PROGRAMMING_MODE        0x13
-#define COMMAND_READ_WORDS                   0x15
-#define COMMAND_SEND_WORDS                   0x16
-#define COMMAND_PROGRAM_WORDS                0x17
+#define BUFFER_WORDS_PER_SEND  15
 
-unsigned char bfm[BFM_SIZE];
-unsigned char pfm[PFM_SIZE];
+//
+// Packed bytes per COMMAND_SEND_BUFFER_PACKED, after the same header.
+//
+#define PACKED_BYTES_PER_SEND  61
 
 bool g_verbose = true;
 
@@ -33,10 +39,10 @@ bool g_verbose = true;
 //
 // Name    : ReceiveAll
 //
-// Desc    : This function receives a number of bytes from the USB pipe. If
-//           received data consist of more than four bytes and start with the
-//           four byte word "DEBU" or "TEXT" the bytes are printed and the
-//           function reads again.
+// Desc    : This function receives a number of bytes from the USB pipe,
+//           reading again until something arrives. Diagnostic "DEBU" and
+//           "TEXT" packets never show up here; Receive() hands them to the
+//           logger.
 //
 // Returns : True if successful, false otherwise.
 //
@@ -67,59 +73,8 @@ bool ReceiveAll(unsigned char *response, int *bytes_received)
 			}
 			continue;
 		}
-		if (*bytes_received > 4
-			&& response[0] == 'D'
-			&& response[1] == 'E'
-			&& response[2] == 'B'
-			&& response[3] == 'U')
-		{
-			printf("DEBU: ");
-			if ((*bytes_received % 4) == 0)
-			{
-				//
-				// Treat the bytes as an array of words (32 bit).
-				//
-				unsigned int *long_response = (unsigned int *)&response[4];
-				int words = (*bytes_received - 4) / 4;
-
-				for (int i = 0; i < words; i++)
-				{
-					printf("%08x ", long_response[i]);
-				}
-			}
-			else
-			{
-				for (int i = 0; i < *bytes_received - 4; i++)
-				{
-					printf("%02x ", response[i + 4]);
-				}
-			}
-			printf("\n");
-
-			continue;
-		}
-		if (*bytes_received > 4
-			&& response[0] == 'T'
-			&& response[1] == 'E'
-			&& response[2] == 'X'
-			&& response[3] == 'T')
-		{
-			char string[1024];
-			int i;
-			for (i = 0; i < *bytes_received - 4; i++)
-			{
-				string[i] = response[4 + i];
-			}
-			string[i] = 0;
-			printf("TEXT: %s\n", string);
-
-			continue;
-		}
 
-		if (*bytes_received > 0)
-		{
-			return true;
-		}
+		return true;
 	}
 	while(1);
 }
@@ -225,57 +180,16 @@ bool ReceiveOk()
 //
 // Name    : ReadWords
 //
-// Desc    : Reads "length" words from the target PIC into "buffer" starting
-//           at address "address".
+// Desc    : Reads "number_of_words" words from the target PIC into "buffer"
+//           starting at address "address", one full packet per request
+//           with several requests outstanding (see ReadMemoryT).
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
 bool ReadWords (unsigned int address, unsigned int *buffer, int number_of_words)
 {
-	unsigned char data[64];
-
-	unsigned char command[] = {
-		COMMAND_READ_WORDS,
-		static_cast<unsigned char>((address & 0x000000ff) >> 0),
-		static_cast<unsigned char>((address & 0x0000ff00) >> 8),
-		static_cast<unsigned char>((address & 0x00ff0000) >> 16),
-		static_cast<unsigned char>((address & 0xff000000) >> 24),
-		static_cast<unsigned char>(number_of_words)
-	};
-	
-	if (!Send(command, 6))
-	{
-		if (g_verbose)
-		{
-			printf("*** Failed to send the COMMAND_READ_WORDS message.\n");
-		}
-		return false;
-	}
-
-	do
-	{
-		int bytes_received;
-		if (!ReceiveAll(data, &bytes_received))
-		{
-			return false;
-		}
-		if (number_of_words * 4 != bytes_received)
-		{
-			printf("+++ Expected %i bytes but got %i: (", number_of_words * 4, bytes_received);
-			for (int i = 0; i < bytes_received; i++)
-			{
-				printf("%02x ", data[i]);
-			}
-			printf(")\n");
-			continue;
-		}
-		memcpy(buffer, data, number_of_words * 4);
-		break;
-	}
-	while(1);
-
-	return true;
+	return ReadMemoryT<PIC32_TRAITS>(address, (unsigned char *)buffer, number_of_words * 4);
 }
 
 //===========================================================================
@@ -321,6 +235,179 @@ bool ProgramWords (unsigned int address)
 	return Send(command, 5) && ReceiveOk();
 }
 
+//===========================================================================
+//
+// Name    : SendBufferWords
+//
+// Desc    : Sends "length" bytes (at most 4 * BUFFER_WORDS_PER_SEND) into
+//           row buffer "buffer" (0 or 1) of the programmer, starting at word
+//           "word_offset" of the row. Unlike SendWords, the programmer does
+//           not answer.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool SendBufferWords (int buffer, int word_offset, const unsigned char *bytes, int length)
+{
+	unsigned char command[64] = {
+		COMMAND_SEND_BUFFER_WORDS,
+		static_cast<unsigned char>(buffer),
+		static_cast<unsigned char>(word_offset)
+	};
+	memcpy(&command[3], bytes, length);
+
+	return Send(command, 3 + length);
+}
+
+//===========================================================================
+//
+// Name    : SendBufferPacked
+//
+// Desc    : Sends the "length" bytes (at most PACKED_BYTES_PER_SEND) of
+//           whole packed runs (see Pack.h) in "packed" into row buffer
+//           "buffer" of the programmer, starting at word "word_offset" of
+//           the row. The programmer unpacks them and, as for
+//           SendBufferWords, does not answer.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool SendBufferPacked (int buffer, int word_offset, const unsigned char *packed, int length)
+{
+	unsigned char command[64] = {
+		COMMAND_SEND_BUFFER_PACKED,
+		static_cast<unsigned char>(buffer),
+		static_cast<unsigned char>(word_offset)
+	};
+	memcpy(&command[3], packed, length);
+
+	return Send(command, 3 + length);
+}
+
+//===========================================================================
+//
+// Name    : SendRowPacked
+//
+// Desc    : Sends the packed "row" of "length" bytes into row buffer
+//           "buffer", as many whole runs per packet as fit.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool SendRowPacked (int buffer, const unsigned char *row, int length)
+{
+	int position = 0;
+	unsigned int word_offset = 0;
+
+	while (position < length)
+	{
+		int first = position;
+		unsigned int first_word = word_offset;
+		while (position < length)
+		{
+			unsigned int words;
+			int run = PackedRunLength(&row[position], &words);
+			if (position + run - first > PACKED_BYTES_PER_SEND)
+			{
+				break;
+			}
+			position += run;
+			word_offset += words;
+		}
+
+		if (!SendBufferPacked(buffer, first_word, &row[first], position - first))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : ProgramBuffer
+//
+// Desc    : Asks the programmer to write row buffer "buffer" to "address".
+//           The programmer starts the write and returns at once; the outcome
+//           arrives later as a row status packet (see ReceiveRowStatus).
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ProgramBuffer (int buffer, unsigned int address)
+{
+	unsigned char command[] = {
+		COMMAND_PROGRAM_BUFFER,
+		static_cast<unsigned char>(buffer),
+		static_cast<unsigned char>((address & 0x000000ff) >> 0),
+		static_cast<unsigned char>((address & 0x0000ff00) >> 8),
+		static_cast<unsigned char>((address & 0x00ff0000) >> 16),
+		static_cast<unsigned char>((address & 0xff000000) >> 24)
+	};
+
+	return Send(command, sizeof(command));
+}
+
+//===========================================================================
+//
+// Name    : ReceiveRowStatus
+//
+// Desc    : Waits for the "RW" packet the programmer sends when a row write
+//           started by ProgramBuffer has finished. The packet carries the
+//           buffer number and the MCHP_STATUS read after the write.
+//
+// Returns : True if the row was written without error, false otherwise.
+//
+//===========================================================================
+bool ReceiveRowStatus (int buffer, unsigned int address)
+{
+	double start = TraceTime();
+	unsigned char response[64];
+	bool ok = false;
+
+	do
+	{
+		int bytes_received;
+
+		if (!ReceiveAll(response, &bytes_received))
+		{
+			break;
+		}
+		if (bytes_received == 4
+			&& response[0] == 'R'
+			&& response[1] == 'W')
+		{
+			if (response[2] != buffer)
+			{
+				printf("*** Expected the status of row buffer %i, but got buffer %i.\n", buffer, response[2]);
+			}
+			else if (response[3] & MCHP_STATUS_NVMERR)
+			{
+				printf("*** Programming the row at %08x failed. NVMERR was asserted in MCHP_STATUS (%02x).\n", address, response[3]);
+			}
+			else
+			{
+				ok = true;
+			}
+			break;
+		}
+
+		if (g_verbose)
+		{
+			printf("*** Waiting for a row status, but got %i bytes rather than 4.\n", bytes_received);
+			for (int i = 0; i < bytes_received; i++)
+			{
+				printf("%02x ", response[i]);
+			}
+			printf("\n");
+		}
+	}
+	while(1);
+
+	TraceSpan("row status", "target", start, address, -1);
+	return ok;
+}
+
 //===========================================================================
 //===========================================================================
 
@@ -422,6 +509,43 @@ bool Erase ()
 	return false;
 }
 
+//===========================================================================
+//
+// Name    : ErasePage
+//
+// Desc    : Erases the flash page starting at "address".
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ErasePage (unsigned int address)
+{
+	unsigned char mchp_status;
+
+	unsigned char command[] = {
+		COMMAND_ERASE_PAGE,
+		static_cast<unsigned char>((address & 0x000000ff) >> 0),
+		static_cast<unsigned char>((address & 0x0000ff00) >> 8),
+		static_cast<unsigned char>((address & 0x00ff0000) >> 16),
+		static_cast<unsigned char>((address & 0xff000000) >> 24)
+	};
+
+	double start = TraceTime();
+	bool ok = Send(command, sizeof(command)) && ReceiveResult(&mchp_status);
+	TraceSpan("erase page", "target", start, address, -1);
+	if (!ok)
+	{
+		return false;
+	}
+
+	if (mchp_status & MCHP_STATUS_NVMERR)
+	{
+		printf("*** Erasing the page at %08x failed. NVMERR was asserted in MCHP_STATUS (%02x).\n", address, mchp_status);
+		return false;
+	}
+	return true;
+}
+
 //===========================================================================
 //
 // Name    : EnterProgrammingMode
@@ -433,7 +557,10 @@ bool Erase ()
 //===========================================================================
 bool EnterProgrammingMode ()
 {
-	return Send(COMMAND_ENTER_SERIAL_EXECUTION_MODE) && ReceiveOk();
+	double start = TraceTime();
+	bool ok = Send(COMMAND_ENTER_SERIAL_EXECUTION_MODE) && ReceiveOk();
+	TraceSpan("enter programming mode", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
 }
 
 //===========================================================================
@@ -447,44 +574,146 @@ bool EnterProgrammingMode ()
 //===========================================================================
 bool ExitProgrammingMode ()
 {
-	return Send(COMMAND_EXIT_PROGRAMMING_MODE) && ReceiveOk();
+	double start = TraceTime();
+	bool ok = Send(COMMAND_EXIT_PROGRAMMING_MODE) && ReceiveOk();
+	TraceSpan("exit programming mode", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
+}
+
+//
+// The number of BeginSession32 calls not yet matched by EndSession32.
+//
+static int session_depth = 0;
+
+//===========================================================================
+//
+// Name    : BeginSession32
+//
+// Desc    : Puts the target in programming mode unless a session is already
+//           open, in which case it stays in programming mode and the session
+//           is only nested. Each successful call must be matched by
+//           EndSession32; a failed one leaves no session open.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool BeginSession32()
+{
+	if (session_depth > 0)
+	{
+		session_depth++;
+		return true;
+	}
+
+	if (!CheckDevice() || !EnterProgrammingMode())
+	{
+		return false;
+	}
+	session_depth = 1;
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : EndSession32
+//
+// Desc    : Ends a session begun by BeginSession32. The target leaves
+//           programming mode when the outermost session ends.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool EndSession32()
+{
+	if (--session_depth > 0)
+	{
+		return true;
+	}
+
+	return ExitProgrammingMode();
+}
+
+//===========================================================================
+//
+// Name    : ChipErase
+//
+// Desc    : Erases the whole device from within a session. The erase goes
+//           through the MTAP, so programming mode is left for it and entered
+//           again afterwards.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool ChipErase()
+{
+	double start = TraceTime();
+	bool ok = ExitProgrammingMode()
+		&& CheckDevice()
+		&& Erase()
+		&& EnterProgrammingMode();
+	TraceSpan("erase", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : DetectDevice32
+//
+// Desc    : Reads the device ID and looks the part up in the device table.
+//           The target must be in programming mode.
+//
+// Returns : The part, or the PIC32MX1xx/2xx memory map if the part is
+//           unknown.
+//
+//===========================================================================
+const DEVICE *DetectDevice32()
+{
+	unsigned int device_id;
+	const DEVICE *device = NULL;
+
+	if (ReadWords(DEVICE_ID_ADDRESS, &device_id, 1))
+	{
+		device = FindDevice(FAMILY_PIC32, device_id);
+		if (device == NULL)
+		{
+			printf ("+++ Unknown device ID %08x, assuming the PIC32MX1xx/2xx memory map.\n", device_id);
+		}
+	}
+
+	return device != NULL ? device : DefaultDevice(FAMILY_PIC32);
 }
 
 //===========================================================================
 //
 // Name    : ProgramFlashMemory
 //
-// Desc    : This function will program the content of a memory area "fm"
-//           (short for flash memory) consisting of "size" bytes into the
-//           target PIC starting at physical address "address".
+// Desc    : This function will program the rows of the memory area "fm"
+//           (short for flash memory) that hold data from the hex file into
+//           the target PIC. Rows never touched by the hex file have no
+//           storage in the image and are skipped without being looked at.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool ProgramFlashMemory(unsigned char *fm, int size, unsigned int address)
+bool ProgramFlashMemory(const IMAGE *fm)
 {
+	const unsigned int row_size = fm->block_size;
+
 	//
 	// Loop over each "row", as specified by the PIC32 flash programming
 	// specification. A row is the number of bytes programmed into the
 	// target PIC in one go. The size of the row depends on the target PIC;
 	// for the PIC32MX220F032B a row is 128 bytes, or 32 words.
 	//
-	for (int row_index = 0; row_index < size / ROW_SIZE; row_index++)
+	for (unsigned int row_index = 0; row_index < fm->size / row_size; row_index++)
 	{
 		//
-		// Does this row need programming? It does if at least one byte is not
-		// 0xff.
-		bool needs_programming = false;
-		for (int i = 0; i < ROW_SIZE && !needs_programming; i++)
-		{
-			needs_programming = fm[row_index * ROW_SIZE + i] != 0xff;
-		}
-		if (!needs_programming)
+		// Does this row need programming? It does if the hex file put data
+		// in it and at least one byte is not 0xff.
+		//
+		unsigned char *row = ImageBlock(fm, row_index);
+		if (!fm->used[row_index] || IsBlank(row, row_size))
 		{
-			//
-			// This row is all 0xff, so does not need to be programmed. On to
-			// the next row.
-			//
 			continue;
 		}
 
@@ -494,39 +723,244 @@ bool ProgramFlashMemory(unsigned char *fm, int size, unsigned int address)
 		// are stored in target PIC SRAM, then issue a ProgramWords call to have
 		// them programmed to the flash memory.
 		//
-		// For the PIC32MX220F032B, we send 32 bytes in each call to SendWords. With
-		// a row equal to 128 bytes, we will call SendWords four times per row.
+		// We send 32 bytes in each call to SendWords. With a row equal to 128 bytes,
+		// we will call SendWords four times per row.
 		//
-		for (int offset = 0; offset < ROW_SIZE; offset += 32)
+		double start = TraceTime();
+		for (unsigned int offset = 0; offset < row_size; offset += 32)
 		{
-			if (!SendWords(offset, &fm[row_index * ROW_SIZE + offset]))
+			if (!SendWords(offset, &row[offset]))
 			{
 				return false;
 			}
 		}
 		
-		if (!ProgramWords(address + row_index * ROW_SIZE))
+		if (!ProgramWords(fm->start + row_index * row_size))
 		{
 			return false;
 		}
+		TraceSpan("program row", "target", start, fm->start + row_index * row_size, row_size);
 	}
 	return true;
 }
 
 //===========================================================================
 //
-// Name    : Program
+// Name    : ProgramFlashMemoryPipelined
 //
-// Desc    : This function will program the content of the bfm and pgm areas
-//           into the target PIC.
+// Desc    : Same as ProgramFlashMemory, but uses the programmer's two row
+//           buffers so that the next row is transferred while the previous
+//           one is being written. At most two rows are in flight; the status
+//           of a row is collected before its buffer is reused. Rows are sent
+//           in packets of BUFFER_WORDS_PER_SEND words, so large rows take
+//           proportionally fewer packets and a single program command, or
+//           packed if "fm" has been packed and that is smaller.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool Program ()
+bool ProgramFlashMemoryPipelined(const IMAGE *fm)
 {
-	return ProgramFlashMemory(pfm, PFM_SIZE, PFM_START)
-		&& ProgramFlashMemory(bfm, BFM_SIZE, BFM_START);
+	const unsigned int row_size = fm->block_size;
+	unsigned int in_flight[2];
+	bool busy[2] = {false, false};
+	int buffer = 0;
+	bool result = true;
+
+	for (unsigned int row_index = 0; row_index < fm->size / row_size && result; row_index++)
+	{
+		unsigned char *row = ImageBlock(fm, row_index);
+		if (!fm->used[row_index] || IsBlank(row, row_size))
+		{
+			continue;
+		}
+
+		//
+		// Wait for the row that last used this buffer to finish.
+		//
+		if (busy[buffer])
+		{
+			busy[buffer] = false;
+			if (!ReceiveRowStatus(buffer, in_flight[buffer]))
+			{
+				result = false;
+				break;
+			}
+		}
+
+		//
+		// Rows that pack smaller (see PackImage) are sent packed; mostly
+		// erased or zero padded rows then take a packet or two.
+		//
+		double start = TraceTime();
+		if (fm->packed[row_index] != NULL && fm->packed_lengths[row_index] < (int)row_size)
+		{
+			result = SendRowPacked(buffer, fm->packed[row_index], fm->packed_lengths[row_index]);
+		}
+		else
+		{
+			for (unsigned int offset = 0; offset < row_size && result; offset += 4 * BUFFER_WORDS_PER_SEND)
+			{
+				unsigned int length = row_size - offset;
+				if (length > 4 * BUFFER_WORDS_PER_SEND)
+				{
+					length = 4 * BUFFER_WORDS_PER_SEND;
+				}
+				result = SendBufferWords(buffer, offset / 4, &row[offset], length);
+			}
+		}
+
+		in_flight[buffer] = fm->start + row_index * row_size;
+		if (!result || !ProgramBuffer(buffer, in_flight[buffer]))
+		{
+			result = false;
+			break;
+		}
+		TraceSpan("send row", "target", start, in_flight[buffer], row_size);
+		busy[buffer] = true;
+		buffer ^= 1;
+	}
+
+	//
+	// Collect the status of the rows still in flight, oldest first.
+	//
+	for (int i = 0; i < 2; i++)
+	{
+		if (busy[buffer] && !ReceiveRowStatus(buffer, in_flight[buffer]))
+		{
+			result = false;
+		}
+		buffer ^= 1;
+	}
+
+	return result;
+}
+
+//===========================================================================
+//
+// Name    : Program
+//
+// Desc    : This function will program the content of the bfm and pgm areas
+//           into the target PIC. If the programmer can unpack rows, the
+//           images are packed first.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool Program (const DEVICE *device, IMAGE *pfm, IMAGE *bfm)
+{
+	if (Capabilities() & CAPABILITY_ROW_PIPELINE)
+	{
+		if (Capabilities() & CAPABILITY_PACKED_ROWS)
+		{
+			PackImage(pfm);
+			PackImage(bfm);
+		}
+		return ProgramFlashMemoryPipelined(pfm)
+			&& ProgramFlashMemoryPipelined(bfm);
+	}
+
+	//
+	// SendWords only has a byte for the offset into the row.
+	//
+	if (device->transfer_size > 256)
+	{
+		printf ("*** The %s has %i byte rows. Programming it needs a programmer firmware with row buffers.\n", device->name, device->transfer_size);
+		return false;
+	}
+
+	return ProgramFlashMemory(pfm)
+		&& ProgramFlashMemory(bfm);
+}
+
+//===========================================================================
+//
+// Name    : ReadCrcs
+//
+// Desc    : Asks the programmer for the CRC32s of "count" address ranges.
+//           Up to 7 ranges fit in one command.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadCrcs (const unsigned int *addresses, const unsigned int *lengths, int count, unsigned int *crcs)
+{
+	return ReadCrcsT<PIC32_TRAITS>(addresses, lengths, count, crcs);
+}
+
+/*
+ * What RewriteRuns32 needs besides the runs.
+ */
+typedef struct {
+	const DEVICE *device;
+	IMAGE *pfm;
+	IMAGE *bfm;
+} REWRITE32;
+
+//===========================================================================
+//
+// Name    : RewriteRuns32
+//
+// Desc    : Erases the flash pages that the "count" runs in "runs" fall in
+//           and programs their rows again from the images, widening each
+//           run to its pages. A row cannot be programmed twice without an
+//           erase, so this needs page erase. "context" is a REWRITE32.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool RewriteRuns32(void *context, VERIFY_RUN *runs, int count)
+{
+	const REWRITE32 *rewrite = (const REWRITE32 *)context;
+	const unsigned int page_size = rewrite->device->erase_size;
+
+	if (!(Capabilities() & CAPABILITY_PAGE_ERASE))
+	{
+		printf ("*** Rewriting needs page erase, which the programmer firmware does not support.\n");
+		return false;
+	}
+
+	//
+	// The runs are in address order, so a page shared by several runs is
+	// rewritten once.
+	//
+	unsigned int next_page = 0;
+	for (int i = 0; i < count; i++)
+	{
+		IMAGE *fm = IsInImage(rewrite->pfm, runs[i].address, runs[i].length) ? rewrite->pfm
+				  : IsInImage(rewrite->bfm, runs[i].address, runs[i].length) ? rewrite->bfm
+				  : NULL;
+		if (fm == NULL)
+		{
+			continue;
+		}
+
+		unsigned int first = fm->start + (runs[i].address - fm->start) / page_size * page_size;
+		unsigned int end = fm->start + ((runs[i].address + runs[i].length - 1 - fm->start) / page_size + 1) * page_size;
+		for (unsigned int page = first; page < end; page += page_size)
+		{
+			if (page < next_page)
+			{
+				continue;
+			}
+			IMAGE window;
+			ImageWindow(&window, fm, page, page_size);
+			bool ok = ErasePage(page)
+				&& ((Capabilities() & CAPABILITY_ROW_PIPELINE)
+					? ProgramFlashMemoryPipelined(&window)
+					: ProgramFlashMemory(&window));
+			if (!ok)
+			{
+				return false;
+			}
+			next_page = page + page_size;
+		}
+
+		runs[i].address = first;
+		runs[i].length = end - first;
+	}
+
+	return true;
 }
 
 //===========================================================================
@@ -534,56 +968,108 @@ bool Program ()
 // Name    : Verify
 //
 // Desc    : Verifies that the contents of the "memory_segments" array matches
-//           the contents of the target PIC.
+//           the contents of the target PIC. Words that differ are read back
+//           again and, if "rewrite" is set, their pages are erased and
+//           programmed again (see RetryVerify).
 //
 // Returns : True if successfull, false otherwise.
 //
 //===========================================================================
-bool Verify ()
+bool Verify (const DEVICE *device, IMAGE *pfm, IMAGE *bfm, bool rewrite)
 {
+	double start = TraceTime();
+
 	//
-	// Loop over each segment as read from the hex file and verify than the
-	// words read from the PIC match.
+	// If the programmer can calculate CRCs, then only the rows whose CRC does
+	// not match are read back. The config words cannot be verified by CRC
+	// (see below), so the row holding them is left to the read back. It is
+	// only left out while comparing, as a rewrite may need it.
 	//
-	for (int seg = 0; seg < g_number_of_segments; seg++)
+	if (g_crc_verify)
 	{
-		unsigned char buffer[MAX_SEGMENT_LENGTH];
+		bool *config_row_used = NULL;
+		bool was_used = false;
+		if (IsInImage(bfm, device->config_address, device->config_size))
+		{
+			config_row_used = &bfm->used[(device->config_address - bfm->start) / bfm->block_size];
+			was_used = *config_row_used;
+			*config_row_used = false;
+		}
+		if (!CompareImageCrcs(pfm, ReadCrcs, 7) || !CompareImageCrcs(bfm, ReadCrcs, 7))
+		{
+			printf ("+++ The programmer does not support CRC verification, reading back instead.\n");
+		}
+		if (config_row_used != NULL)
+		{
+			*config_row_used = was_used;
+		}
+	}
+
+	//
+	// Loop over the segments as read from the hex file and verify that the
+	// words read from the PIC match. Consecutive segments that follow on
+	// each other are read back in one go.
+	//
+	VERIFIER verifier;
+	BeginVerify(&verifier, FAMILY_PIC32, device, true);
+	int seg = 0;
+	while (seg < g_number_of_segments)
+	{
+		if (IsImageVerified(pfm, g_memory_segment[seg].address, g_memory_segment[seg].length)
+			|| IsImageVerified(bfm, g_memory_segment[seg].address, g_memory_segment[seg].length))
+		{
+			seg++;
+			continue;
+		}
+
+		int first = seg;
+		unsigned int run_address = g_memory_segment[seg].address;
+		unsigned int run_length = g_memory_segment[seg].length;
+		for (seg++; seg < g_number_of_segments; seg++)
+		{
+			if (g_memory_segment[seg].address != run_address + run_length
+				|| IsImageVerified(pfm, g_memory_segment[seg].address, g_memory_segment[seg].length)
+				|| IsImageVerified(bfm, g_memory_segment[seg].address, g_memory_segment[seg].length))
+			{
+				break;
+			}
+			run_length += g_memory_segment[seg].length;
+		}
 
 		//
-		// Read the bytes from the PIC.
+		// Read the bytes from the PIC and compare them.
 		//
-		if (!ReadWords (g_memory_segment[seg].address, (unsigned int *)buffer, g_memory_segment[seg].length / 4))
+		unsigned char *buffer = (unsigned char *)malloc((run_length + 3) & ~3);
+		if (!ReadWords (run_address, (unsigned int *)buffer, (run_length + 3) / 4))
 		{
+			free(buffer);
+			EndVerify(&verifier);
+			TraceSpan("verify", "target", start, TRACE_NO_ADDRESS, -1);
 			return false;
 		}
 
 		//
-		// Loop over each bytes and verify.
+		// SPECIAL CASE: The DEVCFG0 word is always read with it's most signficant
+		// bit set to zero (this is according to documentation and not unexpected)
+		// and for some reason the JTAGEN bit cannot be programmed to 0, which is
+		// not expected. The mask image of the part leaves both out.
 		//
-		for (int i = 0; i < g_memory_segment[seg].length; i++)
-		{
-			//
-			// SPECIAL CASE: The DEVCFG0 word is always read with it's most signficant
-			// bit set to zero (this is according to documentation and not unexpected)
-			// and for some reason the JTAGEN bit cannot be programmed to 0, which is
-			// not expected.
-			//
-			// In any event we ignore a mismatch in the the DEVCFG0 word.
-			//
-			if (buffer[i] != g_memory_segment[seg].bytes[i]
-				&& (((g_memory_segment[seg].address + i) & 0xfffffffc) != DEVICE_CONFIG_ADDRESS_0))
-			{
-				printf ("\n\n*** Verification Error: Byte %08x should be %02x, but reads as %02x.\n\n",
-						g_memory_segment[seg].address + i,
-						g_memory_segment[seg].bytes[i],
-						buffer[i]);
-
-				return false;
-			}
+		for (int s = first; s < seg; s++)
+		{
+			VerifyBytes(&verifier,
+						g_memory_segment[s].address,
+						g_memory_segment[s].bytes,
+						&buffer[g_memory_segment[s].address - run_address],
+						g_memory_segment[s].length);
 		}
+		free(buffer);
 	}
 
-	return true;
+	REWRITE32 context = {device, pfm, bfm};
+	bool ok = EndVerify(&verifier)
+		|| RetryVerify(&verifier, ReadMemory32, rewrite ? RewriteRuns32 : NULL, &context);
+	TraceSpan("verify", "target", start, TRACE_NO_ADDRESS, -1);
+	return ok;
 }
 
 //===========================================================================
@@ -599,43 +1085,199 @@ bool Verify ()
 bool DumpDevice32(int address, int length)
 {
 	unsigned int buffer[1024];
+	int lines = (length + 15) / 16;
+
+	if (lines > 1024 / 4)
+	{
+		lines = 1024 / 4;
+	}
+	if (!ReadWords (address, buffer, lines * 4))
+	{
+		return false;
+	}
+
+	for (int line = 0; line < lines; line++)
+	{
+		printf ("%08x : %08x %08x %08x %08x\n",
+				address + line * 16,
+				buffer[line * 4 + 0],
+				buffer[line * 4 + 1],
+				buffer[line * 4 + 2],
+				buffer[line * 4 + 3]);
+	}
+	
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : CreateImages
+//
+// Desc    : Creates the pfm (program flash memory) and bfm (boot flash
+//           memory) images of "device", divided into blocks of "block_size"
+//           bytes, and stores the segments of the hex file in them. Only the
+//           blocks the hex file puts data in get any storage.
+//
+// Returns : True if all of the hex file fits in the images, false otherwise.
+//
+//===========================================================================
+bool CreateImages(const DEVICE *device, IMAGE *pfm, IMAGE *bfm, unsigned int block_size)
+{
+	CreateImage(bfm, BFM_START, device->boot_flash_size, block_size);
+	CreateImage(pfm, PFM_START, device->flash_size, block_size);
 
-	for (int i = 0; i < length; i += 16)
+	for (int seg = 0; seg < g_number_of_segments; seg++)
 	{
-		if (!ReadWords  (address + i, buffer, 4))
+		if (!IsInImage(pfm, g_memory_segment[seg].address, g_memory_segment[seg].length)
+			&& !IsInImage(bfm, g_memory_segment[seg].address, g_memory_segment[seg].length))
 		{
+			printf ("*** Data at %08x is outside the flash of the %s.\n", g_memory_segment[seg].address, device->name);
 			return false;
 		}
+	}
+	AddSegmentsToImage(pfm);
+	AddSegmentsToImage(bfm);
 
-		printf ("%08x : %08x %08x %08x %08x\n",
-				address + i,
-				buffer[0],
-				buffer[1],
-				buffer[2],
-				buffer[3]);
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : FindChangedPages
+//
+// Desc    : Compares the used pages of "pages" (an image with one block per
+//           flash page) with the content of the device and marks the pages
+//           that already match verified. CRCs are used when the programmer
+//           supports them and the pages are read back otherwise. The page
+//           holding the configuration words is always read back, since the
+//           device table masks some of their bits.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool FindChangedPages(const DEVICE *device, IMAGE *pages)
+{
+	const unsigned int number_of_pages = pages->size / pages->block_size;
+
+	bool config_page_used = false;
+	unsigned int config_page = 0;
+	if (IsInImage(pages, device->config_address, device->config_size))
+	{
+		config_page = (device->config_address - pages->start) / pages->block_size;
+		config_page_used = pages->used[config_page];
+		pages->used[config_page] = false;
+	}
+	CompareImageCrcs(pages, ReadCrcs, 7);
+	if (config_page_used)
+	{
+		pages->used[config_page] = true;
+	}
+
+	unsigned char *buffer = (unsigned char *)malloc(pages->block_size);
+	bool result = true;
+	for (unsigned int page = 0; page < number_of_pages && result; page++)
+	{
+		if (!pages->used[page] || pages->verified[page])
+		{
+			continue;
+		}
+
+		unsigned int address = pages->start + page * pages->block_size;
+		result = ReadWords(address, (unsigned int *)buffer, pages->block_size / 4);
+
+		VERIFIER verifier;
+		BeginVerify(&verifier, FAMILY_PIC32, device, false);
+		VerifyBytes(&verifier, address, ImageBlock(pages, page), buffer, pages->block_size);
+		pages->verified[page] = result && EndVerify(&verifier);
+	}
+	free(buffer);
+
+	return result;
+}
+
+//===========================================================================
+//
+// Name    : EraseChangedPages
+//
+// Desc    : Erases the used pages of "pages" that have not been marked
+//           verified by FindChangedPages. The rows of "rows" (an image of
+//           the same area with one block per row) in the other pages are
+//           marked verified and not used, so that they are neither
+//           programmed nor verified again. "*changed" is incremented for
+//           each page erased.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool EraseChangedPages(IMAGE *pages, IMAGE *rows, int *changed)
+{
+	const unsigned int rows_per_page = pages->block_size / rows->block_size;
+
+	for (unsigned int page = 0; page < pages->size / pages->block_size; page++)
+	{
+		bool erase = pages->used[page] && !pages->verified[page];
+		if (erase)
+		{
+			if (!ErasePage(pages->start + page * pages->block_size))
+			{
+				return false;
+			}
+			(*changed)++;
+		}
+		else
+		{
+			for (unsigned int row = page * rows_per_page; row < (page + 1) * rows_per_page; row++)
+			{
+				rows->verified[row] = true;
+				rows->used[row] = false;
+			}
+		}
 	}
-	
 	return true;
 }
 
+//===========================================================================
+//
+// Name    : IsTargetPresent32
+//
+// Desc    : Asks for the MCHP_STATUS of the target without complaining if
+//           there is none. An absent (unpowered) target reads as 0xff.
+//
+// Returns : True if a target answers, false otherwise.
+//
+//===========================================================================
+bool IsTargetPresent32()
+{
+	unsigned char mchp_status;
+
+	return Send(COMMAND_CHECK_DEVICE)
+		&& ReceiveResult(&mchp_status)
+		&& mchp_status != 0xff
+		&& (mchp_status & MCHP_STATUS_CFGRDY);
+}
+
 //===========================================================================
 //
 // Name    : Erase32
 //
 // Desc    : 
 //
-// Returns : Nothing.
+// Returns : True if successful, false otherwise.
 //
 //===========================================================================
-void Erase32()
+bool Erase32()
 {
-	if (CheckDevice()
-		&& Erase()
-		&& EnterProgrammingMode()
-		&& ExitProgrammingMode())
+	if (!BeginSession32())
+	{
+		return false;
+	}
+	bool ok = ChipErase();
+	ok = EndSession32() && ok;
+	if (ok)
 	{
 		printf ("Erased!\n");
 	}
+	return ok;
 }
 
 //===========================================================================
@@ -644,40 +1286,106 @@ void Erase32()
 //
 // Desc    : 
 //
-// Returns : Nothing.
+// Returns : True if successful, false otherwise.
 //
 //===========================================================================
-void Program32()
+bool Program32()
 {
-	//
-	// The bfm (boot flash memory) and pgm (program flash memory) area areas
-	// that will hold the bytes to be programmed. Bytes that do not need to be
-	// programmed should be 0xff.
-	//
-	memset(bfm, 0xff, BFM_SIZE);
-	memset(pfm, 0xff, PFM_SIZE);
+	if (!BeginSession32())
+	{
+		return false;
+	}
 
 	//
-	// Now loop over each of the segments loaded and store them in the BFM or
-	// PGM as appropriate.
+	// Find out which part we are programming; the flash sizes, the row size
+	// and the location of the configuration words all depend on it.
 	//
-	for (int seg = 0; seg < g_number_of_segments; seg++)
+	const DEVICE *device = DetectDevice32();
+
+	IMAGE bfm;
+	IMAGE pfm;
+	bool fits = CreateImages(device, &pfm, &bfm, device->transfer_size);
+
+	bool ok = fits
+		&& ChipErase()
+		&& Program(device, &pfm, &bfm)
+		&& Verify(device, &pfm, &bfm, true);
+	ok = EndSession32() && ok;
+	if (ok)
 	{
-		unsigned char *fm = (g_memory_segment[seg].address < BFM_START) ? pfm : bfm;
-		int offset = g_memory_segment[seg].address & 0x000fffff;
+		printf ("Programmed!\n");
+	}
+
+	FreeImage(&pfm);
+	FreeImage(&bfm);
 
-		memcpy(&fm[offset], g_memory_segment[seg].bytes, g_memory_segment[seg].length);
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : Verify32
+//
+// Desc    : Verifies that the device holds the contents of the
+//           "memory_segments" array, without programming anything.
+//
+// Returns : True if it does, false otherwise.
+//
+//===========================================================================
+bool Verify32()
+{
+	if (!BeginSession32())
+	{
+		return false;
 	}
 
-	if (CheckDevice()
-		&& Erase()
-		&& EnterProgrammingMode()
-		&& Program()
-		&& Verify()
-		&& ExitProgrammingMode())
+	const DEVICE *device = DetectDevice32();
+
+	IMAGE bfm;
+	IMAGE pfm;
+	bool ok = CreateImages(device, &pfm, &bfm, device->transfer_size)
+		&& Verify(device, &pfm, &bfm, false);
+	ok = EndSession32() && ok;
+	if (ok)
 	{
-		printf ("Programmed!\n");
+		printf ("Verified!\n");
 	}
+
+	FreeImage(&pfm);
+	FreeImage(&bfm);
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : ReadDeviceIdWord32
+//
+// Desc    : Reads the device ID word into "device_id". The target must be in
+//           programming mode.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadDeviceIdWord32(unsigned int *device_id)
+{
+	return ReadWords(DEVICE_ID_ADDRESS, device_id, 1);
+}
+
+//===========================================================================
+//
+// Name    : ReadMemory32
+//
+// Desc    : Reads "length" bytes into "buffer" starting at "address". Both
+//           must be multiples of four. The target must be in programming
+//           mode.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool ReadMemory32(unsigned int address, unsigned char *buffer, int length)
+{
+	return ReadWords(address, (unsigned int *)buffer, length / 4);
 }
 
 //===========================================================================
@@ -692,21 +1400,24 @@ void Program32()
 void ReadDeviceId32()
 {
 	unsigned int dev_id;
-	if (CheckDevice() && EnterProgrammingMode() && ReadWords(DEVICE_ID_ADDRESS, &dev_id, 1) && ExitProgrammingMode())
+	bool ok = BeginSession32();
+	if (ok)
+	{
+		ok = ReadDeviceIdWord32(&dev_id);
+		ok = EndSession32() && ok;
+	}
+	if (ok)
 	{
 		printf ("Dev_ID : 0x%08x", dev_id);
 
-		switch (dev_id & 0x0fffffff)
+		const DEVICE *device = FindDevice(FAMILY_PIC32, dev_id);
+		if (device != NULL)
 		{
-		case 0x04A07053: printf(", a PIC32MX110F016B rev %i", dev_id >> 28); break;
-		case 0x04A06053: printf(", a PIC32MX120F032B rev %i", dev_id >> 28); break;
-		case 0x04D07053: printf(", a PIC32MX130F064B rev %i", dev_id >> 28); break;
-		case 0x04D06053: printf(", a PIC32MX150F128B rev %i", dev_id >> 28); break;
-		case 0x04A01053: printf(", a PIC32MX210F016B rev %i", dev_id >> 28); break;
-		case 0x04A00053: printf(", a PIC32MX220F032B rev %i", dev_id >> 28); break;
-		case 0x04D00053: printf(", a PIC32MX250F128B rev %i", dev_id >> 28); break;
-		case 0x04D01053: printf(", a PIC32MX230F063B rev %i", dev_id >> 28); break;
-		default: printf(", an unknown part"); break;
+			printf(", a %s rev %i", device->name, DeviceRevision(device, dev_id));
+		}
+		else
+		{
+			printf(", an unknown part");
 		}
 		printf(".\n");
 	}
@@ -727,19 +1438,84 @@ void ReadDeviceId32()
 //===========================================================================
 void DumpDevice32()
 {
-	if (!CheckDevice() || !EnterProgrammingMode())
+	if (!BeginSession32())
 	{
 		return;
 	}
 
+	const DEVICE *device = DetectDevice32();
+
 	printf ("\nProgram Flash Memory:\n");
-	DumpDevice32(0x1d000000, 256);
+	DumpDevice32(PFM_START, 256);
 	printf ("\nBoot Flash Memory:\n");
-	DumpDevice32(0x1fc00000, 256);
+	DumpDevice32(BFM_START, 256);
 	printf ("\nConfiguration words:\n");
-	DumpDevice32(DEVICE_CONFIG_ADDRESS_3, 0x10);   // Configuration words.
+	DumpDevice32(device->config_address, device->config_size);   // Configuration words.
 	printf ("\nDevice ID bytes:\n");
 	DumpDevice32(DEVICE_ID_ADDRESS, 0x01);   // Device ID bytes.
 
-	ExitProgrammingMode();
+	EndSession32();
+}
+
+//===========================================================================
+//
+// Name    : Update32
+//
+// Desc    : Programs the hex file into the device without a chip erase.
+//           Only the flash pages where the hex file differs from the
+//           device are erased and reprogrammed; pages the hex file does
+//           not mention are left as they are.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool Update32()
+{
+	if (!(Capabilities() & CAPABILITY_PAGE_ERASE))
+	{
+		printf ("*** The programmer firmware does not support page erase. Use \"-e -p\" instead.\n");
+		return false;
+	}
+
+	if (!BeginSession32())
+	{
+		return false;
+	}
+	const DEVICE *device = DetectDevice32();
+
+	//
+	// The same areas twice; divided into pages for finding out what to
+	// erase, and into rows for programming.
+	//
+	IMAGE pfm_pages;
+	IMAGE bfm_pages;
+	IMAGE pfm;
+	IMAGE bfm;
+	bool fits = CreateImages(device, &pfm_pages, &bfm_pages, device->erase_size);
+	CreateImage(&bfm, BFM_START, device->boot_flash_size, device->transfer_size);
+	CreateImage(&pfm, PFM_START, device->flash_size, device->transfer_size);
+	AddSegmentsToImage(&pfm);
+	AddSegmentsToImage(&bfm);
+
+	int changed = 0;
+	bool ok = fits
+		&& FindChangedPages(device, &pfm_pages)
+		&& FindChangedPages(device, &bfm_pages)
+		&& EraseChangedPages(&pfm_pages, &pfm, &changed)
+		&& EraseChangedPages(&bfm_pages, &bfm, &changed)
+		&& Program(device, &pfm, &bfm)
+		&& Verify(device, &pfm, &bfm, true);
+	ok = EndSession32() && ok;
+	if (ok)
+	{
+		printf ("Updated %i page(s).\n", changed);
+		printf ("Programmed!\n");
+	}
+
+	FreeImage(&pfm_pages);
+	FreeImage(&bfm_pages);
+	FreeImage(&pfm);
+	FreeImage(&bfm);
+
+	return ok;
 }
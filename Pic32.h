@@ -7,8 +7,15 @@
 #ifndef PIC32_H
 #define PIC32_H
 
-void Erase32();
-void Program32();
+bool BeginSession32();
+bool EndSession32();
+bool Erase32();
+bool Program32();
+bool Verify32();
+bool Update32();
+bool IsTargetPresent32();
+bool ReadDeviceIdWord32(unsigned int *device_id);
+bool ReadMemory32(unsigned int address, unsigned char *buffer, int length);
 void ReadDeviceId32();
 void DumpDevice32();
 
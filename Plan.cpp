@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "windows.h"
+#include "Commands.h"
+#include "HexFile.h"
+#include "JobFile.h"
+#include "Plan.h"
+#include "Trace.h"
+
+//
+// Round trips timed by CalibrateStation.
+//
+#define CALIBRATION_ROUND_TRIPS  200
+
+bool g_time_steps = false;
+
+/*
+ * The fields of the station timing file, which holds one "<name> <value>"
+ * line (in microseconds) for each field of SIM_TIMING to override.
+ */
+typedef struct {
+	const char *name;
+	double *value;
+} TIMING_FIELD;
+
+static const TIMING_FIELD timing_fields[] = {
+	{ "usb_latency",   &g_sim_timing.usb_latency },
+	{ "usb_packet",    &g_sim_timing.usb_packet },
+	{ "read_byte",     &g_sim_timing.read_byte },
+	{ "read_word_32",  &g_sim_timing.read_word_32 },
+	{ "write_16",      &g_sim_timing.write_16 },
+	{ "write_18",      &g_sim_timing.write_18 },
+	{ "write_row_32",  &g_sim_timing.write_row_32 },
+	{ "write_eeprom",  &g_sim_timing.write_eeprom },
+	{ "erase_16",      &g_sim_timing.erase_16 },
+	{ "erase_18",      &g_sim_timing.erase_18 },
+	{ "erase_32",      &g_sim_timing.erase_32 },
+	{ "erase_page_32", &g_sim_timing.erase_page_32 },
+};
+
+//===========================================================================
+//
+// Name    : Milliseconds
+//
+// Desc    : Tells the time of the step clock, which is the trace clock.
+//
+// Returns : The time in milliseconds.
+//
+//===========================================================================
+static double Milliseconds()
+{
+	return TraceTime() / 1000;
+}
+
+//===========================================================================
+//
+// Name    : LoadStationTiming
+//
+// Desc    : Reads the timing model of this station from the file "name"
+//           into g_sim_timing. Blank lines and lines starting with '#' are
+//           ignored; fields not in the file keep their defaults.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool LoadStationTiming(const char *name)
+{
+	FILE *file;
+	if (fopen_s(&file, name, "r") != 0 || file == NULL)
+	{
+		printf ("*** Failed to open the timing file %s.\n", name);
+		return false;
+	}
+
+	bool ok = true;
+	char line[256];
+	for (int number = 1; fgets(line, sizeof(line), file) != NULL; number++)
+	{
+		char *words[3];
+		int count = SplitWords(line, words, 3);
+		if (count == 0 || words[0][0] == '#')
+		{
+			continue;
+		}
+
+		bool known = false;
+		for (unsigned int i = 0; i < sizeof(timing_fields) / sizeof(timing_fields[0]) && count == 2; i++)
+		{
+			if (strcmp(words[0], timing_fields[i].name) == 0)
+			{
+				*timing_fields[i].value = atof(words[1]);
+				known = true;
+			}
+		}
+		if (!known)
+		{
+			printf ("*** %s, line %i: expected a timing field and a value in microseconds.\n", name, number);
+			ok = false;
+		}
+	}
+	fclose(file);
+
+	return ok;
+}
+
+//===========================================================================
+//
+// Name    : CalibrateStation
+//
+// Desc    : Times CALIBRATION_ROUND_TRIPS short reads from the programmer,
+//           which answers them with or without a target attached, and
+//           writes the timing model with the measured USB latency to the
+//           file "name". The programmer must be open.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool CalibrateStation(const char *name)
+{
+	unsigned char command[] = {READBYTES, 0x00, 0x00, 0x00, 1};
+	unsigned char response[64];
+
+	double start = Milliseconds();
+	for (int i = 0; i < CALIBRATION_ROUND_TRIPS; i++)
+	{
+		int bytes_received = 64;
+		if (!Send(command, sizeof(command)) || !Receive(response, &bytes_received))
+		{
+			printf ("*** The programmer did not answer.\n");
+			return false;
+		}
+	}
+	double latency = (Milliseconds() - start) * 1000 / CALIBRATION_ROUND_TRIPS - 2 * g_sim_timing.usb_packet;
+
+	FILE *file;
+	if (fopen_s(&file, name, "w") != 0 || file == NULL)
+	{
+		printf ("*** Failed to create the timing file %s.\n", name);
+		return false;
+	}
+	fprintf(file, "# Timing model of this station, in microseconds. usb_latency was measured\n");
+	fprintf(file, "# over %i round trips; the target figures are the typical ones.\n", CALIBRATION_ROUND_TRIPS);
+	g_sim_timing.usb_latency = latency;
+	for (unsigned int i = 0; i < sizeof(timing_fields) / sizeof(timing_fields[0]); i++)
+	{
+		fprintf(file, "%s %.0f\n", timing_fields[i].name, *timing_fields[i].value);
+	}
+	fclose(file);
+
+	printf ("USB latency %.0f us per round trip, written to %s.\n", latency, name);
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : PrintStepHeader
+//
+// Desc    : Prints the column headings for the lines of EndStep, if
+//           g_time_steps is set.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void PrintStepHeader()
+{
+	if (!g_time_steps)
+	{
+		return;
+	}
+	printf ("%-10s %11s %8s %9s %7s %7s %10s\n", "step", "round trips", "packets", "bytes", "erases", "writes", "ms");
+}
+
+//===========================================================================
+//
+// Name    : BeginStep
+//
+// Desc    : Notes the traffic, activity and time at the start of "step".
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void BeginStep(PLAN_STEP *step)
+{
+	step->usb = g_usb_statistics;
+	step->activity = g_sim_activity;
+	step->start_ms = Milliseconds();
+}
+
+//===========================================================================
+//
+// Name    : EndStep
+//
+// Desc    : Prints the round trips, packets and bytes on the wire and the
+//           time taken since BeginStep for "step", named "name", if
+//           g_time_steps is set. When simulating, also prints the erases and
+//           flash writes the target was asked for. The step is a span of the
+//           trace, if tracing; "name" must be a string constant.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void EndStep(const PLAN_STEP *step, const char *name)
+{
+	TraceSpan(name, "step", step->start_ms * 1000, TRACE_NO_ADDRESS, -1);
+	if (!g_time_steps)
+	{
+		return;
+	}
+	printf ("%-10s %11u %8u %9u ",
+			name,
+			g_usb_statistics.turnarounds - step->usb.turnarounds,
+			g_usb_statistics.packets_sent + g_usb_statistics.packets_received - step->usb.packets_sent - step->usb.packets_received,
+			g_usb_statistics.bytes_sent + g_usb_statistics.bytes_received - step->usb.bytes_sent - step->usb.bytes_received);
+	if (g_simulate)
+	{
+		printf ("%7u %7u ",
+				g_sim_activity.bulk_erases + g_sim_activity.pages_erased - step->activity.bulk_erases - step->activity.pages_erased,
+				g_sim_activity.writes - step->activity.writes);
+	}
+	else
+	{
+		printf ("%7s %7s ", "-", "-");
+	}
+	printf ("%10.1f\n", Milliseconds() - step->start_ms);
+}
+
+//===========================================================================
+//
+// Name    : RunPlan
+//
+// Desc    : Predicts what erasing (if "erase"), programming (if "program")
+//           and updating (if "update") a blank "part" (the default simulated
+//           part if NULL) with the loaded hex file takes by running the
+//           steps against the simulator with the timing model of this
+//           station. Prints one line per step and the predicted cycle time.
+//
+// Returns : True if all the steps succeed, false otherwise.
+//
+//===========================================================================
+bool RunPlan(const FAMILY_OPERATIONS *operations, const char *part, bool erase, bool program, bool update)
+{
+	if (part != NULL && !SimSelectPart(operations->family, part))
+	{
+		printf ("*** %s is not in the device tables.\n", part);
+		return false;
+	}
+
+	g_simulate = true;
+	g_time_steps = true;
+	if (!Open())
+	{
+		return false;
+	}
+
+	printf ("Plan for %s, %i segment(s) of the hex file, USB latency %.0f us:\n\n",
+			SimPart(operations->family)->name,
+			g_number_of_segments,
+			g_sim_timing.usb_latency);
+	PrintStepHeader();
+
+	PLAN_STEP total;
+	PLAN_STEP step;
+	BeginStep(&total);
+
+	BeginStep(&step);
+	bool begun = operations->begin_session();
+	bool ok = begun;
+	EndStep(&step, "power up");
+	if (erase)
+	{
+		BeginStep(&step);
+		ok = ok && operations->erase();
+		EndStep(&step, "erase");
+	}
+	if (program)
+	{
+		BeginStep(&step);
+		ok = ok && operations->program();
+		EndStep(&step, "program");
+	}
+	if (update)
+	{
+		BeginStep(&step);
+		ok = ok && operations->update();
+		EndStep(&step, "update");
+	}
+	BeginStep(&step);
+	if (begun)
+	{
+		ok = operations->end_session() && ok;
+	}
+	EndStep(&step, "power down");
+
+	EndStep(&total, "total");
+	printf ("\nPredicted cycle time: %.0f ms.\n", Milliseconds() - total.start_ms);
+
+	Close();
+	return ok;
+}
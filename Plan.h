@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "Session.h"
+#include "Sim.h"
+#include "Usb.h"
+
+/*
+ * The USB traffic, target activity and time at the start of a step (see
+ * BeginStep and EndStep). The target activity is only known when
+ * simulating.
+ */
+typedef struct {
+	USB_STATISTICS usb;
+	SIM_ACTIVITY activity;
+	double start_ms;
+} PLAN_STEP;
+
+/*
+ * If true, EndStep prints the figures of each step.
+ */
+extern bool g_time_steps;
+
+bool LoadStationTiming(const char *name);
+bool CalibrateStation(const char *name);
+void PrintStepHeader();
+void BeginStep(PLAN_STEP *step);
+void EndStep(const PLAN_STEP *step, const char *name);
+bool RunPlan(const FAMILY_OPERATIONS *operations, const char *part, bool erase, bool program, bool update);
+
+#endif
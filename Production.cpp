@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "windows.h"
+#include "Production.h"
+#include "Sim.h"
+#include "Trace.h"
+#include "Usb.h"
+
+//
+// How often to look for a board being inserted or removed. On PIC16F and
+// PIC18F each look powers the socket up (Vdd and Vpp) and down again, as
+// only a powered target answers; PIC32MX targets are only asked for their
+// MCHP status.
+//
+#define POLL_INTERVAL 250
+
+//
+// A board counts as inserted once this many looks in a row have found it,
+// so that one still being seated is not programmed.
+//
+#define PRESENT_POLLS 3
+
+//===========================================================================
+//
+// Name    : WaitForTarget
+//
+// Desc    : Polls "is_target_present" until it tells "present". A target
+//           must be found PRESENT_POLLS times in a row; a single look
+//           without one is enough to tell it has gone.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void WaitForTarget(bool (*is_target_present)(), bool present)
+{
+	int polls = present ? PRESENT_POLLS : 1;
+	int in_a_row = 0;
+
+	while (1)
+	{
+		if (is_target_present() == present)
+		{
+			if (++in_a_row == polls)
+			{
+				return;
+			}
+		}
+		else
+		{
+			in_a_row = 0;
+		}
+		Sleep(POLL_INTERVAL);
+	}
+}
+
+//===========================================================================
+//
+// Name    : ProductionLoop
+//
+// Desc    : Programs one board after the other without reloading the hex
+//           file or reopening the programmer. For each board we wait for a
+//           target to show up, erase it (if "erase") and program it (or
+//           update it, if "update") in one session, report the result along
+//           with the cycle time and the throughput so far, and wait for the
+//           board to be removed. Stops after "boards" boards, or never if
+//           "boards" is 0. Unless "serial" is NULL, each board gets the
+//           next serial number; a number is only used up by a board that
+//           passes. With -trace, the boards sampled are traced from
+//           insertion to PASS or FAIL.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void ProductionLoop(const FAMILY_OPERATIONS *operations, bool erase, bool update, int boards, SERIAL *serial)
+{
+	int passed = 0;
+	int failed = 0;
+	DWORD first_start = 0;
+
+	for (int board = 1; boards == 0 || board <= boards; board++)
+	{
+		printf ("\nWaiting for board %i...\n", board);
+		WaitForTarget(operations->is_target_present, true);
+		TraceBoard(board);
+
+		DWORD start = GetTickCount();
+		double trace_start = TraceTime();
+		if (board == 1)
+		{
+			first_start = start;
+		}
+
+		if (serial != NULL)
+		{
+			if (!PatchSerial(serial))
+			{
+				break;
+			}
+			printf ("Serial number %s.\n", serial->text);
+		}
+
+		bool ok = operations->begin_session();
+		if (ok)
+		{
+			ok = (!erase || operations->erase())
+				&& (update ? operations->update() : operations->program());
+			ok = operations->end_session() && ok;
+		}
+
+		DWORD end = GetTickCount();
+		TraceSpan(ok ? "PASS" : "FAIL", "board", trace_start, TRACE_NO_ADDRESS, -1);
+		TraceBoard(0);
+		if (ok && serial != NULL && !AdvanceSerial(serial))
+		{
+			//
+			// Carrying on would hand out the same number again.
+			//
+			break;
+		}
+		if (ok)
+		{
+			passed++;
+		}
+		else
+		{
+			failed++;
+		}
+
+		double hours = (end - first_start) / 3600000.0;
+		printf ("=== Board %i: %s in %.1f s. %i passed, %i failed",
+				board,
+				ok ? "PASS" : "FAIL",
+				(end - start) / 1000.0,
+				passed,
+				failed);
+		if (hours > 0)
+		{
+			printf (", %.0f devices/hour", board / hours);
+		}
+		printf (".\n");
+
+		if (boards != 0 && board == boards)
+		{
+			break;
+		}
+
+		printf ("Remove the board.\n");
+		if (g_simulate)
+		{
+			SimReplaceBoard();
+		}
+		WaitForTarget(operations->is_target_present, false);
+	}
+}
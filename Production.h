@@ -0,0 +1,15 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef PRODUCTION_H
+#define PRODUCTION_H
+
+#include "Session.h"
+#include "Serial.h"
+
+void ProductionLoop(const FAMILY_OPERATIONS *operations, bool erase, bool update, int boards, SERIAL *serial);
+
+#endif
@@ -4,14 +4,23 @@
  * This software may be modified and distributed under the terms
  * of the MIT license.  See the LICENSE file for details.
  */
+#include "ctype.h"
 #include "stdio.h"
+#include "stdlib.h"
 #include "time.h"
 #include "windows.h"
 #include "Usb.h"
 #include "HexFile.h"
-#include "Pic16.h"
-#include "Pic18.h"
-#include "Pic32.h"
+#include "Production.h"
+#include "Session.h"
+#include "Bench.h"
+#include "Daemon.h"
+#include "JobFile.h"
+#include "Plan.h"
+#include "Crc32.h"
+#include "Serial.h"
+#include "Trace.h"
+#include "Verify.h"
 
 //===========================================================================
 //
@@ -29,11 +38,31 @@ int main (int argc, char *argv[])
 	bool pic32          = false;
 	bool erase          = false;
 	bool program        = false;
+	bool update         = false;
 	bool print_hex_file = false;
 	bool read_device_id = false;
 	bool dump_device    = false;
+	bool loop           = false;
+	bool daemon         = false;
+	bool job            = false;
+	bool bench          = false;
+	bool plan           = false;
+	bool serialize      = false;
+	int boards          = 0;
 
 	char *hex_file_name = NULL;
+	char *job_file_name = NULL;
+	const char *pipe_name = DEFAULT_PIPE_NAME;
+	const char *results_name = NULL;
+	const char *baseline_name = NULL;
+	const char *part_name = NULL;
+	const char *timing_name = NULL;
+	const char *calibration_name = NULL;
+	const char *serial_address = NULL;
+	const char *serial_format = NULL;
+	const char *serial_counter_name = NULL;
+	const char *trace_name = NULL;
+	int trace_every = 1;
 	int next_arg = 1;
 
 	//
@@ -47,6 +76,16 @@ int main (int argc, char *argv[])
 			program = true;
 			hex_file_name = argv[++next_arg];
 		}
+		else if (strcmp (argv[next_arg], "-u") == 0)
+		{
+			update = true;
+			hex_file_name = argv[++next_arg];
+		}
+		else if (strcmp (argv[next_arg], "-j") == 0)
+		{
+			job = true;
+			job_file_name = argv[++next_arg];
+		}
 		else if (strcmp (argv[next_arg], "-h") == 0)
 		{
 			print_hex_file = true;
@@ -76,14 +115,90 @@ int main (int argc, char *argv[])
 		{
 			dump_device = true;
 		}
+		else if (strcmp (argv[next_arg], "-loop") == 0)
+		{
+			loop = true;
+			if (next_arg + 1 < argc && isdigit(argv[next_arg + 1][0]))
+			{
+				boards = atoi(argv[++next_arg]);
+			}
+		}
+		else if (strcmp (argv[next_arg], "-daemon") == 0)
+		{
+			daemon = true;
+			if (next_arg + 1 < argc && argv[next_arg + 1][0] != '-')
+			{
+				pipe_name = argv[++next_arg];
+			}
+		}
+		else if (strcmp (argv[next_arg], "-bench") == 0)
+		{
+			bench = true;
+			results_name = argv[++next_arg];
+			if (next_arg + 1 < argc && argv[next_arg + 1][0] != '-')
+			{
+				baseline_name = argv[++next_arg];
+			}
+		}
+		else if (strcmp (argv[next_arg], "-plan") == 0)
+		{
+			plan = true;
+			if (next_arg + 1 < argc && argv[next_arg + 1][0] != '-')
+			{
+				part_name = argv[++next_arg];
+			}
+		}
+		else if (strcmp (argv[next_arg], "-serial") == 0 && next_arg + 3 < argc)
+		{
+			serialize = true;
+			serial_address = argv[++next_arg];
+			serial_format = argv[++next_arg];
+			serial_counter_name = argv[++next_arg];
+		}
+		else if (strcmp (argv[next_arg], "-trace") == 0)
+		{
+			trace_name = argv[++next_arg];
+			if (next_arg + 1 < argc && isdigit(argv[next_arg + 1][0]))
+			{
+				trace_every = atoi(argv[++next_arg]);
+			}
+		}
+		else if (strcmp (argv[next_arg], "-timing") == 0)
+		{
+			timing_name = argv[++next_arg];
+		}
+		else if (strcmp (argv[next_arg], "-calibrate") == 0)
+		{
+			calibration_name = argv[++next_arg];
+		}
+		else if (strcmp (argv[next_arg], "-t") == 0)
+		{
+			g_time_steps = true;
+		}
 		else if (strcmp (argv[next_arg], "-rxtx") == 0)
 		{
 			g_print_txrx = true;
 		}
+		else if (strcmp (argv[next_arg], "-crc") == 0)
+		{
+			g_crc_verify = true;
+		}
+		else if (strcmp (argv[next_arg], "-retry") == 0)
+		{
+			g_verify_retries = atoi(argv[++next_arg]);
+		}
+		else if (strcmp (argv[next_arg], "-nosettle") == 0)
+		{
+			g_allow_unsettled_vpp = true;
+		}
+		else if (strcmp (argv[next_arg], "-sim") == 0)
+		{
+			g_simulate = true;
+		}
 		else if (strcmp (argv[next_arg], "-?") == 0)
 		{
 			printf ("\n");
-			printf ("Usage: Prog [-16|-18|-32] [[-e] [-p <hex_file>] [-id] [-d] [-rxtx]| -h <hex_file>]\n");
+			printf ("Usage: Prog [-16|-18|-32] [[-e] [-p <hex_file>] [-u <hex_file>] [-j <job_file>] [-crc] [-retry <retries>] [-nosettle] [-serial <address> <format> <counter_file>] [-loop [<boards>]] [-id] [-d] [-t] [-trace <trace_file> [<every>]] [-rxtx] [-sim] [-timing <timing_file>] [-plan [<part>]] | -h <hex_file> | -daemon [<pipe>] | -bench <results> [<baseline>] | -calibrate <timing_file>]\n");
 			printf ("\n");
 			printf ("         -16     Target is a PIC16F device.\n");
 			printf ("         -18     Target is a PIC18F device.\n");
@@ -91,11 +206,54 @@ int main (int argc, char *argv[])
 			printf ("\n");
 			printf ("         -e      Erase the device.\n");
 			printf ("         -p      Program and verify the device.\n");
+			printf ("         -u      Update the device: erase and program only the flash pages\n");
+			printf ("                 that differ from the hex file. PIC32MX only.\n");
+			printf ("         -j      Run the steps of the job file (id, erase, program,\n");
+			printf ("                 eeprom, verify, dump) with the target powered once.\n");
+			printf ("                 Stops at the first step that fails.\n");
+			printf ("         -crc    Verify using CRCs calculated by the programmer. Only\n");
+			printf ("                 ranges with a mismatching CRC are read back.\n");
+			printf ("         -retry  Bytes that fail to verify are read back again and\n");
+			printf ("                 rewritten up to <retries> times (2 by default) rather\n");
+			printf ("                 than failing the device. 0 turns this off.\n");
+			printf ("         -nosettle Go ahead with a PIC16F or PIC18F target even if Vpp\n");
+			printf ("                 does not settle, with a warning, rather than failing.\n");
+			printf ("         -serial Give each board the next serial number from\n");
+			printf ("                 <counter_file>, patched into the hex file at\n");
+			printf ("                 <address> as le32, mac, dec<digits> or hex<digits>.\n");
+			printf ("                 The file is updated after each board programmed.\n");
+			printf ("                 Only with -u (PIC32MX) is no more than the page\n");
+			printf ("                 holding the number rewritten; otherwise each board\n");
+			printf ("                 gets the whole image.\n");
+			printf ("         -loop   Production mode: erase (with -e) and program (-p) one\n");
+			printf ("                 board after the other, waiting for each to be inserted\n");
+			printf ("                 and removed. Stops after <boards> boards, if given.\n");
 			printf ("         -id     Read the Device ID.\n");
 			printf ("         -d      Dump selected memory areas of the device.\n");
 			printf ("         -h      Print the content of the hex file.\n");
+			printf ("         -daemon Keep the programmer open and take jobs (such as\n");
+			printf ("                 \"-18 -e -p board.hex\") from clients of the named\n");
+			printf ("                 pipe <pipe>, by default %s.\n", DEFAULT_PIPE_NAME);
+			printf ("         -bench  Measure erase, program, verify, read and ID of\n");
+			printf ("                 synthetic images against the simulated programmer.\n");
+			printf ("                 Writes JSON to <results> and fails if the USB traffic\n");
+			printf ("                 grew compared with an earlier <baseline>.\n");
+			printf ("         -plan   Rather than programming, predict the round trips,\n");
+			printf ("                 packets, erases, writes and time of the steps asked\n");
+			printf ("                 for (-e, -p, -u) on a blank <part>, using the\n");
+			printf ("                 simulated programmer and the station timing.\n");
+			printf ("         -t      Print the same figures, as measured, for each step.\n");
+			printf ("         -trace  Write a timeline of the phases, programming commands\n");
+			printf ("                 and USB transfers to <trace_file>, for chrome://tracing\n");
+			printf ("                 or ui.perfetto.dev. With -loop, only every <every>th\n");
+			printf ("                 board is traced.\n");
+			printf ("         -timing Read the station timing model from <timing_file>.\n");
+			printf ("         -calibrate Measure the USB latency of this station and\n");
+			printf ("                 write the timing model to <timing_file>.\n");
 			printf ("\n");
 			printf ("         -rxtx   Prints the USB communication. For debugging purposes.\n");
+			printf ("         -sim    Talk to a simulated programmer and target rather than\n");
+			printf ("                 the real ones. For testing without hardware.\n");
 			printf ("\n");
 			return 0;
 		}
@@ -108,6 +266,47 @@ int main (int argc, char *argv[])
 		next_arg++;
 	}
 
+	if (daemon)
+	{
+		if (!Open())
+		{
+			printf("*** Failed to open the USB connection to the programmer.\n");
+			return -1;
+		}
+		RunDaemon(pipe_name);
+		Close();
+		return 0;
+	}
+
+	if (timing_name != NULL && !LoadStationTiming(timing_name))
+	{
+		return -1;
+	}
+
+	if (calibration_name != NULL)
+	{
+		if (!Open())
+		{
+			printf("*** Failed to open the USB connection to the programmer.\n");
+			return -1;
+		}
+		bool ok = CalibrateStation(calibration_name);
+		Close();
+		return ok ? 0 : -1;
+	}
+
+	if (bench)
+	{
+		g_simulate = true;
+		if (results_name == NULL || !Open())
+		{
+			return -1;
+		}
+		bool ok = RunBenchmark(results_name, baseline_name);
+		Close();
+		return ok ? 0 : -1;
+	}
+
 	int number_of_devices_nonimated = 0;
 	number_of_devices_nonimated += pic16 ? 1 : 0;
 	number_of_devices_nonimated += pic18 ? 1 : 0;
@@ -123,6 +322,21 @@ int main (int argc, char *argv[])
 		printf ("ERROR: Must specify either -16, -18 or -32, but not more than one.\n");
 		return -1;
 	}
+	if (update && !pic32)
+	{
+		printf ("ERROR: -u is only supported for -32.\n");
+		return -1;
+	}
+	if (loop && !program && !update)
+	{
+		printf ("ERROR: -loop needs -p or -u.\n");
+		return -1;
+	}
+	if (serialize && (job || (!program && !update)))
+	{
+		printf ("ERROR: -serial needs -p or -u.\n");
+		return -1;
+	}
 
 	if (hex_file_name != NULL)
 	{
@@ -134,77 +348,140 @@ int main (int argc, char *argv[])
 			return -1;
 		}
 	}
+	SERIAL serial;
+	if (serialize && !BeginSerial(&serial, serial_address, serial_format, serial_counter_name))
+	{
+		return -1;
+	}
+	if (serialize && !update)
+	{
+		printf ("+++ Each board gets the whole image programmed; only -u (PIC32MX) rewrites just the serial number.\n");
+	}
 	if (print_hex_file)
 	{
 		PrintHexFile();
 		return 0;
 	}
 
+	if (plan)
+	{
+		return RunPlan(FamilyOperations(pic16 ? FAMILY_PIC16 : pic18 ? FAMILY_PIC18 : FAMILY_PIC32), part_name, erase, program, update) ? 0 : -1;
+	}
+
+	if (trace_name != NULL && !BeginTrace(trace_name, trace_every))
+	{
+		return -1;
+	}
+
 	if (!Open())
 	{
 		printf("*** Failed to open the USB connection to the programmer.\n");
+		EndTrace();
+		return -1;
+	}
+
+	const FAMILY_OPERATIONS *operations = FamilyOperations(pic16 ? FAMILY_PIC16 : pic18 ? FAMILY_PIC18 : FAMILY_PIC32);
+
+	if (job)
+	{
+		bool ok = RunJobFile(operations->family, job_file_name);
+		Close();
+		EndTrace();
+		return ok ? 0 : -1;
+	}
+
+	if (loop)
+	{
+		ProductionLoop(operations, erase, update, boards, serialize ? &serial : NULL);
+		Close();
+		EndTrace();
 		return 0;
 	}
 
-	if (pic16)
+	//
+	// Run everything asked for in one session, so the target is powered up
+	// (or put in programming mode) only once.
+	//
+	if (!erase && !program && !update && !read_device_id && !dump_device)
 	{
-		if (erase)
-		{
-			Erase16();
-		}
-		if (program)
-		{
-			Program16();
-		}
-		if (read_device_id)
-		{
-			ReadDeviceId16();
-		}
-		if (dump_device)
-		{
-			DumpDevice16();
-		}
+		Close();
+		EndTrace();
+		return 0;
 	}
-	if (pic18)
+	if (serialize)
 	{
-		if (erase)
-		{
-			Erase18();
-		}
-		if (program)
-		{
-			Program18();
-		}
-		if (read_device_id)
-		{
-			ReadDeviceId18();
-		}
-		if (dump_device)
+		if (!PatchSerial(&serial))
 		{
-			DumpDevice18();
+			Close();
+			EndTrace();
+			return -1;
 		}
+		printf ("Serial number %s.\n", serial.text);
+	}
+
+	//
+	// With -t, each step is timed as RunPlan would predict it. With -trace,
+	// each step is also a span of the trace.
+	//
+	PLAN_STEP total;
+	PLAN_STEP step;
+	bool ok = true;
+	PrintStepHeader();
+	BeginStep(&total);
+	BeginStep(&step);
+	bool begun = operations->begin_session();
+	EndStep(&step, "power up");
+	if (!begun)
+	{
+		printf ("*** Failed to power up the target or put it in programming mode.\n");
+		ok = false;
 	}
-	if (pic32)
+	else
 	{
 		if (erase)
 		{
-			Erase32();
+			BeginStep(&step);
+			ok = operations->erase() && ok;
+			EndStep(&step, "erase");
 		}
 		if (program)
 		{
-			Program32();
+			BeginStep(&step);
+			ok = operations->program() && ok;
+			EndStep(&step, "program");
+		}
+		if (update)
+		{
+			BeginStep(&step);
+			ok = operations->update() && ok;
+			EndStep(&step, "update");
 		}
 		if (read_device_id)
 		{
-			ReadDeviceId32();
+			operations->print_device_id();
 		}
 		if (dump_device)
 		{
-			DumpDevice32();
+			operations->dump();
 		}
+		BeginStep(&step);
+		ok = operations->end_session() && ok;
+		EndStep(&step, "power down");
+	}
+	EndStep(&total, "total");
+
+	if (serialize && ok && !AdvanceSerial(&serial))
+	{
+		//
+		// The next run would hand out the same number again.
+		//
+		Close();
+		EndTrace();
+		return -1;
 	}
 
 	Close();
+	EndTrace();
 
-	return 0;
+	return ok ? 0 : -1;
 }
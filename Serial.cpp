@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "io.h"
+#include "windows.h"
+#include "HexFile.h"
+#include "Serial.h"
+
+#define MAX_NAME_LENGTH  512
+
+//===========================================================================
+//
+// Name    : ParseSerialFormat
+//
+// Desc    : Sets the format and size of "serial" from "format": "le32",
+//           "mac", "dec<digits>" or "hex<digits>".
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+static bool ParseSerialFormat(SERIAL *serial, const char *format)
+{
+	if (_stricmp(format, "le32") == 0)
+	{
+		serial->format = SERIAL_LE32;
+		serial->size = 4;
+		return true;
+	}
+	if (_stricmp(format, "mac") == 0)
+	{
+		serial->format = SERIAL_MAC;
+		serial->size = 6;
+		return true;
+	}
+	if (_strnicmp(format, "dec", 3) == 0 || _strnicmp(format, "hex", 3) == 0)
+	{
+		serial->format = _strnicmp(format, "dec", 3) == 0 ? SERIAL_DECIMAL : SERIAL_HEX;
+		serial->size = atoi(format + 3);
+		return serial->size > 0 && serial->size <= MAX_SERIAL_BYTES;
+	}
+	return false;
+}
+
+//===========================================================================
+//
+// Name    : FindImageByte
+//
+// Desc    : Finds the byte at hex file address "address" in the segments of
+//           the loaded hex file.
+//
+// Returns : A pointer to the byte, or NULL if the hex file has no data there.
+//
+//===========================================================================
+static unsigned char *FindImageByte(unsigned int address)
+{
+	for (int seg = 0; seg < g_number_of_segments; seg++)
+	{
+		if (g_memory_segment[seg].address <= address
+			&& address < g_memory_segment[seg].address + g_memory_segment[seg].length)
+		{
+			return &g_memory_segment[seg].bytes[address - g_memory_segment[seg].address];
+		}
+	}
+	return NULL;
+}
+
+//===========================================================================
+//
+// Name    : BeginSerial
+//
+// Desc    : Sets up "serial" to patch serial numbers in format "format" into
+//           the loaded hex file at hex file address "address", starting
+//           with the number in the file "counter_name". The hex file must
+//           have data at every byte the serial number takes.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool BeginSerial(SERIAL *serial, const char *address, const char *format, const char *counter_name)
+{
+	memset(serial, 0, sizeof(SERIAL));
+	serial->address = strtoul(address, NULL, 0);
+	serial->counter_name = counter_name;
+
+	if (!ParseSerialFormat(serial, format))
+	{
+		printf ("*** \"%s\" is not a serial number format; use le32, mac, dec<digits> or hex<digits>.\n", format);
+		return false;
+	}
+
+	FILE *file = NULL;
+	char line[MAX_NAME_LENGTH];
+	if (fopen_s(&file, counter_name, "r") != 0 || file == NULL)
+	{
+		printf ("*** Cannot open the serial number counter %s.\n", counter_name);
+		return false;
+	}
+	bool read = fgets(line, sizeof(line), file) != NULL;
+	fclose(file);
+	char *p = line;
+	while (read && (*p == ' ' || *p == '\t'))
+	{
+		p++;
+	}
+	char *end = p;
+	serial->counter = read ? strtoull(p, &end, 0) : 0;
+	if (end == p)
+	{
+		printf ("*** %s does not start with a serial number.\n", counter_name);
+		return false;
+	}
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+	{
+		serial->counter_hex_digits = (int)(end - p) - 2;
+	}
+
+	//
+	// Find the bytes once, so that each unit only has to write them.
+	//
+	for (int i = 0; i < serial->size; i++)
+	{
+		serial->bytes[i] = FindImageByte(serial->address + i);
+		if (serial->bytes[i] == NULL)
+		{
+			printf ("*** The hex file has no data at %08x to put the serial number in.\n", serial->address + i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : PatchSerial
+//
+// Desc    : Writes the current serial number into the loaded hex file.
+//
+// Returns : True if successful, false if the number does not fit the
+//           format.
+//
+//===========================================================================
+bool PatchSerial(SERIAL *serial)
+{
+	unsigned char bytes[MAX_SERIAL_BYTES];
+	unsigned long long number = serial->counter;
+	bool fits = true;
+
+	switch (serial->format)
+	{
+	case SERIAL_LE32:
+		fits = number <= 0xffffffffULL;
+		for (int i = 0; i < 4; i++)
+		{
+			bytes[i] = static_cast<unsigned char>(number >> (8 * i));
+		}
+		snprintf(serial->text, sizeof(serial->text), "%llu", number);
+		break;
+
+	case SERIAL_MAC:
+		fits = number <= 0xffffffffffffULL;
+		for (int i = 0; i < 6; i++)
+		{
+			bytes[i] = static_cast<unsigned char>(number >> (8 * (5 - i)));
+		}
+		snprintf(serial->text, sizeof(serial->text), "%02x:%02x:%02x:%02x:%02x:%02x",
+				 bytes[0], bytes[1], bytes[2], bytes[3], bytes[4], bytes[5]);
+		break;
+
+	case SERIAL_DECIMAL:
+	case SERIAL_HEX:
+		{
+			unsigned int base = serial->format == SERIAL_DECIMAL ? 10 : 16;
+			for (int i = serial->size - 1; i >= 0; i--)
+			{
+				bytes[i] = "0123456789ABCDEF"[number % base];
+				number /= base;
+			}
+			fits = number == 0;
+			memcpy(serial->text, bytes, serial->size);
+			serial->text[serial->size] = 0;
+		}
+		break;
+	}
+
+	if (!fits)
+	{
+		printf ("*** Serial number %llu does not fit the format.\n", serial->counter);
+		return false;
+	}
+
+	for (int i = 0; i < serial->size; i++)
+	{
+		*serial->bytes[i] = bytes[i];
+	}
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : AdvanceSerial
+//
+// Desc    : Moves on to the next serial number once the current one has
+//           been programmed, and saves it in the counter file. The number
+//           is written to a temporary file, which is committed to disk and
+//           then replaces the counter file, so the counter file holds
+//           either the old or the new number however the program stops.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool AdvanceSerial(SERIAL *serial)
+{
+	unsigned long long next = serial->counter + 1;
+
+	char temp_name[MAX_NAME_LENGTH];
+	snprintf(temp_name, sizeof(temp_name), "%s.tmp", serial->counter_name);
+
+	FILE *file = NULL;
+	if (fopen_s(&file, temp_name, "w") != 0 || file == NULL)
+	{
+		printf ("*** Cannot create %s.\n", temp_name);
+		return false;
+	}
+	if (serial->counter_hex_digits > 0)
+	{
+		fprintf(file, "0x%0*llx\n", serial->counter_hex_digits, next);
+	}
+	else
+	{
+		fprintf(file, "%llu\n", next);
+	}
+	bool ok = fflush(file) == 0 && _commit(_fileno(file)) == 0;
+	ok = fclose(file) == 0 && ok;
+
+	if (!ok || !MoveFileEx(temp_name, serial->counter_name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		printf ("*** Cannot save the next serial number in %s.\n", serial->counter_name);
+		return false;
+	}
+
+	serial->counter = next;
+	return true;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef SERIAL_H
+#define SERIAL_H
+
+/*
+ * The most bytes a serial number may take in the image.
+ */
+#define MAX_SERIAL_BYTES  16
+
+typedef enum {
+	SERIAL_LE32,       // 32 bit number, least significant byte first.
+	SERIAL_MAC,        // 48 bit number, most significant byte first.
+	SERIAL_DECIMAL,    // ASCII decimal digits, zero padded.
+	SERIAL_HEX         // ASCII hex digits, zero padded.
+} SERIAL_FORMAT;
+
+/*
+ * A serial number patched into the loaded hex file, one unit after the
+ * other. The hex file must already hold data (such as a placeholder) at the
+ * bytes the serial number takes; "bytes" points straight at them in the
+ * segments, so patching a unit costs no more than formatting the number.
+ * The next number to use is kept in the counter file.
+ */
+typedef struct {
+	unsigned int address;              // Hex file address of the first byte.
+	SERIAL_FORMAT format;
+	int size;                          // Bytes the serial number takes.
+	unsigned long long counter;        // The number of the current unit.
+	int counter_hex_digits;            // As found in the counter file, or 0 for decimal.
+	const char *counter_name;
+	unsigned char *bytes[MAX_SERIAL_BYTES];
+	char text[2 * MAX_SERIAL_BYTES + 1];  // The current number, as printed.
+} SERIAL;
+
+bool BeginSerial(SERIAL *serial, const char *address, const char *format, const char *counter_name);
+bool PatchSerial(SERIAL *serial);
+bool AdvanceSerial(SERIAL *serial);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "Session.h"
+#include "Pic16.h"
+#include "Pic18.h"
+#include "Pic32.h"
+
+bool g_allow_unsettled_vpp = false;
+
+static const FAMILY_OPERATIONS family_operations[] = {
+	{
+		FAMILY_PIC16,
+		BeginSession16,
+		EndSession16,
+		IsTargetPresent16,
+		ReadDeviceIdWord16,
+		Erase16,
+		Program16,
+		NULL,
+		Verify16,
+		WriteEeprom16,
+		ReadMemory16,
+		ReadDeviceId16,
+		DumpDevice16
+	},
+	{
+		FAMILY_PIC18,
+		BeginSession18,
+		EndSession18,
+		IsTargetPresent18,
+		ReadDeviceIdWord18,
+		Erase18,
+		Program18,
+		NULL,
+		Verify18,
+		WriteEeprom18,
+		ReadMemory18,
+		ReadDeviceId18,
+		DumpDevice18
+	},
+	{
+		FAMILY_PIC32,
+		BeginSession32,
+		EndSession32,
+		IsTargetPresent32,
+		ReadDeviceIdWord32,
+		Erase32,
+		Program32,
+		Update32,
+		Verify32,
+		NULL,
+		ReadMemory32,
+		ReadDeviceId32,
+		DumpDevice32
+	}
+};
+
+//===========================================================================
+//
+// Name    : FamilyOperations
+//
+// Desc    : Looks up the operations of "family".
+//
+// Returns : The operations of the family.
+//
+//===========================================================================
+const FAMILY_OPERATIONS *FamilyOperations(FAMILY family)
+{
+	for (unsigned int i = 0; i < sizeof(family_operations) / sizeof(family_operations[0]); i++)
+	{
+		if (family_operations[i].family == family)
+		{
+			return &family_operations[i];
+		}
+	}
+	return NULL;
+}
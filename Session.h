@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "Devices.h"
+
+/*
+ * What a family can do. Operations a family lacks are NULL. All but
+ * is_target_present may be called between begin_session and end_session,
+ * in which case the target is powered up (or put in programming mode) once
+ * for all of them rather than once for each. If begin_session fails, no
+ * session is open and end_session must not be called.
+ */
+typedef struct {
+	FAMILY family;
+	bool (*begin_session)();
+	bool (*end_session)();
+	bool (*is_target_present)();
+	bool (*read_device_id)(unsigned int *device_id);
+	bool (*erase)();
+	bool (*program)();
+	bool (*update)();
+	bool (*verify)();
+	bool (*write_eeprom)();
+	bool (*read_memory)(unsigned int address, unsigned char *buffer, int length);
+	void (*print_device_id)();
+	void (*dump)();
+} FAMILY_OPERATIONS;
+
+const FAMILY_OPERATIONS *FamilyOperations(FAMILY family);
+
+/*
+ * A PIC16F or PIC18F session fails to begin when Vpp does not settle, as a
+ * target that is missing or marginally supplied should not be programmed.
+ * With -nosettle that is only a warning and the session goes ahead.
+ */
+extern bool g_allow_unsettled_vpp;
+
+#endif
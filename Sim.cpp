@@ -0,0 +1,1152 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "windows.h"
+#include "Capabilities.h"
+#include "Commands.h"
+#include "Crc32.h"
+#include "Devices.h"
+#include "Sim.h"
+#include "pic32mx.h"
+
+//
+// The parts simulated, one per family. Define these when building to
+// simulate other parts from the device tables.
+//
+#ifndef SIM_DEVICE_ID_16
+#define SIM_DEVICE_ID_16    0x1066      // 16F628A rev 6.
+#endif
+#ifndef SIM_DEVICE_ID_18
+#define SIM_DEVICE_ID_18    0x5c02      // 18F45K50 rev 2.
+#endif
+#ifndef SIM_DEVICE_ID_32
+#define SIM_DEVICE_ID_32    0x14a00053  // PIC32MX220F032B rev 1.
+#endif
+
+//
+// How long Vpp takes to rise after VPPON, in ms. Until then the PIC16F and
+// PIC18F targets are not in programming mode and read as all zeros.
+//
+#ifndef SIM_VPP_SETTLE_TIME
+#define SIM_VPP_SETTLE_TIME 20
+#endif
+
+//
+// The optional protocol features the simulated firmware reports. Define
+// fewer when building to try the host against older firmware.
+//
+#ifndef SIM_CAPABILITIES
+#define SIM_CAPABILITIES (CAPABILITY_READ_CRCS | CAPABILITY_ROW_PIPELINE | CAPABILITY_PAGE_ERASE | CAPABILITY_VDD_VPP_ON | CAPABILITY_PACKED_ROWS | CAPABILITY_EEPROM)
+#endif
+
+//
+// Every this many flash writes, the first word of the write does not take
+// and is left as it was, as happens now and then with long leads; 0 for
+// never. Define this when building to try the verify retries.
+//
+#ifndef SIM_WRITE_FAULTS
+#define SIM_WRITE_FAULTS    0
+#endif
+
+//
+// The timing model, in microseconds. Nothing actually waits; the simulator
+// keeps a clock of its own (see SimTime). The defaults are the typical
+// figures of the simulated parts and a full speed USB programmer. Define
+// these when building, or change g_sim_timing, to model something else.
+//
+#ifndef SIM_USB_LATENCY
+#define SIM_USB_LATENCY       1000    // From a command being sent to its response arriving, one frame.
+#endif
+#ifndef SIM_USB_PACKET
+#define SIM_USB_PACKET        53      // Each packet on the wire; 19 bulk packets fit in a frame.
+#endif
+#ifndef SIM_READ_BYTE
+#define SIM_READ_BYTE         8       // Reading one PIC16F/PIC18F byte over ICSP.
+#endif
+#ifndef SIM_READ_WORD_32
+#define SIM_READ_WORD_32      20      // Reading one PIC32MX word.
+#endif
+#ifndef SIM_WRITE_16
+#define SIM_WRITE_16          2500    // Programming one PIC16F write latch.
+#endif
+#ifndef SIM_WRITE_18
+#define SIM_WRITE_18          1000    // Programming one PIC18F write buffer.
+#endif
+#ifndef SIM_WRITE_ROW_32
+#define SIM_WRITE_ROW_32      2000    // Programming one PIC32MX row.
+#endif
+#ifndef SIM_WRITE_EEPROM
+#define SIM_WRITE_EEPROM      4000    // Programming one data EEPROM byte.
+#endif
+#ifndef SIM_ERASE_16
+#define SIM_ERASE_16          6000    // PIC16F bulk erase.
+#endif
+#ifndef SIM_ERASE_18
+#define SIM_ERASE_18          15000   // PIC18F bulk erase.
+#endif
+#ifndef SIM_ERASE_32
+#define SIM_ERASE_32          20000   // PIC32MX chip erase.
+#endif
+#ifndef SIM_ERASE_PAGE_32
+#define SIM_ERASE_PAGE_32     20000   // PIC32MX page erase.
+#endif
+
+SIM_ACTIVITY g_sim_activity;
+
+SIM_TIMING g_sim_timing = {
+	SIM_USB_LATENCY,
+	SIM_USB_PACKET,
+	SIM_READ_BYTE,
+	SIM_READ_WORD_32,
+	SIM_WRITE_16,
+	SIM_WRITE_18,
+	SIM_WRITE_ROW_32,
+	SIM_WRITE_EEPROM,
+	SIM_ERASE_16,
+	SIM_ERASE_18,
+	SIM_ERASE_32,
+	SIM_ERASE_PAGE_32
+};
+
+//
+// Responses waiting to be received, one USB packet each.
+//
+#define SIM_MAX_RESPONSES   64
+#define SIM_PACKET_SIZE     64
+
+/*
+ * A memory area of a simulated target.
+ */
+typedef struct {
+	unsigned int start;
+	unsigned int size;
+	unsigned char *bytes;
+} SIM_REGION;
+
+static unsigned char responses[SIM_MAX_RESPONSES][SIM_PACKET_SIZE];
+static int response_lengths[SIM_MAX_RESPONSES];
+static double response_times[SIM_MAX_RESPONSES];
+static int first_response = 0;
+static int number_of_responses = 0;
+
+//
+// PIC16F: 14 bit words stored little endian, indexed by twice the word
+// address, covering program memory and the configuration words.
+//
+static unsigned char flash16[2 * 0x2008];
+static unsigned char eeprom16[256];
+
+//
+// PIC18F.
+//
+static unsigned char flash18[0x10000];
+static unsigned char id18[8];
+static unsigned char config18[16];
+static unsigned char devid18[16];
+static unsigned char eeprom18[256];
+
+static SIM_REGION regions18[] = {
+	{ 0x000000, sizeof(flash18),  flash18 },
+	{ 0x200000, sizeof(id18),     id18 },
+	{ 0x300000, sizeof(config18), config18 },
+	{ 0x3ffff0, sizeof(devid18),  devid18 },
+};
+
+//
+// PIC32MX.
+//
+static unsigned char pfm32[0x80000];
+static unsigned char bfm32[0x3000];
+static unsigned char devid32[4];
+static unsigned char row32[0x200];
+static unsigned char row_buffers32[2][0x200];
+
+static SIM_REGION regions32[] = {
+	{ PFM_START,         sizeof(pfm32),   pfm32 },
+	{ BFM_START,         sizeof(bfm32),   bfm32 },
+	{ DEVICE_ID_ADDRESS, sizeof(devid32), devid32 },
+};
+
+static unsigned int device_id16 = SIM_DEVICE_ID_16;
+static unsigned int device_id18 = SIM_DEVICE_ID_18;
+static unsigned int device_id32 = SIM_DEVICE_ID_32;
+
+static const DEVICE *device16;
+static const DEVICE *device18;
+static const DEVICE *device32;
+
+//
+// True while the targets have been pulled by SimReplaceBoard.
+//
+static bool board_absent = false;
+
+//
+// The host's clock, and when the programmer will be done with the commands
+// sent so far, in microseconds.
+//
+static double host_time = 0;
+static double programmer_time = 0;
+
+//
+// When Vpp was last turned on, on the programmer's clock.
+//
+static double vpp_on_time = 0;
+
+static void InsertBoard();
+
+//===========================================================================
+//
+// Name    : Busy
+//
+// Desc    : Keeps the programmer busy for "microseconds" with the command
+//           being executed. Responses queued after this go out no earlier.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void Busy(double microseconds)
+{
+	programmer_time += microseconds;
+}
+
+//===========================================================================
+//
+// Name    : WriteFails
+//
+// Desc    : Tells if the flash write being simulated is one of those that
+//           do not take (see SIM_WRITE_FAULTS).
+//
+// Returns : True if it is, false otherwise.
+//
+//===========================================================================
+static bool WriteFails()
+{
+	static int writes_left = SIM_WRITE_FAULTS;
+
+	if (SIM_WRITE_FAULTS == 0 || --writes_left > 0)
+	{
+		return false;
+	}
+	writes_left = SIM_WRITE_FAULTS;
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : Respond
+//
+// Desc    : Queues "length" bytes in "bytes" as one packet to be returned
+//           by SimReceive.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void Respond(const void *bytes, int length)
+{
+	if (number_of_responses == SIM_MAX_RESPONSES)
+	{
+		printf("*** (Sim) Too many responses queued; dropping one.\n");
+		return;
+	}
+
+	int last = (first_response + number_of_responses) % SIM_MAX_RESPONSES;
+	memcpy(responses[last], bytes, length);
+	response_lengths[last] = length;
+	response_times[last] = programmer_time + g_sim_timing.usb_latency / 2;
+	number_of_responses++;
+}
+
+//===========================================================================
+//
+// Name    : RespondOk
+//
+// Desc    : Queues an "OK".
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void RespondOk()
+{
+	Respond("OK", 2);
+}
+
+//===========================================================================
+//
+// Name    : RespondCrcs
+//
+// Desc    : Queues the CRC32s of "count" ranges, each four bytes little
+//           endian, in one packet.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void RespondCrcs(const unsigned int *crcs, int count)
+{
+	unsigned char response[SIM_PACKET_SIZE];
+
+	for (int i = 0; i < count; i++)
+	{
+		response[i * 4 + 0] = (crcs[i] >> 0) & 0xff;
+		response[i * 4 + 1] = (crcs[i] >> 8) & 0xff;
+		response[i * 4 + 2] = (crcs[i] >> 16) & 0xff;
+		response[i * 4 + 3] = (crcs[i] >> 24) & 0xff;
+	}
+	Respond(response, count * 4);
+}
+
+//===========================================================================
+//
+// Name    : Locate
+//
+// Desc    : Finds the byte at "address" in one of the "count" "regions".
+//
+// Returns : A pointer to the byte, or NULL if it is not in any region.
+//
+//===========================================================================
+static unsigned char *Locate(SIM_REGION *regions, int count, unsigned int address)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (regions[i].start <= address && address < regions[i].start + regions[i].size)
+		{
+			return &regions[i].bytes[address - regions[i].start];
+		}
+	}
+	return NULL;
+}
+
+//===========================================================================
+//
+// Name    : ReadRegions
+//
+// Desc    : Reads "length" bytes from "address" in the "count" "regions"
+//           into "buffer". Unimplemented memory reads as zero.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void ReadRegions(SIM_REGION *regions, int count, unsigned int address, unsigned char *buffer, int length)
+{
+	for (int i = 0; i < length; i++)
+	{
+		unsigned char *byte = Locate(regions, count, address + i);
+		buffer[i] = byte != NULL ? *byte : 0x00;
+	}
+}
+
+//===========================================================================
+//
+// Name    : CrcRegions
+//
+// Desc    : Calculates the CRC32 of "length" bytes from "address" in the
+//           "count" "regions".
+//
+// Returns : The CRC32.
+//
+//===========================================================================
+static unsigned int CrcRegions(SIM_REGION *regions, int count, unsigned int address, unsigned int length)
+{
+	unsigned int crc = 0;
+	unsigned char buffer[256];
+
+	for (unsigned int i = 0; i < length; i += sizeof(buffer))
+	{
+		unsigned int n = (length - i < sizeof(buffer)) ? length - i : sizeof(buffer);
+		ReadRegions(regions, count, address + i, buffer, n);
+		crc = Crc32(buffer, n, crc);
+	}
+	return crc;
+}
+
+//===========================================================================
+//
+// Name    : EraseAll
+//
+// Desc    : Sets each target to the state after a bulk/chip erase.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void EraseAll16()
+{
+	for (unsigned int i = 0; i < sizeof(flash16); i += 2)
+	{
+		if (i < 2 * 0x2000 || i >= 2 * 0x2007)
+		{
+			flash16[i] = 0xff;
+			flash16[i + 1] = 0x3f;
+		}
+	}
+	memset(eeprom16, 0xff, sizeof(eeprom16));
+}
+
+static void EraseAll18()
+{
+	memset(flash18, 0xff, sizeof(flash18));
+	memset(id18, 0xff, sizeof(id18));
+	for (unsigned int i = 0; i < sizeof(config18); i++)
+	{
+		config18[i] = i < device18->config_size ? device18->config_mask[i] : 0x00;
+	}
+	memset(eeprom18, 0xff, sizeof(eeprom18));
+}
+
+static void EraseAll32()
+{
+	memset(pfm32, 0xff, sizeof(pfm32));
+	memset(bfm32, 0xff, sizeof(bfm32));
+}
+
+//===========================================================================
+//
+// Name    : Command16
+//
+// Desc    : Executes a PIC16F command.
+//
+// Returns : True if the command is known, false otherwise.
+//
+//===========================================================================
+static bool Command16(unsigned char *command, int length)
+{
+	unsigned int address = (command[1] << 8) | command[2];
+
+	switch (command[0])
+	{
+	case VPPVDDOFF_16:
+		if (board_absent)
+		{
+			InsertBoard();
+		}
+		RespondOk();
+		return true;
+
+	case VPPON_16:
+	case VDDVPPON_16:
+		vpp_on_time = programmer_time;
+		RespondOk();
+		return true;
+
+	case VDDON_16:
+		RespondOk();
+		return true;
+
+	case ERASE_16:
+		EraseAll16();
+		Busy(g_sim_timing.erase_16);
+		g_sim_activity.bulk_erases++;
+		RespondOk();
+		return true;
+
+	case READBYTES_16:
+		{
+			unsigned char buffer[SIM_PACKET_SIZE];
+			for (int i = 0; i < command[3]; i++)
+			{
+				unsigned int offset = 2 * address + i;
+				buffer[i] = offset < sizeof(flash16) ? flash16[offset] : 0x00;
+			}
+			Busy(command[3] * g_sim_timing.read_byte);
+			if (programmer_time - vpp_on_time < SIM_VPP_SETTLE_TIME * 1000)
+			{
+				memset(buffer, 0x00, command[3]);
+			}
+			Respond(buffer, command[3]);
+		}
+		return true;
+
+	case PROGRAMBYTES_16:
+		//
+		// Each word is erased and written, so no need to AND with the old content.
+		//
+		for (int i = WriteFails() ? 2 : 0; i < length - 3; i++)
+		{
+			unsigned int offset = 2 * address + i;
+			if (offset < 2 * 0x2000)
+			{
+				flash16[offset] = command[3 + i] & ((offset % 2) ? 0x3f : 0xff);
+			}
+		}
+		Busy((length - 3 + device16->write_size - 1) / device16->write_size * g_sim_timing.write_16);
+		g_sim_activity.writes += (length - 3 + device16->write_size - 1) / device16->write_size;
+		RespondOk();
+		return true;
+
+	case PROGRAMCONFIGWORD_16:
+		flash16[2 * 0x2007] = command[1];
+		flash16[2 * 0x2007 + 1] = command[2] & 0x3f;
+		Busy(g_sim_timing.write_16);
+		g_sim_activity.writes++;
+		RespondOk();
+		return true;
+
+	case READEEPROM_16:
+		{
+			unsigned char buffer[SIM_PACKET_SIZE];
+			for (int i = 0; i < command[3]; i++)
+			{
+				buffer[i] = eeprom16[(address + i) % device16->eeprom_size];
+			}
+			Busy(command[3] * g_sim_timing.read_byte);
+			Respond(buffer, command[3]);
+		}
+		return true;
+
+	case PROGRAMEEPROM_16:
+		for (int i = 0; i < length - 3; i++)
+		{
+			eeprom16[(address + i) % device16->eeprom_size] = command[3 + i];
+		}
+		Busy((length - 3) * g_sim_timing.write_eeprom);
+		g_sim_activity.eeprom_bytes_written += length - 3;
+		RespondOk();
+		return true;
+
+	case READCRCS_16:
+		{
+			//
+			// The address of each range is a word address, the length is in bytes.
+			//
+			unsigned int crcs[16];
+			for (int i = 0; i < command[1]; i++)
+			{
+				unsigned char *range = &command[2 + i * 4];
+				unsigned int range_address = 2 * ((range[0] << 8) | range[1]);
+				unsigned int range_length = (range[2] << 8) | range[3];
+				unsigned int crc = 0;
+				for (unsigned int j = 0; j < range_length; j++)
+				{
+					unsigned char byte = range_address + j < sizeof(flash16) ? flash16[range_address + j] : 0x00;
+					crc = Crc32(&byte, 1, crc);
+				}
+				crcs[i] = crc;
+				Busy(range_length * g_sim_timing.read_byte);
+			}
+			RespondCrcs(crcs, command[1]);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+//===========================================================================
+//
+// Name    : Command18
+//
+// Desc    : Executes a PIC18F command.
+//
+// Returns : True if the command is known, false otherwise.
+//
+//===========================================================================
+static bool Command18(unsigned char *command, int length)
+{
+	const int number_of_regions = sizeof(regions18) / sizeof(SIM_REGION);
+	unsigned int address = (command[1] << 16) | (command[2] << 8) | command[3];
+
+	switch (command[0])
+	{
+	case VPPVDDOFF:
+		if (board_absent)
+		{
+			InsertBoard();
+		}
+		RespondOk();
+		return true;
+
+	case VPPON:
+	case VDDVPPON:
+		vpp_on_time = programmer_time;
+		RespondOk();
+		return true;
+
+	case VDDON:
+		RespondOk();
+		return true;
+
+	case ERASE:
+		EraseAll18();
+		Busy(g_sim_timing.erase_18);
+		g_sim_activity.bulk_erases++;
+		RespondOk();
+		return true;
+
+	case READBYTES:
+		{
+			unsigned char buffer[SIM_PACKET_SIZE];
+			ReadRegions(regions18, number_of_regions, address, buffer, command[4]);
+			Busy(command[4] * g_sim_timing.read_byte);
+			if (programmer_time - vpp_on_time < SIM_VPP_SETTLE_TIME * 1000)
+			{
+				memset(buffer, 0x00, command[4]);
+			}
+			Respond(buffer, command[4]);
+		}
+		return true;
+
+	case PROGRAMBYTES:
+		{
+			if (length - 4 > (int)device18->write_size)
+			{
+				printf("*** (Sim) %i bytes overflow the %i byte write buffer.\n", length - 4, device18->write_size);
+			}
+			for (int i = WriteFails() ? 1 : 0; i < length - 4; i++)
+			{
+				unsigned char *byte = Locate(regions18, number_of_regions, address + i);
+				if (byte != NULL && address + i < 0x300000)
+				{
+					*byte &= command[4 + i];
+				}
+			}
+			Busy(g_sim_timing.write_18);
+			g_sim_activity.writes++;
+			RespondOk();
+		}
+		return true;
+
+	case PROGRAMCONFIGBYTE:
+		{
+			//
+			// Unimplemented config bits read as zero.
+			//
+			unsigned int offset = command[1];
+			if (offset < device18->config_size)
+			{
+				config18[offset] = command[2] & device18->config_mask[offset];
+			}
+			Busy(g_sim_timing.write_18);
+			g_sim_activity.writes++;
+			RespondOk();
+		}
+		return true;
+
+	case READEEPROM:
+		{
+			unsigned char buffer[SIM_PACKET_SIZE];
+			unsigned int eeprom_address = (command[1] << 8) | command[2];
+			for (int i = 0; i < command[3]; i++)
+			{
+				buffer[i] = eeprom18[(eeprom_address + i) % device18->eeprom_size];
+			}
+			Busy(command[3] * g_sim_timing.read_byte);
+			Respond(buffer, command[3]);
+		}
+		return true;
+
+	case PROGRAMEEPROM:
+		{
+			unsigned int eeprom_address = (command[1] << 8) | command[2];
+			for (int i = 0; i < length - 3; i++)
+			{
+				eeprom18[(eeprom_address + i) % device18->eeprom_size] = command[3 + i];
+			}
+			Busy((length - 3) * g_sim_timing.write_eeprom);
+			g_sim_activity.eeprom_bytes_written += length - 3;
+			RespondOk();
+		}
+		return true;
+
+	case READCRCS:
+		{
+			unsigned int crcs[16];
+			for (int i = 0; i < command[1]; i++)
+			{
+				unsigned char *range = &command[2 + i * 5];
+				unsigned int range_address = (range[0] << 16) | (range[1] << 8) | range[2];
+				unsigned int range_length = (range[3] << 8) | range[4];
+				crcs[i] = CrcRegions(regions18, number_of_regions, range_address, range_length);
+				Busy(range_length * g_sim_timing.read_byte);
+			}
+			RespondCrcs(crcs, command[1]);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+//===========================================================================
+//
+// Name    : ProgramRow32
+//
+// Desc    : Programs one row at "address" from "row".
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void ProgramRow32(unsigned int address, const unsigned char *row)
+{
+	const int number_of_regions = sizeof(regions32) / sizeof(SIM_REGION);
+
+	for (unsigned int i = WriteFails() ? 4 : 0; i < device32->write_size; i++)
+	{
+		unsigned char *byte = Locate(regions32, number_of_regions, address + i);
+		if (byte != NULL)
+		{
+			*byte &= row[i];
+		}
+	}
+
+	//
+	// DEVCFG0 always reads with its most significant bit cleared.
+	//
+	unsigned char *devcfg0 = Locate(regions32, number_of_regions, device32->config_address + 15);
+	if (devcfg0 != NULL)
+	{
+		*devcfg0 &= 0x7f;
+	}
+}
+
+//===========================================================================
+//
+// Name    : Command32
+//
+// Desc    : Executes a PIC32MX command.
+//
+// Returns : True if the command is known, false otherwise.
+//
+//===========================================================================
+static bool Command32(unsigned char *command, int length)
+{
+	const int number_of_regions = sizeof(regions32) / sizeof(SIM_REGION);
+	unsigned int address = command[1] | (command[2] << 8) | (command[3] << 16) | ((unsigned int)command[4] << 24);
+
+	switch (command[0])
+	{
+	case COMMAND_CHECK_DEVICE:
+		{
+			unsigned char mchp_status = board_absent ? 0xff : MCHP_STATUS_CFGRDY;
+			if (board_absent)
+			{
+				InsertBoard();
+			}
+			Respond(&mchp_status, 1);
+		}
+		return true;
+
+	case COMMAND_ERASE:
+		{
+			unsigned char mchp_status = MCHP_STATUS_CFGRDY;
+			EraseAll32();
+			Busy(g_sim_timing.erase_32);
+			g_sim_activity.bulk_erases++;
+			Respond(&mchp_status, 1);
+		}
+		return true;
+
+	case COMMAND_ENTER_SERIAL_EXECUTION_MODE:
+	case COMMAND_EXIT_PROGRAMMING_MODE:
+		RespondOk();
+		return true;
+
+	case COMMAND_READ_WORDS:
+		{
+			unsigned char buffer[SIM_PACKET_SIZE];
+			int bytes = command[5] * 4;
+			if (bytes > SIM_PACKET_SIZE)
+			{
+				bytes = SIM_PACKET_SIZE;
+			}
+			ReadRegions(regions32, number_of_regions, address, buffer, bytes);
+			Busy(bytes / 4 * g_sim_timing.read_word_32);
+			Respond(buffer, bytes);
+		}
+		return true;
+
+	case COMMAND_SEND_WORDS:
+		{
+			unsigned int offset = command[1];
+			for (int i = 0; i < length - 2 && offset + i < sizeof(row32); i++)
+			{
+				row32[offset + i] = command[2 + i];
+			}
+			RespondOk();
+		}
+		return true;
+
+	case COMMAND_PROGRAM_WORDS:
+		ProgramRow32(address, row32);
+		memset(row32, 0xff, sizeof(row32));
+		Busy(g_sim_timing.write_row_32);
+		g_sim_activity.writes++;
+		RespondOk();
+		return true;
+
+	case COMMAND_ERASE_PAGE:
+		{
+			unsigned char status = MCHP_STATUS_CFGRDY;
+			unsigned int page = address & ~(device32->erase_size - 1);
+			for (unsigned int i = 0; i < device32->erase_size; i++)
+			{
+				unsigned char *byte = Locate(regions32, number_of_regions, page + i);
+				if (byte != NULL)
+				{
+					*byte = 0xff;
+				}
+			}
+			Busy(g_sim_timing.erase_page_32);
+			g_sim_activity.pages_erased++;
+			Respond(&status, 1);
+		}
+		return true;
+
+	case COMMAND_SEND_BUFFER_WORDS:
+		{
+			//
+			// No response; errors are reported by COMMAND_PROGRAM_BUFFER.
+			//
+			unsigned char *row = row_buffers32[command[1] & 1];
+			unsigned int offset = command[2] * 4;
+			for (int i = 0; i < length - 3 && offset + i < sizeof(row32); i++)
+			{
+				row[offset + i] = command[3 + i];
+			}
+		}
+		return true;
+
+	case COMMAND_SEND_BUFFER_PACKED:
+		{
+			//
+			// Unpack the runs (see Pack.h) into the row buffer. No
+			// response, as for COMMAND_SEND_BUFFER_WORDS.
+			//
+			unsigned char *row = row_buffers32[command[1] & 1];
+			unsigned int offset = command[2] * 4;
+			int i = 3;
+			while (i < length)
+			{
+				unsigned char t = command[i++];
+				unsigned int words = (t & 0x3f) + 1;
+				const unsigned char zeros[4] = {0x00, 0x00, 0x00, 0x00};
+				const unsigned char ones[4] = {0xff, 0xff, 0xff, 0xff};
+				const unsigned char *word = t < 0x80 ? zeros : ones;
+				if (t >= 0xc0)
+				{
+					word = &command[i];
+					i += 4;
+				}
+				for (unsigned int w = 0; w < words && offset + 4 <= sizeof(row32); w++, offset += 4)
+				{
+					if (t < 0x40)
+					{
+						word = &command[i];
+						i += 4;
+					}
+					memcpy(&row[offset], word, 4);
+				}
+			}
+		}
+		return true;
+
+	case COMMAND_PROGRAM_BUFFER:
+		{
+			unsigned char *row = row_buffers32[command[1] & 1];
+			unsigned int row_address = command[2] | (command[3] << 8) | (command[4] << 16) | ((unsigned int)command[5] << 24);
+			unsigned char status[] = {'R', 'W', command[1], MCHP_STATUS_CFGRDY};
+
+			ProgramRow32(row_address, row);
+			memset(row, 0xff, sizeof(row32));
+			Busy(g_sim_timing.write_row_32);
+			g_sim_activity.writes++;
+			Respond(status, 4);
+		}
+		return true;
+
+	case COMMAND_READ_CRCS:
+		{
+			unsigned int crcs[16];
+			for (int i = 0; i < command[1]; i++)
+			{
+				unsigned char *range = &command[2 + i * 8];
+				unsigned int range_address = range[0] | (range[1] << 8) | (range[2] << 16) | ((unsigned int)range[3] << 24);
+				unsigned int range_length = range[4] | (range[5] << 8) | (range[6] << 16) | ((unsigned int)range[7] << 24);
+				crcs[i] = CrcRegions(regions32, number_of_regions, range_address, range_length);
+				Busy(range_length / 4 * g_sim_timing.read_word_32);
+			}
+			RespondCrcs(crcs, command[1]);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+//===========================================================================
+//
+// Name    : CommandCommon
+//
+// Desc    : Executes a command common to all families.
+//
+// Returns : True if the command is known, false otherwise.
+//
+//===========================================================================
+static bool CommandCommon(unsigned char *command, int length)
+{
+	switch (command[0])
+	{
+	case GETCAPABILITIES:
+		{
+			unsigned int capabilities = SIM_CAPABILITIES;
+			unsigned char response[] = {
+				'C', 'A', 'P', 'S',
+				static_cast<unsigned char>(capabilities >> 0),
+				static_cast<unsigned char>(capabilities >> 8),
+				static_cast<unsigned char>(capabilities >> 16),
+				static_cast<unsigned char>(capabilities >> 24)
+			};
+			Respond(response, sizeof(response));
+		}
+		return true;
+	}
+
+	return false;
+}
+
+//===========================================================================
+//
+// Name    : InsertBoard
+//
+// Desc    : Puts blank targets in place.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void InsertBoard()
+{
+	EraseAll16();
+	flash16[2 * 0x2006] = device_id16 & 0xff;
+	flash16[2 * 0x2006 + 1] = device_id16 >> 8;
+	flash16[2 * 0x2007] = 0xff;
+	flash16[2 * 0x2007 + 1] = 0x3f;
+
+	EraseAll18();
+	devid18[14] = device_id18 & 0xff;
+	devid18[15] = device_id18 >> 8;
+
+	EraseAll32();
+	devid32[0] = (device_id32 >> 0) & 0xff;
+	devid32[1] = (device_id32 >> 8) & 0xff;
+	devid32[2] = (device_id32 >> 16) & 0xff;
+	devid32[3] = (device_id32 >> 24) & 0xff;
+	memset(row32, 0xff, sizeof(row32));
+	memset(row_buffers32, 0xff, sizeof(row_buffers32));
+
+	board_absent = false;
+}
+
+//===========================================================================
+//
+// Name    : SimOpen
+//
+// Desc    : Powers up the simulated programmer with blank targets.
+//
+// Returns : True.
+//
+//===========================================================================
+bool SimOpen()
+{
+	device16 = FindDevice(FAMILY_PIC16, device_id16);
+	device18 = FindDevice(FAMILY_PIC18, device_id18);
+	device32 = FindDevice(FAMILY_PIC32, device_id32);
+
+	InsertBoard();
+
+	first_response = 0;
+	number_of_responses = 0;
+	host_time = 0;
+	programmer_time = 0;
+	vpp_on_time = 0;
+	memset(&g_sim_activity, 0, sizeof(g_sim_activity));
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : SimReplaceBoard
+//
+// Desc    : Pulls the simulated targets, as an operator would between two
+//           boards. They read as absent (zero device IDs, MCHP_STATUS 0xff)
+//           until the next power down or status check, after which blank
+//           ones take their place.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void SimReplaceBoard()
+{
+	board_absent = true;
+	memset(&flash16[2 * 0x2006], 0, 2);
+	memset(devid18, 0, sizeof(devid18));
+	memset(devid32, 0, sizeof(devid32));
+}
+
+//===========================================================================
+//
+// Name    : SimClose
+//
+// Desc    : Powers down the simulated programmer.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void SimClose()
+{
+	number_of_responses = 0;
+}
+
+//===========================================================================
+//
+// Name    : SimSend
+//
+// Desc    : Hands the "length" bytes of the command in "buffer" to the
+//           simulated programmer, which executes it right away and queues
+//           the response, if any. Unknown commands get no response, just
+//           like the real firmware.
+//
+// Returns : True.
+//
+//===========================================================================
+//===========================================================================
+//
+// Name    : SimSend
+//
+// Desc    : Executes the command of "length" bytes in "buffer", just like
+//           Send(). The command reaches the programmer half a USB latency
+//           after the host sent it, and is started once the programmer is
+//           done with the commands before it.
+//
+// Returns : True.
+//
+//===========================================================================
+bool SimSend(unsigned char *buffer, int length)
+{
+	host_time += g_sim_timing.usb_packet;
+	if (programmer_time < host_time + g_sim_timing.usb_latency / 2)
+	{
+		programmer_time = host_time + g_sim_timing.usb_latency / 2;
+	}
+
+	//
+	// Work on a zero padded copy so short commands can be decoded safely.
+	//
+	unsigned char command[1024] = {0};
+	if (length > (int)sizeof(command))
+	{
+		length = sizeof(command);
+	}
+	memcpy(command, buffer, length);
+
+	if (length < 1
+		|| (!Command16(command, length)
+			&& !Command18(command, length)
+			&& !Command32(command, length)
+			&& !CommandCommon(command, length)))
+	{
+		printf("+++ (Sim) Unknown command %02x.\n", command[0]);
+	}
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : SimReceive
+//
+// Desc    : Returns the oldest queued response, just like Receive(). If no
+//           response is queued, no bytes are returned, just like a USB read
+//           that times out. The host waits until the response has arrived.
+//
+// Returns : True.
+//
+//===========================================================================
+bool SimReceive(unsigned char *buffer, int *length)
+{
+	if (number_of_responses == 0)
+	{
+		*length = 0;
+		return true;
+	}
+
+	int bytes = response_lengths[first_response];
+	if (bytes > *length)
+	{
+		bytes = *length;
+	}
+	memcpy(buffer, responses[first_response], bytes);
+	*length = bytes;
+
+	if (host_time < response_times[first_response])
+	{
+		host_time = response_times[first_response];
+	}
+	host_time += g_sim_timing.usb_packet;
+
+	first_response = (first_response + 1) % SIM_MAX_RESPONSES;
+	number_of_responses--;
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : SimTime
+//
+// Desc    : Tells the time on the host according to the timing model (see
+//           g_sim_timing), counted from SimOpen.
+//
+// Returns : The time in milliseconds.
+//
+//===========================================================================
+double SimTime()
+{
+	return host_time / 1000;
+}
+
+//===========================================================================
+//
+// Name    : SimSelectPart
+//
+// Desc    : Makes the simulated "family" target the part called "name" in
+//           the device tables, from the next SimOpen.
+//
+// Returns : True if the part is known, false otherwise.
+//
+//===========================================================================
+bool SimSelectPart(FAMILY family, const char *name)
+{
+	const DEVICE *device = FindDeviceByName(family, name);
+	if (device == NULL)
+	{
+		return false;
+	}
+
+	switch (family)
+	{
+	case FAMILY_PIC16: device_id16 = device->device_id; break;
+	case FAMILY_PIC18: device_id18 = device->device_id; break;
+	case FAMILY_PIC32: device_id32 = device->device_id; break;
+	}
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : SimPart
+//
+// Desc    : Tells which part the simulated "family" target is.
+//
+// Returns : The part.
+//
+//===========================================================================
+const DEVICE *SimPart(FAMILY family)
+{
+	const DEVICE *device = FindDevice(family, family == FAMILY_PIC16 ? device_id16 : family == FAMILY_PIC18 ? device_id18 : device_id32);
+
+	return device != NULL ? device : DefaultDevice(family);
+}
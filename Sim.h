@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include "Devices.h"
+
+/*
+ * A loopback fake of the programmer firmware and the target PIC. When
+ * g_simulate is set, Send() and Receive() talk to the fake rather than USB,
+ * which makes it possible to run the programming paths without hardware.
+ */
+
+/*
+ * How long things take in the simulator, in microseconds.
+ */
+typedef struct {
+	double usb_latency;
+	double usb_packet;
+	double read_byte;
+	double read_word_32;
+	double write_16;
+	double write_18;
+	double write_row_32;
+	double write_eeprom;
+	double erase_16;
+	double erase_18;
+	double erase_32;
+	double erase_page_32;
+} SIM_TIMING;
+
+extern SIM_TIMING g_sim_timing;
+
+/*
+ * What the simulated targets have been asked to do since SimOpen.
+ */
+typedef struct {
+	unsigned int bulk_erases;
+	unsigned int pages_erased;
+	unsigned int writes;               // Write latches, write buffers, rows and configuration words.
+	unsigned int eeprom_bytes_written;
+} SIM_ACTIVITY;
+
+extern SIM_ACTIVITY g_sim_activity;
+
+bool SimOpen();
+void SimClose();
+bool SimSend(unsigned char *buffer, int length);
+bool SimReceive(unsigned char *buffer, int *length);
+void SimReplaceBoard();
+double SimTime();
+bool SimSelectPart(FAMILY family, const char *name);
+const DEVICE *SimPart(FAMILY family);
+
+#endif
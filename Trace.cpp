@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "windows.h"
+#include "Sim.h"
+#include "Usb.h"
+#include "Trace.h"
+
+//
+// Spans kept before they are written to the file.
+//
+#define TRACE_BUFFER_SPANS  4096
+
+/*
+ * One span; "name" and "category" must be string constants.
+ */
+typedef struct {
+	const char *name;
+	const char *category;
+	double start;                      // Microseconds.
+	double duration;
+	unsigned int address;
+	int length;
+	int board;
+} TRACE_SPAN;
+
+bool g_trace = false;
+
+static FILE *trace_file = NULL;
+static bool first_event = true;
+static int trace_every = 1;
+static int current_board = 1;
+static TRACE_SPAN spans[TRACE_BUFFER_SPANS];
+static int number_of_spans = 0;
+
+//===========================================================================
+//
+// Name    : WriteEvent
+//
+// Desc    : Writes the separator before the next event of the trace file.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void WriteEvent()
+{
+	fprintf(trace_file, first_event ? "\n" : ",\n");
+	first_event = false;
+}
+
+//===========================================================================
+//
+// Name    : FlushSpans
+//
+// Desc    : Writes the spans in the buffer to the trace file as complete
+//           ("X") events and empties the buffer.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void FlushSpans()
+{
+	for (int i = 0; i < number_of_spans; i++)
+	{
+		const TRACE_SPAN *span = &spans[i];
+		WriteEvent();
+		fprintf(trace_file, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %i, \"tid\": 1, \"ts\": %.1f, \"dur\": %.1f, \"args\": {",
+				span->name, span->category, span->board, span->start, span->duration);
+		if (span->address != TRACE_NO_ADDRESS)
+		{
+			fprintf(trace_file, "\"address\": \"%08x\"%s", span->address, span->length >= 0 ? ", " : "");
+		}
+		if (span->length >= 0)
+		{
+			fprintf(trace_file, "\"bytes\": %i", span->length);
+		}
+		fprintf(trace_file, "}}");
+	}
+	number_of_spans = 0;
+}
+
+//===========================================================================
+//
+// Name    : BeginTrace
+//
+// Desc    : Starts writing a trace to the file "name". In the production
+//           loop only every "every"th board is traced, starting with the
+//           first.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool BeginTrace(const char *name, int every)
+{
+	if (fopen_s(&trace_file, name, "w") != 0 || trace_file == NULL)
+	{
+		printf ("*** Cannot create the trace file %s.\n", name);
+		trace_file = NULL;
+		return false;
+	}
+	fprintf(trace_file, "[");
+	first_event = true;
+	trace_every = every > 0 ? every : 1;
+	number_of_spans = 0;
+	TraceBoard(1);
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : TraceBoard
+//
+// Desc    : Tells the trace that board "board" of the production loop is
+//           next. If it is sampled, its spans are traced as a process of
+//           their own, named after the board. Board 0 stops tracing until
+//           the next board, such as while waiting for boards.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void TraceBoard(int board)
+{
+	current_board = board;
+	g_trace = trace_file != NULL && board > 0 && (board - 1) % trace_every == 0;
+	if (g_trace)
+	{
+		WriteEvent();
+		fprintf(trace_file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %i, \"args\": {\"name\": \"board %i\"}}", board, board);
+		WriteEvent();
+		fprintf(trace_file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %i, \"tid\": 1, \"args\": {\"name\": \"host\"}}", board);
+	}
+}
+
+//===========================================================================
+//
+// Name    : TraceTime
+//
+// Desc    : Tells the time of the trace clock; the simulator's clock when
+//           simulating and the performance counter otherwise.
+//
+// Returns : The time in microseconds.
+//
+//===========================================================================
+double TraceTime()
+{
+	if (g_simulate)
+	{
+		return SimTime() * 1000;
+	}
+
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&frequency);
+	}
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart * 1000000.0 / frequency.QuadPart;
+}
+
+//===========================================================================
+//
+// Name    : TraceSpan
+//
+// Desc    : Records a span named "name" in category "category" from "start"
+//           (see TraceTime) until now, covering "length" bytes (if not
+//           negative) from "address" (unless TRACE_NO_ADDRESS). Nothing
+//           happens unless g_trace is set.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void TraceSpan(const char *name, const char *category, double start, unsigned int address, int length)
+{
+	if (!g_trace)
+	{
+		return;
+	}
+
+	TRACE_SPAN *span = &spans[number_of_spans++];
+	span->name = name;
+	span->category = category;
+	span->start = start;
+	span->duration = TraceTime() - start;
+	span->address = address;
+	span->length = length;
+	span->board = current_board;
+
+	if (number_of_spans == TRACE_BUFFER_SPANS)
+	{
+		FlushSpans();
+	}
+}
+
+//===========================================================================
+//
+// Name    : EndTrace
+//
+// Desc    : Writes what is left of the trace and closes the file.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void EndTrace()
+{
+	if (trace_file == NULL)
+	{
+		return;
+	}
+	FlushSpans();
+	fprintf(trace_file, "\n]\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	g_trace = false;
+}
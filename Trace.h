@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * A timeline of a run in the Chrome trace event format, for chrome://tracing
+ * or ui.perfetto.dev. Each phase (power up, settle, erase, program, verify,
+ * power down), each programming command and each USB Send and Receive is a
+ * span; a span lies within the spans that were open when it started, so
+ * the USB traffic shows nested under the phase it belongs to. Receive spans
+ * are the time spent waiting for the programmer, and gaps between spans are
+ * time the host spent on its own.
+ *
+ * Spans are taken with
+ *
+ *     double start = TraceTime();
+ *     ...
+ *     TraceSpan("erase", "target", start, address, length);
+ *
+ * and cost a clock read and a store into a buffer while tracing, and a test
+ * of g_trace otherwise. The buffer is written out when full and at
+ * EndTrace. Times come from the simulator's clock when simulating.
+ */
+
+/*
+ * If true, TraceSpan records spans. Set by BeginTrace and TraceBoard.
+ */
+extern bool g_trace;
+
+/*
+ * For spans without an address. Spans without a length give a negative one.
+ */
+#define TRACE_NO_ADDRESS  0xffffffff
+
+bool BeginTrace(const char *name, int every);
+void TraceBoard(int board);
+double TraceTime();
+void TraceSpan(const char *name, const char *category, double start, unsigned int address, int length);
+void EndTrace();
+
+#endif
@@ -9,6 +9,11 @@
 #include <WinUsb.h>
 #include <Setupapi.h>
 #include <Usb100.h>
+#include "Log.h"
+#include "PacketQueue.h"
+#include "Sim.h"
+#include "Trace.h"
+#include "Usb.h"
 
 DEFINE_GUID (GUID_PROG_DEVICE_INTERFACE_CLASS, 0xb35924d6, 0x3e16, 0x4a9e, 0x97, 0x82, 0x55, 0x24, 0xa4, 0xb7, 0x9b, 0xe0);
 
@@ -19,6 +24,88 @@ UCHAR in_pipe;
 
 extern bool g_verbose;
 bool g_print_txrx = false;
+bool g_simulate = false;
+USB_STATISTICS g_usb_statistics;
+
+/*
+ * True if the last thing done was a Send(), so the next response received
+ * is a turnaround.
+ */
+static bool sent_since_receive = false;
+
+/*
+ * The reader thread owns the IN pipe. It hands answers to commands to
+ * Receive() through "responses" and diagnostic packets to the logger.
+ */
+static HANDLE reader_thread = NULL;
+static HANDLE response_event = NULL;
+static volatile LONG stop_reader = 0;
+static volatile LONG reader_failed = 0;   // Set once the reader thread has stopped on a failed read.
+static PACKET_QUEUE responses;
+static DWORD receive_timeout = 1000;
+
+//===========================================================================
+//
+// Name    : ReaderThread
+//
+// Desc    : Reads the IN pipe until Close() is called. Diagnostic packets
+//           go to the logger and all others to the "responses" queue, so
+//           that neither has to wait for the other. A failed read (such as
+//           the programmer being unplugged) is passed on to Receive() as a
+//           packet of length -1 and stops the thread; from then on every
+//           Receive() fails once the packets before it have been taken.
+//
+// Returns : 0.
+//
+//===========================================================================
+static DWORD WINAPI ReaderThread(void *)
+{
+	unsigned char packet[PACKET_SIZE];
+
+	while (!stop_reader)
+	{
+		ULONG bytes_read;
+		int length;
+		if (!WinUsb_ReadPipe(usb_handle, in_pipe, packet, sizeof(packet), &bytes_read, NULL))
+		{
+			if (stop_reader || GetLastError() == ERROR_SEM_TIMEOUT)
+			{
+				continue;
+			}
+			length = -1;
+		}
+		else if (bytes_read == 0)
+		{
+			continue;
+		}
+		else if (IsLogPacket(packet, bytes_read))
+		{
+			Log(packet, bytes_read);
+			continue;
+		}
+		else
+		{
+			length = bytes_read;
+		}
+
+		if (length < 0)
+		{
+			InterlockedExchange(&reader_failed, 1);
+		}
+		while (!PushPacket(&responses, packet, length) && !stop_reader)
+		{
+			Sleep(1);
+		}
+		SetEvent(response_event);
+
+		if (length < 0)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
 
 //===========================================================================
 //
@@ -31,6 +118,11 @@ bool g_print_txrx = false;
 //===========================================================================
 bool Open()
 {
+	if (g_simulate)
+	{
+		return SimOpen();
+	}
+
 	HDEVINFO hardware_device_info = SetupDiGetClassDevs (&GUID_PROG_DEVICE_INTERFACE_CLASS,
 														 NULL,
 														 NULL,
@@ -181,9 +273,71 @@ bool Open()
 		return false;
 	}
 
+	//
+	// From here on the IN pipe is read by the reader thread only.
+	//
+	InitPacketQueue(&responses);
+	stop_reader = 0;
+	reader_failed = 0;
+	StartLogger();
+	response_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	reader_thread = CreateThread(NULL, 0, ReaderThread, NULL, 0, NULL);
+	if (reader_thread == NULL)
+	{
+		if (g_verbose)
+		{
+			printf ("*** CreateThread failed\n");
+		}
+		return false;
+	}
+
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : SetReceiveTimeout
+//
+// Desc    : Sets how long Receive() waits for an answer before giving up.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool SetReceiveTimeout(int milliseconds)
+{
+	receive_timeout = milliseconds;
 	return true;
 }
 
+//===========================================================================
+//
+// Name    : DiscardResponses
+//
+// Desc    : Throws away the packets that have arrived but not been taken
+//           by Receive(), such as an answer that came after Receive() gave
+//           up on it, so that they are not taken as the answer to the next
+//           command.
+//
+// Returns : The number of packets thrown away.
+//
+//===========================================================================
+int DiscardResponses()
+{
+	if (g_simulate)
+	{
+		return 0;
+	}
+
+	unsigned char packet[PACKET_SIZE];
+	int length;
+	int discarded = 0;
+	while (PopPacket(&responses, packet, &length))
+	{
+		discarded++;
+	}
+	return discarded;
+}
+
 //===========================================================================
 //
 // Name    : Close
@@ -195,6 +349,24 @@ bool Open()
 //===========================================================================
 void Close()
 {
+	if (g_simulate)
+	{
+		SimClose();
+		return;
+	}
+
+	if (reader_thread != NULL)
+	{
+		InterlockedExchange(&stop_reader, 1);
+		WinUsb_AbortPipe(usb_handle, in_pipe);
+		WaitForSingleObject(reader_thread, INFINITE);
+		CloseHandle(reader_thread);
+		CloseHandle(response_event);
+		reader_thread = NULL;
+		response_event = NULL;
+	}
+	StopLogger();
+
 	if (usb_handle != NULL)
 	{
 		WinUsb_Free(usb_handle);
@@ -206,14 +378,14 @@ void Close()
 
 //===========================================================================
 //
-// Name    : Send
+// Name    : SendPacket
 //
 // Desc    : Sends "length" bytes in "buffer" to the programmer over USB.
 //
 // Returns : True if successful, false otherwise.
 //
 //===========================================================================
-bool Send(unsigned char *buffer, int length)
+static bool SendPacket(unsigned char *buffer, int length)
 {
 	if (g_print_txrx)
 	{
@@ -225,6 +397,15 @@ bool Send(unsigned char *buffer, int length)
 		printf("\n");
 	}
 
+	g_usb_statistics.packets_sent++;
+	g_usb_statistics.bytes_sent += length;
+	sent_since_receive = true;
+
+	if (g_simulate)
+	{
+		return SimSend(buffer, length);
+	}
+
 	ULONG bytes_written;
 	if (!WinUsb_WritePipe(usb_handle, out_pipe, buffer, length, &bytes_written, NULL))
 	{
@@ -278,6 +459,23 @@ bool Send(unsigned char *buffer, int length)
 	return true;
 }
 
+//===========================================================================
+//
+// Name    : Send
+//
+// Desc    : Sends "length" bytes in "buffer" to the programmer over USB.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool Send(unsigned char *buffer, int length)
+{
+	double start = TraceTime();
+	bool ok = SendPacket(buffer, length);
+	TraceSpan("send", "usb", start, TRACE_NO_ADDRESS, length);
+	return ok;
+}
+
 //===========================================================================
 //
 // Name    : Send
@@ -294,30 +492,78 @@ bool Send(unsigned char byte)
 
 //===========================================================================
 //
-// Name    : Receive
+// Name    : ReceivePacket
 //
 // Desc    : Receives up to "*length" bytes into "buffer" from the programmer
 //           over USB. If successful, "*length" denotes the number of bytes
-//           actually received.
+//           actually received, which is 0 if nothing arrived within the
+//           receive timeout. Diagnostic packets are never returned; they go
+//           to the logger.
 //
-// Returns : True if successful, false otherwise.
+// Returns : True if successful, false otherwise, which includes every call
+//           after the reader thread has stopped on a failed read.
 //
 //===========================================================================
-bool Receive(unsigned char *buffer, int *length)
+static bool ReceivePacket(unsigned char *buffer, int *length)
 {
-	ULONG bytes_read;
+	unsigned char packet[PACKET_SIZE];
+	int bytes_read = 0;
 
 	memset(buffer, 0xcd, *length);
 
-	if (!WinUsb_ReadPipe(usb_handle, in_pipe, buffer, *length, &bytes_read, NULL)
-		&& GetLastError() != ERROR_SEM_TIMEOUT)
+	if (g_simulate)
 	{
-		*length = 0;
-		return false;
+		bytes_read = sizeof(packet);
+		SimReceive(packet, &bytes_read);
+		if (IsLogPacket(packet, bytes_read))
+		{
+			Log(packet, bytes_read);
+			bytes_read = 0;
+		}
+	}
+	else
+	{
+		DWORD start = GetTickCount();
+		while (!PopPacket(&responses, packet, &bytes_read))
+		{
+			if (reader_failed)
+			{
+				bytes_read = -1;
+				break;
+			}
+			DWORD elapsed = GetTickCount() - start;
+			if (elapsed >= receive_timeout)
+			{
+				bytes_read = 0;
+				break;
+			}
+			WaitForSingleObject(response_event, receive_timeout - elapsed);
+		}
+		if (bytes_read < 0)
+		{
+			*length = 0;
+			return false;
+		}
 	}
 
+	if (bytes_read > *length)
+	{
+		bytes_read = *length;
+	}
+	memcpy(buffer, packet, bytes_read);
 	*length = bytes_read;
 
+	if (bytes_read > 0)
+	{
+		g_usb_statistics.packets_received++;
+		g_usb_statistics.bytes_received += bytes_read;
+		if (sent_since_receive)
+		{
+			g_usb_statistics.turnarounds++;
+			sent_since_receive = false;
+		}
+	}
+
 	if (g_print_txrx)
 	{
 		printf("RX: ");
@@ -331,3 +577,21 @@ bool Receive(unsigned char *buffer, int *length)
 	return true;
 }
 
+//===========================================================================
+//
+// Name    : Receive
+//
+// Desc    : Receives up to "*length" bytes into "buffer" from the programmer
+//           over USB, as ReceivePacket does. In a trace, the span is the time
+//           spent waiting for the programmer.
+//
+// Returns : True if successful, false otherwise.
+//
+//===========================================================================
+bool Receive(unsigned char *buffer, int *length)
+{
+	double start = TraceTime();
+	bool ok = ReceivePacket(buffer, length);
+	TraceSpan("receive", "usb", start, TRACE_NO_ADDRESS, *length);
+	return ok;
+}
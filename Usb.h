@@ -12,8 +12,31 @@
  */
 extern bool g_print_txrx;
 
+/*
+ * If true, Open(), Send() and Receive() talk to a simulated programmer (see
+ * Sim.cpp) rather than the real one.
+ */
+extern bool g_simulate;
+
+/*
+ * Counts of what Send() and Receive() have moved since the last reset. A
+ * turnaround is a Receive() that gets a response after one or more Send()s;
+ * each costs at least one USB frame, however many commands were in flight.
+ */
+typedef struct {
+	unsigned int packets_sent;
+	unsigned int bytes_sent;
+	unsigned int packets_received;
+	unsigned int bytes_received;
+	unsigned int turnarounds;
+} USB_STATISTICS;
+
+extern USB_STATISTICS g_usb_statistics;
+
 bool Open();
 void Close();
+bool SetReceiveTimeout(int milliseconds);
+int DiscardResponses();
 
 bool Receive(unsigned char *buffer, int *length);
 bool Send(unsigned char *buffer, int length);
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "HexFile.h"
+#include "Trace.h"
+#include "Verify.h"
+
+int g_verify_retries = 2;
+
+//===========================================================================
+//
+// Name    : BeginVerify
+//
+// Desc    : Prepares "verifier" for comparing the memory of "device", a
+//           "family" part. Mismatches are printed if "report" is set.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+void BeginVerify(VERIFIER *verifier, FAMILY family, const DEVICE *device, bool report)
+{
+	verifier->mask = MaskImage(family, device);
+	verifier->high_byte_mask = family == FAMILY_PIC16 ? 0x3f : 0xff;
+	verifier->address_digits = family == FAMILY_PIC32 ? 8 : 6;
+	verifier->report = report;
+	verifier->mismatches = 0;
+	verifier->in_run = false;
+	verifier->number_of_runs = 0;
+}
+
+//===========================================================================
+//
+// Name    : ByteMask
+//
+// Desc    : Gives the bits of the byte at "address", which is outside the
+//           mask image, that are verified.
+//
+// Returns : The mask.
+//
+//===========================================================================
+static unsigned char ByteMask(const VERIFIER *verifier, unsigned int address)
+{
+	return (address % 2) ? verifier->high_byte_mask : 0xff;
+}
+
+//===========================================================================
+//
+// Name    : Differs
+//
+// Desc    : Tells if any of the "length" bytes in "expected" and "actual"
+//           differ in the bits set in "mask". The bytes are compared eight
+//           at a time without branching on the data.
+//
+// Returns : True if they do, false otherwise.
+//
+//===========================================================================
+static bool Differs(const unsigned char *expected, const unsigned char *actual, const unsigned char *mask, unsigned int length)
+{
+	unsigned long long difference = 0;
+	unsigned int i = 0;
+
+	for (; i + 8 <= length; i += 8)
+	{
+		unsigned long long expected_word;
+		unsigned long long actual_word;
+		unsigned long long mask_word;
+		memcpy(&expected_word, &expected[i], 8);
+		memcpy(&actual_word, &actual[i], 8);
+		memcpy(&mask_word, &mask[i], 8);
+		difference |= (expected_word ^ actual_word) & mask_word;
+	}
+	for (; i < length; i++)
+	{
+		difference |= (expected[i] ^ actual[i]) & mask[i];
+	}
+
+	return difference != 0;
+}
+
+//===========================================================================
+//
+// Name    : EndRun
+//
+// Desc    : Counts the run of mismatching bytes being collected, if any,
+//           keeps it for RetryVerify if there is room and prints it unless
+//           too many have been printed already.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void EndRun(VERIFIER *verifier)
+{
+	if (!verifier->in_run)
+	{
+		return;
+	}
+	verifier->in_run = false;
+	verifier->mismatches++;
+
+	if (verifier->number_of_runs < VERIFY_MAX_RUNS)
+	{
+		VERIFY_RUN *run = &verifier->runs[verifier->number_of_runs++];
+		run->address = verifier->run_address;
+		run->length = verifier->run_length;
+		run->needs_erase = verifier->run_needs_erase;
+	}
+
+	if (!verifier->report || verifier->mismatches > VERIFY_REPORT_LIMIT)
+	{
+		return;
+	}
+	if (verifier->run_length == 1)
+	{
+		printf ("\n*** Verification Error: Byte %0*x should be %02x, but reads as %02x.\n",
+				verifier->address_digits,
+				verifier->run_address,
+				verifier->run_expected,
+				verifier->run_actual);
+	}
+	else
+	{
+		printf ("\n*** Verification Error: %u bytes from %0*x differ; the first should be %02x, but reads as %02x.\n",
+				verifier->run_length,
+				verifier->address_digits,
+				verifier->run_address,
+				verifier->run_expected,
+				verifier->run_actual);
+	}
+}
+
+//===========================================================================
+//
+// Name    : VerifyBytes
+//
+// Desc    : Compares the "length" bytes read back from "address" in "actual"
+//           with those in "expected". Bytes inside the mask image are first
+//           compared in one pass; only when that finds a difference (or a
+//           run of mismatches is being collected) are they looked at byte by
+//           byte to find the runs.
+//
+// Returns : True if all the bytes match, false otherwise.
+//
+//===========================================================================
+bool VerifyBytes(VERIFIER *verifier, unsigned int address, const unsigned char *expected, const unsigned char *actual, unsigned int length)
+{
+	const unsigned char *mask = MaskBytes(verifier->mask, address, length);
+
+	if (mask != NULL && !verifier->in_run && !Differs(expected, actual, mask, length))
+	{
+		return true;
+	}
+
+	if (verifier->in_run && address != verifier->run_address + verifier->run_length)
+	{
+		EndRun(verifier);
+	}
+
+	bool match = true;
+	for (unsigned int i = 0; i < length; i++)
+	{
+		unsigned char byte_mask = mask != NULL ? mask[i] : ByteMask(verifier, address + i);
+		if ((expected[i] ^ actual[i]) & byte_mask)
+		{
+			if (!verifier->in_run)
+			{
+				verifier->in_run = true;
+				verifier->run_address = address + i;
+				verifier->run_length = 0;
+				verifier->run_expected = expected[i];
+				verifier->run_actual = actual[i];
+				verifier->run_needs_erase = false;
+			}
+			if (expected[i] & ~actual[i] & byte_mask)
+			{
+				verifier->run_needs_erase = true;
+			}
+			verifier->run_length++;
+			match = false;
+		}
+		else
+		{
+			EndRun(verifier);
+		}
+	}
+
+	return match;
+}
+
+//===========================================================================
+//
+// Name    : EndVerify
+//
+// Desc    : Finishes the comparisons of "verifier", printing how many runs
+//           of mismatches went unprinted.
+//
+// Returns : True if everything matched, false otherwise.
+//
+//===========================================================================
+bool EndVerify(VERIFIER *verifier)
+{
+	EndRun(verifier);
+
+	if (verifier->report && verifier->mismatches > VERIFY_REPORT_LIMIT)
+	{
+		printf ("\n*** Verification Error: %i more run(s) of bytes differ.\n", verifier->mismatches - VERIFY_REPORT_LIMIT);
+	}
+
+	return verifier->mismatches == 0;
+}
+
+//===========================================================================
+//
+// Name    : ReverifyRun
+//
+// Desc    : Reads the bytes of "run" back from the target using
+//           "read_memory" and compares those the hex file has data for
+//           with it, using "verifier".
+//
+// Returns : True if successful, false if reading failed.
+//
+//===========================================================================
+static bool ReverifyRun(VERIFIER *verifier, const VERIFY_RUN *run, READ_MEMORY read_memory)
+{
+	unsigned int first = run->address & ~3;
+	unsigned int end = (run->address + run->length + 3) & ~3;
+	unsigned char *buffer = (unsigned char *)malloc(end - first);
+
+	if (!read_memory(first, buffer, end - first))
+	{
+		printf ("\n*** Verification Error: Failed to read %u bytes at %0*x\n", end - first, verifier->address_digits, first);
+		free(buffer);
+		return false;
+	}
+
+	for (int seg = 0; seg < g_number_of_segments; seg++)
+	{
+		unsigned int low = g_memory_segment[seg].address;
+		unsigned int high = g_memory_segment[seg].address + g_memory_segment[seg].length;
+		if (low < run->address)
+		{
+			low = run->address;
+		}
+		if (high > run->address + run->length)
+		{
+			high = run->address + run->length;
+		}
+		if (low < high)
+		{
+			VerifyBytes(verifier,
+						low,
+						&g_memory_segment[seg].bytes[low - g_memory_segment[seg].address],
+						&buffer[low - first],
+						high - low);
+		}
+	}
+
+	free(buffer);
+	return true;
+}
+
+//===========================================================================
+//
+// Name    : MergeRuns
+//
+// Desc    : Joins the runs in "runs" that overlap or follow on each other
+//           once widened by a rewrite. The runs are in address order.
+//
+// Returns : Nothing.
+//
+//===========================================================================
+static void MergeRuns(VERIFY_RUN *runs, int *number_of_runs)
+{
+	int merged = 0;
+	for (int i = 1; i < *number_of_runs; i++)
+	{
+		VERIFY_RUN *last = &runs[merged];
+		if (runs[i].address <= last->address + last->length)
+		{
+			if (runs[i].address + runs[i].length > last->address + last->length)
+			{
+				last->length = runs[i].address + runs[i].length - last->address;
+			}
+			last->needs_erase = last->needs_erase || runs[i].needs_erase;
+		}
+		else
+		{
+			runs[++merged] = runs[i];
+		}
+	}
+	*number_of_runs = *number_of_runs > 0 ? merged + 1 : 0;
+}
+
+//===========================================================================
+//
+// Name    : RetryVerify
+//
+// Desc    : Retries the runs of mismatching bytes a finished "verifier"
+//           found, rather than the whole device. The runs are first read
+//           back again, as long leads make reads as well as writes fail now
+//           and then. Runs that still differ are rewritten with "rewrite"
+//           (given "context") and read back again, up to g_verify_retries
+//           times. Without "rewrite", such as when only verifying, the runs
+//           are only read back again. Nothing is retried if
+//           g_verify_retries is 0, or if more than VERIFY_MAX_RUNS runs
+//           differ.
+//
+// Returns : True if the runs now match, false otherwise.
+//
+//===========================================================================
+bool RetryVerify(VERIFIER *verifier, READ_MEMORY read_memory, REWRITE_RUNS rewrite, void *context)
+{
+	if (verifier->mismatches == 0)
+	{
+		return true;
+	}
+	if (g_verify_retries <= 0)
+	{
+		return false;
+	}
+	if (verifier->mismatches > verifier->number_of_runs)
+	{
+		printf ("*** Too many runs of bytes differ to retry them.\n");
+		return false;
+	}
+
+	VERIFY_RUN runs[VERIFY_MAX_RUNS];
+	int number_of_runs = verifier->number_of_runs;
+	memcpy(runs, verifier->runs, number_of_runs * sizeof(VERIFY_RUN));
+
+	for (int retry = 0; ; retry++)
+	{
+		double start = TraceTime();
+		VERIFIER again = *verifier;
+		again.report = false;
+		again.mismatches = 0;
+		again.in_run = false;
+		again.number_of_runs = 0;
+		bool ok = true;
+		for (int i = 0; i < number_of_runs && ok; i++)
+		{
+			ok = ReverifyRun(&again, &runs[i], read_memory);
+		}
+		EndVerify(&again);
+		TraceSpan("reverify", "target", start, runs[0].address, -1);
+		if (!ok)
+		{
+			return false;
+		}
+
+		if (again.mismatches == 0)
+		{
+			if (retry == 0)
+			{
+				printf ("+++ The bytes that differed read back correctly the second time.\n");
+			}
+			else
+			{
+				printf ("+++ Verified after rewriting the bytes that differed %i time(s).\n", retry);
+			}
+			return true;
+		}
+		if (rewrite == NULL)
+		{
+			printf ("*** %i run(s) of bytes still differ when read back again.\n", again.mismatches);
+			return false;
+		}
+		if (retry == g_verify_retries || again.mismatches > again.number_of_runs)
+		{
+			printf ("*** %i run(s) of bytes still differ after %i rewrite(s).\n", again.mismatches, retry);
+			return false;
+		}
+
+		number_of_runs = again.number_of_runs;
+		memcpy(runs, again.runs, number_of_runs * sizeof(VERIFY_RUN));
+		printf ("+++ Rewriting %i run(s) of bytes that differ (%i of %i).\n", number_of_runs, retry + 1, g_verify_retries);
+
+		start = TraceTime();
+		ok = rewrite(context, runs, number_of_runs);
+		TraceSpan("rewrite", "target", start, runs[0].address, -1);
+		if (!ok)
+		{
+			return false;
+		}
+		MergeRuns(runs, &number_of_runs);
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2017 Johan Bergkvist
+ *
+ * This software may be modified and distributed under the terms
+ * of the MIT license.  See the LICENSE file for details.
+ */
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "Devices.h"
+#include "Image.h"
+
+/*
+ * At most this many runs of mismatching bytes are printed by one verify.
+ */
+#define VERIFY_REPORT_LIMIT  16
+
+/*
+ * At most this many runs of mismatching bytes are kept for RetryVerify. A
+ * verify that finds more is not retried.
+ */
+#define VERIFY_MAX_RUNS  32
+
+/*
+ * Times RetryVerify rewrites the runs that still differ before giving up.
+ * Set by -retry.
+ */
+extern int g_verify_retries;
+
+/*
+ * A run of mismatching bytes. "needs_erase" is set if some bit reads as 0
+ * that should be 1, which programming alone cannot fix on flash that can
+ * only clear bits.
+ */
+typedef struct {
+	unsigned int address;
+	unsigned int length;
+	bool needs_erase;
+} VERIFY_RUN;
+
+/*
+ * Compares bytes read back from a target with the bytes that should be
+ * there, for all families. Bits the target does not implement are masked
+ * away using the mask image of the part. Every run of consecutive
+ * mismatching bytes is counted and, if "report" is set, printed; a run may
+ * continue from one call of VerifyBytes to the next. The first
+ * VERIFY_MAX_RUNS runs are kept in "runs", in address order, so that only
+ * they need to be retried.
+ */
+typedef struct {
+	const MASK_IMAGE *mask;
+	unsigned char high_byte_mask;      // For bytes outside the mask image.
+	int address_digits;                // Digits of the addresses printed.
+	bool report;
+	int mismatches;                    // Runs of mismatching bytes so far.
+	bool in_run;
+	unsigned int run_address;
+	unsigned int run_length;
+	unsigned char run_expected;        // First byte of the run, as it should be...
+	unsigned char run_actual;          // ...and as read back.
+	bool run_needs_erase;
+	VERIFY_RUN runs[VERIFY_MAX_RUNS];
+	int number_of_runs;
+} VERIFIER;
+
+/*
+ * Reads "length" bytes from hex file address "address" of the target, such
+ * as the read_memory operation of a family (see Session.h). Addresses and
+ * lengths are multiples of four.
+ */
+typedef bool (*READ_MEMORY)(unsigned int address, unsigned char *buffer, int length);
+
+/*
+ * Reprograms the "count" runs in "runs" from the hex file. Each run is
+ * widened in place to cover all the bytes that were rewritten (such as the
+ * rest of an erased page), so that they are all verified again.
+ */
+typedef bool (*REWRITE_RUNS)(void *context, VERIFY_RUN *runs, int count);
+
+void BeginVerify(VERIFIER *verifier, FAMILY family, const DEVICE *device, bool report);
+bool VerifyBytes(VERIFIER *verifier, unsigned int address, const unsigned char *expected, const unsigned char *actual, unsigned int length);
+bool EndVerify(VERIFIER *verifier);
+bool RetryVerify(VERIFIER *verifier, READ_MEMORY read_memory, REWRITE_RUNS rewrite, void *context);
+
+#endif
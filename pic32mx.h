@@ -4,8 +4,8 @@
  * This software may be modified and distributed under the terms
  * of the MIT license.  See the LICENSE file for details.
  */
-#ifndef PIC32MX220F032B_H
-#define PIC32MX220F032B_H
+#ifndef PIC32MX_H
+#define PIC32MX_H
 
 //
 // This is the (physical) address the device ID can be found at.
@@ -13,14 +13,6 @@
 //
 #define DEVICE_ID_ADDRESS         0xbf80f220
 
-//
-// The four config words locations.
-//
-#define DEVICE_CONFIG_ADDRESS_0   0x1fc00bfc
-#define DEVICE_CONFIG_ADDRESS_1   0x1fc00bf8
-#define DEVICE_CONFIG_ADDRESS_2   0x1fc00bf4
-#define DEVICE_CONFIG_ADDRESS_3   0x1fc00bf0
-
 //
 // The Microchip TAP status register values.
 //
@@ -33,13 +25,11 @@
 #define MCHP_STATUS_UNUSED  0x50
 
 //
-// Locations and sizes of the boot and program flash memory areas and the
-// number of bytes in a "row". A row is used for flash programming.
+// Locations of the boot and program flash memory areas. Their sizes, the
+// number of bytes in a "row" (used for flash programming) and the location
+// of the config words depend on the part; see Devices.cpp.
 //
 #define BFM_START   0x1fc00000
-#define BFM_SIZE        0x0c00  //  3k bytes
 #define PFM_START   0x1d000000
-#define PFM_SIZE      0x020000  //128k bytes
-#define ROW_SIZE        0x0080  // 128 bytes
 
 #endif